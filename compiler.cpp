@@ -0,0 +1,377 @@
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "compiler.h"
+#include "types.h"
+#include "functions.h"
+
+// -----------------------------------------------------------
+// LocalRef
+std::shared_ptr<Type> LocalRef::Evaluate(Context* context) {
+    Context* frame = context;
+    for (size_t i = 0; i < depth; ++i) {
+        frame = frame->parent;
+    }
+    // кадр на depth выше - всегда кадр лямбды, по раскладке которой найден slot: тела циклов,
+    // создающих свои кадры, не компилируются
+    if (frame->slots[slot]) {
+        return frame->slots[slot];
+    }
+    if (auto cell = frame->Find(name)) {
+        return *cell;
+    }
+    if (!frame->parent) {
+        throw NameError("Get() got unknown name");
+    }
+    return frame->parent->Get(name);
+}
+
+// -----------------------------------------------------------
+// LocalSymbol
+LocalSymbol::LocalSymbol(const UnknownSymbol& symbol, size_t depth, size_t slot,
+                         std::shared_ptr<const std::vector<std::string>> layout)
+    : UnknownSymbol(symbol.name), depth(depth), slot(slot), layout(std::move(layout)) {
+    mark = symbol.mark;
+}
+
+std::shared_ptr<Type>* LocalSymbol::Find(Context* context) {
+    Context* frame = context;
+    for (size_t i = 0; frame && i < depth; ++i) {
+        frame = frame->parent;
+    }
+    if (!frame || frame->layout != layout || !frame->slots[slot]) {
+        return nullptr;
+    }
+    return &frame->slots[slot];
+}
+
+std::shared_ptr<Type> LocalSymbol::Evaluate(Context* context) {
+    if (auto cell = Find(context)) {
+        return *cell;
+    }
+    return UnknownSymbol::Evaluate(context);
+}
+
+// -----------------------------------------------------------
+// IfNode
+std::shared_ptr<Type> IfNode::Evaluate(Context* context) {
+    if (Helper::ConvertToBool(condition->Evaluate(context))) {
+        return then_branch->Evaluate(context);
+    }
+    if (!else_branch) {
+        return Pair::EmptyPair();
+    }
+    return else_branch->Evaluate(context);
+}
+
+void IfNode::Children(std::vector<std::shared_ptr<Type>>* out) {
+    out->push_back(condition);
+    out->push_back(then_branch);
+    if (else_branch) {
+        out->push_back(else_branch);
+    }
+}
+
+// -----------------------------------------------------------
+// BuiltinCallNode
+std::shared_ptr<Type> BuiltinCallNode::Evaluate(Context* context) {
+    GarbageCollector::DepthGuard guard(context->collector);
+    std::vector<std::shared_ptr<Type>> values(args.size());
+    for (size_t i = 0; i < args.size(); ++i) {
+        values[i] = args[i]->Evaluate(context);
+    }
+    return func->Call(values, context);
+}
+
+void BuiltinCallNode::Children(std::vector<std::shared_ptr<Type>>* out) {
+    out->push_back(func);
+    out->insert(out->end(), args.begin(), args.end());
+}
+
+// -----------------------------------------------------------
+// CallNode
+std::shared_ptr<Type> CallNode::Evaluate(Context* context) {
+    GarbageCollector::DepthGuard guard(context->collector);
+    auto func = AsType<Function>(op->Evaluate(context));
+    if (!IsType<Lambda>(func)) {
+        return func->Apply(raw_args, context);
+    }
+    std::vector<std::shared_ptr<Type>> values(args.size());
+    for (size_t i = 0; i < args.size(); ++i) {
+        values[i] = args[i]->Evaluate(context);
+    }
+    return func->Call(values, context);
+}
+
+void CallNode::Children(std::vector<std::shared_ptr<Type>>* out) {
+    out->push_back(op);
+    out->insert(out->end(), args.begin(), args.end());
+}
+
+// -----------------------------------------------------------
+// Compiler
+std::shared_ptr<Type> Compiler::Compile(std::shared_ptr<Type> tree) {
+    scopes_.clear();
+    tree_ = false;
+    return CompileExpression(tree);
+}
+
+std::shared_ptr<Type> Compiler::Resolve(std::shared_ptr<Type> tree) {
+    scopes_.clear();
+    tree_ = true;
+    return CompileExpression(tree);
+}
+
+bool Compiler::FindLocal(const std::string& name, size_t* depth, size_t* slot) const {
+    for (*depth = 0; *depth < scopes_.size(); ++*depth) {
+        const auto& scope = *scopes_[scopes_.size() - 1 - *depth];
+        for (*slot = 0; *slot < scope.size(); ++*slot) {
+            if (scope[*slot] == name) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+std::shared_ptr<Type> Compiler::CompileSymbol(std::shared_ptr<Type> symbol) {
+    auto unknown = AsType<UnknownSymbol>(symbol);
+    size_t depth, slot;
+    if (!FindLocal(unknown->name, &depth, &slot)) {
+        // глобальное имя: UnknownSymbol со своим кэшем ячейки
+        return symbol;
+    }
+    if (tree_) {
+        return Make<LocalSymbol>(*unknown, depth, slot, scopes_[scopes_.size() - 1 - depth]);
+    }
+    return Make<LocalRef>(depth, slot, unknown->name);
+}
+
+std::shared_ptr<Type> Compiler::CompileList(std::shared_ptr<Type> list) {
+    auto values = Helper::GetAll(list);
+    bool changed = false;
+    for (auto& value : values) {
+        auto compiled = CompileExpression(value);
+        changed |= compiled != value;
+        value = std::move(compiled);
+    }
+    // Resolve не копирует списки без локальных имён и лямбд
+    if (tree_ && !changed) {
+        return list;
+    }
+    return Pair::MakeList(values);
+}
+
+void Compiler::CollectDefines(std::shared_ptr<Type> body, std::vector<std::string>* names) {
+    std::vector<std::shared_ptr<Type>> nodes{std::move(body)};
+    while (!nodes.empty()) {
+        auto node = std::move(nodes.back());
+        nodes.pop_back();
+        if (IsType<Node>(node)) {
+            AsType<Node>(node)->Children(&nodes);
+            continue;
+        }
+        if (!IsType<Pair>(node) || AsType<Pair>(node)->Empty()) {
+            continue;
+        }
+        auto pair = AsType<Pair>(node);
+        auto op = pair->GetFirst();
+        // вложенные лямбды связывают имена в своих кадрах
+        if (IsType<Quote>(op) || IsType<LambdaCreate>(op)) {
+            continue;
+        }
+        auto args = pair->GetSecond();
+        if ((IsType<Define>(op) || IsType<DefineMemoized>(op)) && IsType<Pair>(args) &&
+            !AsType<Pair>(args)->Empty()) {
+            auto target = AsType<Pair>(args)->GetFirst();
+            if (IsType<UnknownSymbol>(target)) {
+                names->push_back(AsType<UnknownSymbol>(target)->name);
+                nodes.push_back(AsType<Pair>(args)->GetSecond());
+            } else if (IsType<Pair>(target) && !AsType<Pair>(target)->Empty() &&
+                       IsType<UnknownSymbol>(AsType<Pair>(target)->GetFirst())) {
+                names->push_back(AsType<UnknownSymbol>(AsType<Pair>(target)->GetFirst())->name);
+            }
+            continue;
+        }
+        nodes.push_back(op);
+        nodes.push_back(args);
+    }
+}
+
+std::vector<std::string> Compiler::Layout(const std::vector<std::string>& params,
+                                          std::shared_ptr<Type> body) {
+    std::vector<std::string> defines;
+    CollectDefines(std::move(body), &defines);
+    std::sort(defines.begin(), defines.end());
+    defines.erase(std::unique(defines.begin(), defines.end()), defines.end());
+    std::vector<std::string> layout = params;
+    for (auto& name : defines) {
+        if (std::find(params.begin(), params.end(), name) == params.end()) {
+            layout.push_back(std::move(name));
+        }
+    }
+    return layout;
+}
+
+std::shared_ptr<LambdaCreate> Compiler::CompileLambda(std::shared_ptr<Type> params,
+                                                      std::shared_ptr<Type> body) {
+    if (!IsType<Pair>(params) || !AsType<Pair>(params)->ProperList() || !IsType<Pair>(body) ||
+        AsType<Pair>(body)->Empty() || !AsType<Pair>(body)->ProperList()) {
+        return nullptr;
+    }
+    std::vector<std::string> names;
+    for (const auto& param : Helper::GetAll(params)) {
+        if (!IsType<UnknownSymbol>(param)) {
+            return nullptr;
+        }
+        names.push_back(AsType<UnknownSymbol>(param)->name);
+    }
+    auto layout = std::make_shared<const std::vector<std::string>>(Layout(names, body));
+    scopes_.push_back(layout);
+    auto compiled = CompileList(body);
+    scopes_.pop_back();
+    auto create = Make<LambdaCreate>();
+    create->code = Make<LambdaCode>(std::move(names), AsType<Pair>(compiled), std::move(layout));
+    return create;
+}
+
+std::shared_ptr<NamedLet> Compiler::PrepareNamedLet(std::shared_ptr<Type> args) {
+    if (!IsType<Pair>(args) || !AsType<Pair>(args)->ProperList()) {
+        return nullptr;
+    }
+    auto parts = Helper::GetAll(args);
+    if (parts.size() < 3 || !IsType<UnknownSymbol>(parts[0]) || !IsType<Pair>(parts[1]) ||
+        !AsType<Pair>(parts[1])->ProperList()) {
+        return nullptr;
+    }
+    std::vector<std::string> names;
+    for (const auto& binding : Helper::GetAll(parts[1])) {
+        if (!IsType<Pair>(binding) || AsType<Pair>(binding)->Empty() ||
+            !IsType<UnknownSymbol>(AsType<Pair>(binding)->GetFirst())) {
+            return nullptr;
+        }
+        names.push_back(AsType<UnknownSymbol>(AsType<Pair>(binding)->GetFirst())->name);
+    }
+    auto body = AsType<Pair>(AsType<Pair>(AsType<Pair>(args)->GetSecond())->GetSecond());
+    auto let = Make<NamedLet>();
+    let->code = Make<LambdaCode>(std::move(names), body);
+    return let;
+}
+
+std::shared_ptr<Type> Compiler::CompileExpression(std::shared_ptr<Type> expr) {
+    if (IsType<UnknownSymbol>(expr)) {
+        return CompileSymbol(expr);
+    }
+    if (!IsType<Pair>(expr) || AsType<Pair>(expr)->Empty()) {
+        return expr;
+    }
+    auto pair = AsType<Pair>(expr);
+    auto op = pair->GetFirst();
+    auto args = pair->GetSecond();
+    if (IsType<Quote>(op)) {
+        return tree_ ? expr : Make<ConstantNode>(args);
+    }
+    if (IsType<DefineSyntax>(op)) {
+        // правила syntax-rules - данные, а не код
+        return expr;
+    }
+    // циклы создают свой кадр, которого нет в scopes_, и вычисляются деревом
+    if (IsType<Do>(op)) {
+        return expr;
+    }
+    if (IsType<NamedLet>(op)) {
+        auto let = PrepareNamedLet(args);
+        return let ? Make<Pair>(let, args) : expr;
+    }
+    if (!IsType<Pair>(args) || !AsType<Pair>(args)->ProperList()) {
+        return expr;
+    }
+    auto values = Helper::GetAll(args);
+    if (IsType<If>(op)) {
+        if (values.size() != 2 && values.size() != 3) {
+            return expr;
+        }
+        if (tree_) {
+            auto compiled = CompileList(args);
+            return compiled == args ? expr : Make<Pair>(op, compiled);
+        }
+        auto node = Make<IfNode>();
+        node->condition = CompileExpression(values[0]);
+        node->then_branch = CompileExpression(values[1]);
+        if (values.size() == 3) {
+            node->else_branch = CompileExpression(values[2]);
+        }
+        return node;
+    }
+    if (IsType<LambdaCreate>(op)) {
+        if (values.empty()) {
+            return expr;
+        }
+        auto create = CompileLambda(values[0], AsType<Pair>(args)->GetSecond());
+        if (!create) {
+            return expr;
+        }
+        return Make<Pair>(create, Make<Pair>(values[0], create->code->body));
+    }
+    if (IsType<Define>(op) || IsType<DefineMemoized>(op) || IsType<Set>(op)) {
+        if (values.empty()) {
+            return expr;
+        }
+        auto rest = AsType<Pair>(args)->GetSecond();
+        if (!IsType<Pair>(values[0])) {
+            // имя остаётся символом, у set! - со слотом, значение компилируется
+            auto target = values[0];
+            if (IsType<Set>(op) && IsType<UnknownSymbol>(target)) {
+                size_t depth, slot;
+                if (FindLocal(AsType<UnknownSymbol>(target)->name, &depth, &slot)) {
+                    target = Make<LocalSymbol>(*AsType<UnknownSymbol>(target), depth, slot,
+                                               scopes_[scopes_.size() - 1 - depth]);
+                }
+            }
+            auto compiled = CompileList(rest);
+            if (tree_ && target == values[0] && compiled == rest) {
+                return expr;
+            }
+            return Make<Pair>(op, Make<Pair>(target, compiled));
+        }
+        // (define (f args) body)
+        auto target = AsType<Pair>(values[0]);
+        if (IsType<Set>(op) || target->Empty() || !IsType<UnknownSymbol>(target->GetFirst())) {
+            return expr;
+        }
+        auto create = CompileLambda(target->GetSecond(), rest);
+        if (!create) {
+            return expr;
+        }
+        if (IsType<DefineMemoized>(op)) {
+            return Make<Pair>(op, Make<Pair>(target, create->code->body));
+        }
+        auto lambda = Make<Pair>(create, Make<Pair>(target->GetSecond(), create->code->body));
+        return Make<Pair>(op, Pair::MakeList({target->GetFirst(), lambda}));
+    }
+    if (tree_) {
+        auto compiled_op = CompileExpression(op);
+        auto compiled = CompileList(args);
+        return compiled_op == op && compiled == args ? expr : Make<Pair>(compiled_op, compiled);
+    }
+    for (auto& value : values) {
+        value = CompileExpression(value);
+    }
+    if (IsType<IntegerOperation>(op) || IsType<Compare>(op) || IsType<MinMax>(op)) {
+        auto node = Make<BuiltinCallNode>();
+        node->func = AsType<Function>(op);
+        node->args = std::move(values);
+        return node;
+    }
+    if (IsType<Function>(op)) {
+        // остальные встроенные функции разбирают аргументы сами
+        return Make<Pair>(op, Pair::MakeList(values));
+    }
+    auto node = Make<CallNode>();
+    node->op = CompileExpression(op);
+    node->raw_args = args;
+    node->args = std::move(values);
+    return node;
+}
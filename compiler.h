@@ -0,0 +1,153 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "types.h"
+
+struct LambdaCreate;
+struct NamedLet;
+
+// Узел скомпилированного дерева. Форма выражения известна заранее, поэтому Evaluate не
+// разбирает список аргументов при каждом вызове
+struct Node : public Type {
+    std::string Repr() override {
+        return "compiled node";
+    }
+
+    // вложенные выражения, для обходов дерева кода (см. IsPure в functions.cpp)
+    virtual void Children(std::vector<std::shared_ptr<Type>>* out) = 0;
+};
+
+// quote: значение, возвращаемое без вычисления
+struct ConstantNode : public Node {
+    std::shared_ptr<Type> value;
+    // литерал дерева из кэша разбора: возвращается копия, см. LiteralQuote
+    bool copy = false;
+
+    ConstantNode(std::shared_ptr<Type> value) : value(std::move(value)) {
+    }
+
+    std::shared_ptr<Type> Evaluate(Context*) override {
+        return copy ? Pair::CopyData(value) : value;
+    }
+
+    void Children(std::vector<std::shared_ptr<Type>>*) override {
+    }
+};
+
+// Параметр или внутренний define лямбды, объявленный на depth кадров выше текущего, в слоте
+// slot его раскладки. Если define в этом кадре ещё не выполнялся, имя ищется дальше, как в
+// UnknownSymbol
+struct LocalRef : public Node {
+    size_t depth;
+    size_t slot;
+    std::string name;
+
+    LocalRef(size_t depth, size_t slot, std::string name)
+        : depth(depth), slot(slot), name(std::move(name)) {
+    }
+
+    std::shared_ptr<Type> Evaluate(Context* context) override;
+
+    void Children(std::vector<std::shared_ptr<Type>>*) override {
+    }
+};
+
+// Локальное имя для дерева без компиляции (см. Compiler::Resolve): символ с заранее найденным
+// слотом. Кадр на depth выше должен иметь раскладку layout, иначе (символ попал в другое место
+// через макрос, раскрытый при вычислении) или при пустом слоте имя ищется как UnknownSymbol
+struct LocalSymbol : public UnknownSymbol {
+    size_t depth;
+    size_t slot;
+    std::shared_ptr<const std::vector<std::string>> layout;
+
+    LocalSymbol(const UnknownSymbol& symbol, size_t depth, size_t slot,
+                std::shared_ptr<const std::vector<std::string>> layout);
+
+    // заполненный слот, nullptr - искать по имени
+    std::shared_ptr<Type>* Find(Context* context);
+
+    std::shared_ptr<Type> Evaluate(Context* context) override;
+};
+
+struct IfNode : public Node {
+    std::shared_ptr<Type> condition;
+    std::shared_ptr<Type> then_branch;
+    // nullptr - ветки нет
+    std::shared_ptr<Type> else_branch;
+
+    std::shared_ptr<Type> Evaluate(Context* context) override;
+
+    void Children(std::vector<std::shared_ptr<Type>>* out) override;
+};
+
+// Вызов встроенной функции, которая вычисляет все аргументы: аргументы передаются в
+// Function::Call без обёртки в список
+struct BuiltinCallNode : public Node {
+    std::shared_ptr<Function> func;
+    std::vector<std::shared_ptr<Type>> args;
+
+    std::shared_ptr<Type> Evaluate(Context* context) override;
+
+    void Children(std::vector<std::shared_ptr<Type>>* out) override;
+};
+
+// Вызов функции, известной только во время исполнения. Лямбда получает вычисленные
+// аргументы через Call, остальные функции (особые формы, связанные с другим именем, и
+// макросы, определённые после компиляции) - исходный некомпилированный список через Apply
+struct CallNode : public Node {
+    std::shared_ptr<Type> op;
+    std::vector<std::shared_ptr<Type>> args;
+    std::shared_ptr<Type> raw_args;
+
+    std::shared_ptr<Type> Evaluate(Context* context) override;
+
+    void Children(std::vector<std::shared_ptr<Type>>* out) override;
+};
+
+// Компилирует дерево после Optimizer в дерево узлов. Особые формы define, set! и lambda
+// остаются списками, но вычисляемые части внутри них компилируются; форма lambda получает
+// свой LambdaCreate с LambdaCode, общим для всех её замыканий, а (define (f args) body)
+// становится (define f (lambda args body)). Выражения, форму которых нельзя проверить заранее
+// (неверное число аргументов if, несобственные списки), остаются как есть и при вычислении
+// дают те же ошибки, что и без компиляции
+class Compiler {
+private:
+    // раскладки кадров лямбд, внутренний - последний
+    std::vector<std::shared_ptr<const std::vector<std::string>>> scopes_;
+    // Resolve: списки не заменяются узлами, локальные имена становятся LocalSymbol
+    bool tree_ = false;
+
+    std::shared_ptr<Type> CompileExpression(std::shared_ptr<Type> expr);
+
+    // false - имя не локальное
+    bool FindLocal(const std::string& name, size_t* depth, size_t* slot) const;
+
+    std::shared_ptr<Type> CompileSymbol(std::shared_ptr<Type> symbol);
+
+    std::shared_ptr<Type> CompileList(std::shared_ptr<Type> list);
+
+    // (params . body) лямбды или define функции; nullptr - форма неверна
+    std::shared_ptr<LambdaCreate> CompileLambda(std::shared_ptr<Type> params,
+                                                std::shared_ptr<Type> body);
+
+    // args формы named-let; nullptr - форма неверна
+    std::shared_ptr<NamedLet> PrepareNamedLet(std::shared_ptr<Type> args);
+
+    static void CollectDefines(std::shared_ptr<Type> body, std::vector<std::string>* names);
+
+public:
+    std::shared_ptr<Type> Compile(std::shared_ptr<Type> tree);
+
+    // Для вычисления без компиляции: дерево остаётся списками, но локальные имена заранее
+    // связываются со слотами кадров, а формы lambda получают общий LambdaCode
+    std::shared_ptr<Type> Resolve(std::shared_ptr<Type> tree);
+
+    // Раскладка кадра лямбды: параметры по порядку, затем имена внутренних define по алфавиту.
+    // Для исходного и скомпилированного тела раскладка одна и та же, поэтому LocalRef может
+    // обращаться к слоту по номеру
+    static std::vector<std::string> Layout(const std::vector<std::string>& params,
+                                           std::shared_ptr<Type> body);
+};
@@ -23,6 +23,9 @@ FunctionFactory::FunctionFactory() {
     AddFunction<Min>();
     AddFunction<Max>();
     AddFunction<Abs>();
+    AddFunction<Sum>();
+    AddFunction<Product>();
+    AddFunction<ApplyFunc>();
     AddFunction<PairPred>();
     AddFunction<NullPred>();
     AddFunction<ListPred>();
@@ -32,6 +35,15 @@ FunctionFactory::FunctionFactory() {
     AddFunction<List>();
     AddFunction<ListRef>();
     AddFunction<ListTail>();
+    AddFunction<Map>();
+    AddFunction<Filter>();
+    AddFunction<Fold>();
+    AddFunction<Append>();
+    AddFunction<Reverse>();
+    AddFunction<Length>();
+    AddFunction<Assoc>();
+    AddFunction<Member>();
+    AddFunction<PMap>();
     AddFunction<SymbolPred>();
     AddFunction<Define>();
     AddFunction<Set>();
@@ -39,13 +51,24 @@ FunctionFactory::FunctionFactory() {
     AddFunction<SetCar>();
     AddFunction<SetCdr>();
     AddFunction<LambdaCreate>();
+    AddFunction<Memoize>();
+    AddFunction<DefineMemoized>();
+    AddFunction<Begin>();
+    AddFunction<Do>();
+    AddFunction<NamedLet>();
+    AddFunction<DefineSyntax>();
+    AddFunction<CallCC>();
+    AddFunction<CallCC>("call-with-current-continuation");
+    AddFunction<GetRuntimeStats>();
 }
 
 std::shared_ptr<Function> FunctionFactory::GetFunction(const std::string& name) {
-    if (!map_.contains(name)) {
+    // без operator[]: Interpreter::ReadFile разбирает данные в нескольких потоках
+    auto it = map_.find(name);
+    if (it == map_.end()) {
         throw RuntimeError("Function not found");
     }
-    return map_[name];
+    return it->second;
 }
 
 bool FunctionFactory::HasFunction(const std::string& name) {
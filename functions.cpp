@@ -1,7 +1,236 @@
+#include <algorithm>
+#include <cstdint>
 #include <memory>
+#include <unordered_set>
+#include <utility>
 
 #include "types.h"
 #include "functions.h"
+#include "thread_pool.h"
+#include "compiler.h"
+
+namespace {
+
+// Свёртки по непрерывному буферу. Циклы без ветвлений в теле компилятор векторизует,
+// а переполнение проверяется по результату, накопленному в int64_t
+int SumKernel(const std::vector<int>& values) {
+    int64_t total = 0;
+    for (int value : values) {
+        total += value;
+    }
+    return CheckedInt(total);
+}
+
+// Без нулей модуль произведения не убывает, поэтому переполнение промежуточного результата -
+// это переполнение итогового. Флаг переполнения int64_t накапливается без ветвлений
+int ProductKernel(const std::vector<int>& values) {
+    if (std::find(values.begin(), values.end(), 0) != values.end()) {
+        return 0;
+    }
+    int64_t total = 1;
+    bool overflow = false;
+    for (int value : values) {
+        overflow |= __builtin_mul_overflow(total, value, &total);
+    }
+    if (overflow) {
+        throw RuntimeError("Integer overflow");
+    }
+    return CheckedInt(total);
+}
+
+int MinKernel(const std::vector<int>& values) {
+    int result = values[0];
+    for (int value : values) {
+        result = std::min(result, value);
+    }
+    return result;
+}
+
+int MaxKernel(const std::vector<int>& values) {
+    int result = values[0];
+    for (int value : values) {
+        result = std::max(result, value);
+    }
+    return result;
+}
+
+std::vector<int> EvaluateIntegers(std::shared_ptr<Type> arg, Context* context) {
+    auto args = Helper::GetAll(arg);
+    std::vector<int> values(args.size());
+    for (size_t i = 0; i < args.size(); ++i) {
+        values[i] = AsType<Integer>(args[i]->Evaluate(context))->GetValue();
+    }
+    return values;
+}
+
+// Можно ли вычислять func в нескольких потоках: в телах лямбд (и глобальных лямбд, которые
+// они вызывают) нет изменения общих данных. Функции, полученные через аргументы и списки,
+// проверка не видит, их ловит Helper::CheckExclusive во время вызова
+bool IsPure(std::shared_ptr<Function> func) {
+    std::vector<std::shared_ptr<Lambda>> lambdas;
+    std::unordered_set<Lambda*> seen;
+    auto add_function = [&](const std::shared_ptr<Type>& value) {
+        // кэш memoize изменяется при каждом вызове, а раскрытие макроса может дать что угодно
+        if (IsType<Set>(value) || IsType<SetCar>(value) || IsType<SetCdr>(value) ||
+            IsType<Memoized>(value) || IsType<Macro>(value)) {
+            return false;
+        }
+        if (IsType<Lambda>(value) && seen.insert(AsType<Lambda>(value).get()).second) {
+            lambdas.push_back(AsType<Lambda>(value));
+        }
+        return true;
+    };
+    if (!add_function(func)) {
+        return false;
+    }
+    while (!lambdas.empty()) {
+        auto lambda = lambdas.back();
+        lambdas.pop_back();
+        std::vector<std::shared_ptr<Type>> nodes = lambda->code->body_lines;
+        while (!nodes.empty()) {
+            auto node = nodes.back();
+            nodes.pop_back();
+            if (IsType<UnknownSymbol>(node)) {
+                const std::string& name = AsType<UnknownSymbol>(node)->name;
+                // не найдено - параметр или ещё не определённое имя
+                auto cell = lambda->created_context->Lookup(name);
+                if (cell && !add_function(*cell)) {
+                    return false;
+                }
+                continue;
+            }
+            if (IsType<Node>(node)) {
+                AsType<Node>(node)->Children(&nodes);
+                continue;
+            }
+            if (!IsType<Pair>(node) || AsType<Pair>(node)->Empty()) {
+                if (!add_function(node)) {
+                    return false;
+                }
+                continue;
+            }
+            auto pair = AsType<Pair>(node);
+            if (IsType<Quote>(pair->GetFirst())) {
+                continue;
+            }
+            nodes.push_back(pair->GetFirst());
+            nodes.push_back(pair->GetSecond());
+        }
+    }
+    return true;
+}
+
+// ячейка через count шагов по cdr; список держит вызывающий
+Pair* Advance(Pair* cell, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        cell = dynamic_cast<Pair*>(cell->PeekSecond());
+        if (!cell) {
+            throw RuntimeError("list index out of range");
+        }
+    }
+    return cell;
+}
+
+// Может ли вычисление exprs создать замыкание, захватывающее текущий кадр
+bool CreatesClosures(const std::vector<std::shared_ptr<Type>>& exprs) {
+    std::vector<std::shared_ptr<Type>> nodes = exprs;
+    while (!nodes.empty()) {
+        auto node = std::move(nodes.back());
+        nodes.pop_back();
+        if (IsType<Node>(node)) {
+            AsType<Node>(node)->Children(&nodes);
+            continue;
+        }
+        if (!IsType<Pair>(node) || AsType<Pair>(node)->Empty()) {
+            continue;
+        }
+        auto pair = AsType<Pair>(node);
+        auto op = pair->GetFirst();
+        if (IsType<Quote>(op)) {
+            continue;
+        }
+        if (IsType<LambdaCreate>(op) || IsType<DefineMemoized>(op) || IsType<NamedLet>(op) ||
+            IsType<DefineSyntax>(op)) {
+            return true;
+        }
+        auto args = pair->GetSecond();
+        if (IsType<Define>(op) && IsType<Pair>(args) && !AsType<Pair>(args)->Empty() &&
+            IsType<Pair>(AsType<Pair>(args)->GetFirst())) {
+            return true;
+        }
+        nodes.push_back(op);
+        nodes.push_back(args);
+    }
+    return false;
+}
+
+bool IsCallOf(const std::shared_ptr<Type>& op, const std::string& name) {
+    return IsType<UnknownSymbol>(op) && AsType<UnknownSymbol>(op)->name == name;
+}
+
+// Тело именованного let можно выполнять циклом: name встречается только как оператор вызова
+// в хвостовой позиции (через if и begin), а замыкания не создаются
+bool IsLoopBody(const std::string& name, const std::vector<std::shared_ptr<Type>>& body) {
+    if (CreatesClosures(body)) {
+        return false;
+    }
+    std::vector<std::pair<std::shared_ptr<Type>, bool>> nodes;
+    for (size_t i = 0; i < body.size(); ++i) {
+        nodes.emplace_back(body[i], i + 1 == body.size());
+    }
+    while (!nodes.empty()) {
+        auto [node, tail] = std::move(nodes.back());
+        nodes.pop_back();
+        if (IsCallOf(node, name)) {
+            return false;
+        }
+        if (!IsType<Pair>(node) || AsType<Pair>(node)->Empty()) {
+            continue;
+        }
+        auto pair = AsType<Pair>(node);
+        auto op = pair->GetFirst();
+        auto args = pair->GetSecond();
+        if (IsType<Quote>(op)) {
+            continue;
+        }
+        bool proper = IsType<Pair>(args) && AsType<Pair>(args)->ProperList();
+        if (IsType<If>(op) || IsType<Begin>(op) || IsCallOf(op, name)) {
+            if (!proper) {
+                return false;
+            }
+            auto values = Helper::GetAll(args);
+            if (IsType<If>(op) && values.size() != 2 && values.size() != 3) {
+                return false;
+            }
+            if (IsType<Begin>(op) && values.empty()) {
+                return false;
+            }
+            if (IsCallOf(op, name) && !tail) {
+                return false;
+            }
+            for (size_t i = 0; i < values.size(); ++i) {
+                bool value_tail = false;
+                if (IsType<If>(op)) {
+                    value_tail = tail && i > 0;
+                } else if (IsType<Begin>(op)) {
+                    value_tail = tail && i + 1 == values.size();
+                }
+                nodes.emplace_back(values[i], value_tail);
+            }
+            continue;
+        }
+        if ((IsType<Define>(op) || IsType<Set>(op)) && proper && !AsType<Pair>(args)->Empty() &&
+            IsCallOf(AsType<Pair>(args)->GetFirst(), name)) {
+            return false;
+        }
+        nodes.emplace_back(op, false);
+        nodes.emplace_back(args, false);
+    }
+    return true;
+}
+
+
+}  // namespace
 
 // -----------------------------------------------------------
 // Quote
@@ -9,25 +238,31 @@ std::shared_ptr<Type> Quote::Apply(std::shared_ptr<Type> arg, Context*) {
     return arg;
 }
 
+// -----------------------------------------------------------
+// LiteralQuote
+std::shared_ptr<Type> LiteralQuote::Apply(std::shared_ptr<Type> arg, Context*) {
+    return Pair::CopyData(arg);
+}
+
 // -----------------------------------------------------------
 // BooleanPred
 std::shared_ptr<Type> BooleanPred::Apply(std::shared_ptr<Type> arg, Context* context) {
     arg = Helper::GetOneEvaluated(arg, context);
-    return std::make_shared<Bool>(IsType<Bool>(arg));
+    return Make<Bool>(IsType<Bool>(arg));
 }
 
 // -----------------------------------------------------------
 // Not
 std::shared_ptr<Type> Not::Apply(std::shared_ptr<Type> arg, Context* context) {
     arg = Helper::GetOneEvaluated(arg, context);
-    return std::make_shared<Bool>(!(Helper::ConvertToBool(arg)));
+    return Make<Bool>(!(Helper::ConvertToBool(arg)));
 }
 
 // -----------------------------------------------------------
 // And
 std::shared_ptr<Type> And::Apply(std::shared_ptr<Type> arg, Context* context) {
     auto args = Helper::GetAll(arg);
-    arg = std::make_shared<Bool>(true);
+    arg = Make<Bool>(true);
     for (size_t i = 0; i < args.size(); ++i) {
         arg = args[i]->Evaluate(context);
         if (!Helper::ConvertToBool(arg)) {
@@ -41,7 +276,7 @@ std::shared_ptr<Type> And::Apply(std::shared_ptr<Type> arg, Context* context) {
 // Or
 std::shared_ptr<Type> Or::Apply(std::shared_ptr<Type> arg, Context* context) {
     auto args = Helper::GetAll(arg);
-    arg = std::make_shared<Bool>(false);
+    arg = Make<Bool>(false);
     for (size_t i = 0; i < args.size(); ++i) {
         arg = args[i]->Evaluate(context);
         if (Helper::ConvertToBool(arg)) {
@@ -55,36 +290,51 @@ std::shared_ptr<Type> Or::Apply(std::shared_ptr<Type> arg, Context* context) {
 // NumberPred
 std::shared_ptr<Type> NumberPred::Apply(std::shared_ptr<Type> arg, Context* context) {
     arg = Helper::GetOneEvaluated(arg, context);
-    return std::make_shared<Bool>(IsType<Integer>(arg));
+    return Make<Bool>(IsType<Integer>(arg));
 }
 
 // -----------------------------------------------------------
 // IntegerOperation
-std::shared_ptr<Type> IntegerOperation::Apply(std::shared_ptr<Type> arg, Context* context) {
-    auto args = Helper::GetAll(arg);
-    std::shared_ptr<Integer> result = FirstElem();
+int IntegerOperation::Reduce(const std::vector<int>& values) {
+    int result = FirstElem();
     size_t start_ind = 0;
     // нет начального значения
-    if (result->GetValue() == -1) {
-        if (args.size() < 2) {
+    if (result == -1) {
+        if (values.size() < 2) {
             throw RuntimeError("Too few arguments for IntegerOperation");
         }
-        result = Operation(AsType<Integer>(args[0]->Evaluate(context)),
-                           AsType<Integer>(args[1]->Evaluate(context)));
+        result = Operation(values[0], values[1]);
         start_ind = 2;
     }
-    for (size_t i = start_ind; i < args.size(); ++i) {
-        result = Operation(result, AsType<Integer>(args[i]->Evaluate(context)));
+    for (size_t i = start_ind; i < values.size(); ++i) {
+        result = Operation(result, values[i]);
     }
     return result;
 }
 
+std::shared_ptr<Type> IntegerOperation::Apply(std::shared_ptr<Type> arg, Context* context) {
+    return Make<Integer>(Reduce(EvaluateIntegers(arg, context)));
+}
+
+std::shared_ptr<Type> IntegerOperation::Call(const std::vector<std::shared_ptr<Type>>& values,
+                                             Context*) {
+    return Make<Integer>(Reduce(Helper::GetIntegers(values)));
+}
+
+int Addition::Reduce(const std::vector<int>& values) {
+    return SumKernel(values);
+}
+
+int Multiplication::Reduce(const std::vector<int>& values) {
+    return ProductKernel(values);
+}
+
 // -----------------------------------------------------------
 // Compare
 std::shared_ptr<Type> Compare::Apply(std::shared_ptr<Type> arg, Context* context) {
     auto args = Helper::GetAll(arg);
     if (args.empty()) {
-        return std::make_shared<Bool>(true);
+        return Make<Bool>(true);
     }
     if (args.size() == 1) {
         throw RuntimeError("Compare 1 element");
@@ -92,52 +342,108 @@ std::shared_ptr<Type> Compare::Apply(std::shared_ptr<Type> arg, Context* context
     for (size_t i = 0; i < args.size() - 1; ++i) {
         if (!Comparator(AsType<Integer>(args[i]->Evaluate(context)),
                         AsType<Integer>(args[i + 1]->Evaluate(context)))) {
-            return std::make_shared<Bool>(false);
+            return Make<Bool>(false);
         }
     }
-    return std::make_shared<Bool>(true);
+    return Make<Bool>(true);
+}
+
+std::shared_ptr<Type> Compare::Call(const std::vector<std::shared_ptr<Type>>& values, Context*) {
+    if (values.size() == 1) {
+        throw RuntimeError("Compare 1 element");
+    }
+    for (size_t i = 0; i + 1 < values.size(); ++i) {
+        if (!Comparator(AsType<Integer>(values[i]), AsType<Integer>(values[i + 1]))) {
+            return Make<Bool>(false);
+        }
+    }
+    return Make<Bool>(true);
 }
 
 // -----------------------------------------------------------
 // MinMax
 std::shared_ptr<Type> MinMax::Apply(std::shared_ptr<Type> arg, Context* context) {
-    auto args = Helper::GetAll(arg);
-    if (args.empty()) {
+    auto values = EvaluateIntegers(arg, context);
+    if (values.empty()) {
         throw RuntimeError("Empty args in MinMax");
     }
-    std::shared_ptr<Integer> result = AsType<Integer>(args[0]->Evaluate(context));
-    for (size_t i = 1; i < args.size(); ++i) {
-        result = Operation(result, AsType<Integer>(args[i]->Evaluate(context)));
+    return Make<Integer>(Reduce(values));
+}
+
+std::shared_ptr<Type> MinMax::Call(const std::vector<std::shared_ptr<Type>>& values, Context*) {
+    if (values.empty()) {
+        throw RuntimeError("Empty args in MinMax");
     }
-    return result;
+    return Make<Integer>(Reduce(Helper::GetIntegers(values)));
+}
+
+int Min::Reduce(const std::vector<int>& values) {
+    return MinKernel(values);
+}
+
+int Max::Reduce(const std::vector<int>& values) {
+    return MaxKernel(values);
+}
+
+// -----------------------------------------------------------
+// Sum
+std::shared_ptr<Type> Sum::Apply(std::shared_ptr<Type> arg, Context* context) {
+    arg = Helper::GetOneEvaluated(arg, context);
+    return Make<Integer>(SumKernel(Helper::GetIntegers(arg)));
+}
+
+// -----------------------------------------------------------
+// Product
+std::shared_ptr<Type> Product::Apply(std::shared_ptr<Type> arg, Context* context) {
+    arg = Helper::GetOneEvaluated(arg, context);
+    return Make<Integer>(ProductKernel(Helper::GetIntegers(arg)));
+}
+
+// -----------------------------------------------------------
+// ApplyFunc
+std::shared_ptr<Type> ApplyFunc::Apply(std::shared_ptr<Type> arg, Context* context) {
+    auto args = Helper::GetAll(arg);
+    if (args.size() < 2) {
+        throw RuntimeError("apply takes a function and a list");
+    }
+    auto func = AsType<Function>(args[0]->Evaluate(context));
+    std::vector<std::shared_ptr<Type>> values;
+    for (size_t i = 1; i + 1 < args.size(); ++i) {
+        values.push_back(args[i]->Evaluate(context));
+    }
+    for (auto& elem : Helper::GetAll(args.back()->Evaluate(context))) {
+        values.push_back(std::move(elem));
+    }
+    return func->Call(values, context);
 }
 
 // -----------------------------------------------------------
 // Abs
 std::shared_ptr<Type> Abs::Apply(std::shared_ptr<Type> arg, Context* context) {
     arg = Helper::GetOneEvaluated(arg, context);
-    return std::make_shared<Integer>(std::abs(AsType<Integer>(arg)->GetValue()));
+    int64_t value = AsType<Integer>(arg)->GetValue();
+    return Make<Integer>(CheckedInt(std::abs(value)));
 }
 
 // -----------------------------------------------------------
 // PairPred
 std::shared_ptr<Type> PairPred::Apply(std::shared_ptr<Type> arg, Context* context) {
     arg = Helper::GetOneEvaluated(arg, context);
-    return std::make_shared<Bool>(IsType<Pair>(arg) && !AsType<Pair>(arg)->Empty());
+    return Make<Bool>(IsType<Pair>(arg) && !AsType<Pair>(arg)->Empty());
 }
 
 // -----------------------------------------------------------
 // NullPred
 std::shared_ptr<Type> NullPred::Apply(std::shared_ptr<Type> arg, Context* context) {
     arg = Helper::GetOneEvaluated(arg, context);
-    return std::make_shared<Bool>(IsType<Pair>(arg) && AsType<Pair>(arg)->Empty());
+    return Make<Bool>(IsType<Pair>(arg) && AsType<Pair>(arg)->Empty());
 }
 
 // -----------------------------------------------------------
 // ListPred
 std::shared_ptr<Type> ListPred::Apply(std::shared_ptr<Type> arg, Context* context) {
     arg = Helper::GetOneEvaluated(arg, context);
-    return std::make_shared<Bool>(IsType<Pair>(arg) && AsType<Pair>(arg)->ProperList());
+    return Make<Bool>(IsType<Pair>(arg) && AsType<Pair>(arg)->ProperList());
 }
 
 // -----------------------------------------------------------
@@ -147,7 +453,7 @@ std::shared_ptr<Type> Cons::Apply(std::shared_ptr<Type> arg, Context* context) {
     if (args.size() != 2) {
         throw RuntimeError("Cons take 2 arguments");
     }
-    return std::make_shared<Pair>(args[0]->Evaluate(context), args[1]->Evaluate(context));
+    return Make<Pair>(args[0]->Evaluate(context), args[1]->Evaluate(context));
 }
 
 // -----------------------------------------------------------
@@ -168,16 +474,10 @@ std::shared_ptr<Type> Cdr::Apply(std::shared_ptr<Type> arg, Context* context) {
 // List
 std::shared_ptr<Type> List::Apply(std::shared_ptr<Type> arg, Context* context) {
     auto args = Helper::GetAll(arg);
-    if (args.empty()) {
-        return Pair::EmptyPair();
-    }
-    auto ret_val = std::make_shared<Pair>(args[0]->Evaluate(context), Pair::EmptyPair());
-    auto curr = ret_val;
-    for (size_t i = 1; i < args.size(); ++i) {
-        curr->SetSecond(std::make_shared<Pair>(args[i]->Evaluate(context), Pair::EmptyPair()));
-        curr = AsType<Pair>(curr->GetSecond());
+    for (auto& elem : args) {
+        elem = elem->Evaluate(context);
     }
-    return ret_val;
+    return Pair::MakeCompactList(args);
 }
 
 // -----------------------------------------------------------
@@ -189,10 +489,10 @@ std::shared_ptr<Type> ListRef::Apply(std::shared_ptr<Type> arg, Context* context
     }
     auto list = AsType<Pair>(args[0]->Evaluate(context));
     size_t index = AsType<Integer>(args[1]->Evaluate(context))->GetValue();
-    for (size_t i = 0; i < index; ++i) {
-        list = AsType<Pair>(list->GetSecond());
+    if (list->ProperList() && index >= list->Length()) {
+        throw RuntimeError("list index out of range");
     }
-    return list->GetFirst();
+    return Advance(list.get(), index)->GetFirst();
 }
 
 // -----------------------------------------------------------
@@ -204,17 +504,453 @@ std::shared_ptr<Type> ListTail::Apply(std::shared_ptr<Type> arg, Context* contex
     }
     auto list = AsType<Pair>(args[0]->Evaluate(context));
     size_t index = AsType<Integer>(args[1]->Evaluate(context))->GetValue();
-    for (size_t i = 0; i < index; ++i) {
-        list = AsType<Pair>(list->GetSecond());
+    if (list->ProperList() && index > list->Length()) {
+        throw RuntimeError("list index out of range");
+    }
+    return Advance(list.get(), index)->Self();
+}
+
+// -----------------------------------------------------------
+// Map
+std::shared_ptr<Type> Map::Apply(std::shared_ptr<Type> arg, Context* context) {
+    auto args = Helper::GetAll(arg);
+    if (args.size() < 2) {
+        throw RuntimeError("map takes a function and at least one list");
+    }
+    auto func = AsType<Function>(args[0]->Evaluate(context));
+    std::vector<std::vector<std::shared_ptr<Type>>> lists;
+    size_t length = SIZE_MAX;
+    for (size_t i = 1; i < args.size(); ++i) {
+        lists.push_back(Helper::GetAll(args[i]->Evaluate(context)));
+        length = std::min(length, lists.back().size());
+    }
+    std::vector<std::shared_ptr<Type>> result(length);
+    std::vector<std::shared_ptr<Type>> values(lists.size());
+    for (size_t i = 0; i < length; ++i) {
+        for (size_t j = 0; j < lists.size(); ++j) {
+            values[j] = lists[j][i];
+        }
+        result[i] = func->Call(values, context);
+    }
+    return Pair::MakeCompactList(result);
+}
+
+// -----------------------------------------------------------
+// Filter
+std::shared_ptr<Type> Filter::Apply(std::shared_ptr<Type> arg, Context* context) {
+    auto args = Helper::GetAll(arg);
+    if (args.size() != 2) {
+        throw RuntimeError("filter takes 2 arguments");
+    }
+    auto func = AsType<Function>(args[0]->Evaluate(context));
+    std::vector<std::shared_ptr<Type>> result;
+    std::vector<std::shared_ptr<Type>> values(1);
+    for (auto& elem : Helper::GetAll(args[1]->Evaluate(context))) {
+        values[0] = elem;
+        if (Helper::ConvertToBool(func->Call(values, context))) {
+            result.push_back(std::move(elem));
+        }
+    }
+    return Pair::MakeCompactList(result);
+}
+
+// -----------------------------------------------------------
+// Fold
+std::shared_ptr<Type> Fold::Apply(std::shared_ptr<Type> arg, Context* context) {
+    auto args = Helper::GetAll(arg);
+    if (args.size() != 3) {
+        throw RuntimeError("fold takes 3 arguments");
+    }
+    auto func = AsType<Function>(args[0]->Evaluate(context));
+    auto acc = args[1]->Evaluate(context);
+    std::vector<std::shared_ptr<Type>> values(2);
+    for (auto& elem : Helper::GetAll(args[2]->Evaluate(context))) {
+        values[0] = std::move(elem);
+        values[1] = std::move(acc);
+        acc = func->Call(values, context);
+    }
+    return acc;
+}
+
+// -----------------------------------------------------------
+// Append
+std::shared_ptr<Type> Append::Apply(std::shared_ptr<Type> arg, Context* context) {
+    auto args = Helper::GetAll(arg);
+    if (args.empty()) {
+        return Pair::EmptyPair();
+    }
+    std::vector<std::shared_ptr<Type>> elems;
+    for (size_t i = 0; i + 1 < args.size(); ++i) {
+        for (auto& elem : Helper::GetAll(args[i]->Evaluate(context))) {
+            elems.push_back(std::move(elem));
+        }
+    }
+    return Pair::MakeCompactList(elems, args.back()->Evaluate(context));
+}
+
+// -----------------------------------------------------------
+// Reverse
+std::shared_ptr<Type> Reverse::Apply(std::shared_ptr<Type> arg, Context* context) {
+    auto elems = Helper::GetAll(Helper::GetOneEvaluated(arg, context));
+    std::reverse(elems.begin(), elems.end());
+    return Pair::MakeCompactList(elems);
+}
+
+// -----------------------------------------------------------
+// Length
+std::shared_ptr<Type> Length::Apply(std::shared_ptr<Type> arg, Context* context) {
+    auto list = AsType<Pair>(Helper::GetOneEvaluated(arg, context));
+    if (!list->ProperList()) {
+        throw RuntimeError("length got not proper list");
+    }
+    return Make<Integer>(list->Length());
+}
+
+// -----------------------------------------------------------
+// Assoc
+std::shared_ptr<Type> Assoc::Apply(std::shared_ptr<Type> arg, Context* context) {
+    auto args = Helper::GetAll(arg);
+    if (args.size() != 2) {
+        throw RuntimeError("assoc takes 2 arguments");
+    }
+    auto key = args[0]->Evaluate(context);
+    for (auto& entry : Helper::GetAll(args[1]->Evaluate(context))) {
+        if (Helper::Equal(key, AsType<Pair>(entry)->GetFirst())) {
+            return entry;
+        }
+    }
+    return Make<Bool>(false);
+}
+
+// -----------------------------------------------------------
+// Member
+std::shared_ptr<Type> Member::Apply(std::shared_ptr<Type> arg, Context* context) {
+    auto args = Helper::GetAll(arg);
+    if (args.size() != 2) {
+        throw RuntimeError("member takes 2 arguments");
+    }
+    auto value = args[0]->Evaluate(context);
+    auto list = AsType<Pair>(args[1]->Evaluate(context));
+    // список держит list, поэтому ячейки можно обходить по сырым указателям
+    for (Pair* cell = list.get(); !cell->Empty();) {
+        if (Helper::Equal(value, cell->GetFirst())) {
+            return cell->Self();
+        }
+        cell = dynamic_cast<Pair*>(cell->PeekSecond());
+        if (!cell) {
+            throw RuntimeError("member got not proper list");
+        }
+    }
+    return Make<Bool>(false);
+}
+
+// -----------------------------------------------------------
+// PMap
+std::shared_ptr<Type> PMap::Apply(std::shared_ptr<Type> arg, Context* context) {
+    auto args = Helper::GetAll(arg);
+    if (args.size() != 2) {
+        throw RuntimeError("pmap takes 2 arguments");
+    }
+    auto func = AsType<Function>(args[0]->Evaluate(context));
+    auto elems = Helper::GetAll(args[1]->Evaluate(context));
+    std::vector<std::shared_ptr<Type>> result(elems.size());
+    auto run_serial = [&] {
+        std::vector<std::shared_ptr<Type>> values(1);
+        for (size_t i = 0; i < elems.size(); ++i) {
+            values[0] = elems[i];
+            result[i] = func->Call(values, context);
+        }
+        return Pair::MakeCompactList(result);
+    };
+    ThreadPool& pool = ThreadPool::Shared();
+    // потоки пула не тратили бы топливо вычисления с бюджетом, поэтому оно идёт последовательно
+    if (elems.size() < 2 || pool.Concurrency() == 1 || !IsPure(func) ||
+        context->collector->HasFuel()) {
+        return run_serial();
+    }
+    // несколько частей на поток, чтобы выровнять нагрузку
+    size_t chunks = std::min(elems.size(), pool.Concurrency() * 4);
+    std::vector<std::unique_ptr<GarbageCollector>> collectors(chunks);
+    GarbageCollector* owner = context->collector->Owner();
+    auto adopt = [&] {
+        for (auto& collector : collectors) {
+            if (collector) {
+                context->collector->Adopt(*collector);
+            }
+        }
+    };
+    try {
+        pool.ParallelFor(chunks, [&](size_t chunk) {
+            collectors[chunk] = std::make_unique<GarbageCollector>(owner);
+            Context* worker_context = collectors[chunk]->GetRoot();
+            std::vector<std::shared_ptr<Type>> values(1);
+            size_t begin = elems.size() * chunk / chunks;
+            size_t end = elems.size() * (chunk + 1) / chunks;
+            for (size_t i = begin; i < end; ++i) {
+                values[0] = elems[i];
+                result[i] = func->Call(values, worker_context);
+            }
+        });
+    } catch (const SharedMutation&) {
+        // до изменения потоки только читали общие данные, поэтому всё вычисляется заново
+        adopt();
+        return run_serial();
+    } catch (...) {
+        adopt();
+        throw;
+    }
+    adopt();
+    return Pair::MakeCompactList(result);
+}
+
+// -----------------------------------------------------------
+// Continuation
+std::shared_ptr<Type> Continuation::Apply(std::shared_ptr<Type> arg, Context* context) {
+    auto value = Helper::GetOneEvaluated(arg, context);
+    if (!active) {
+        throw RuntimeError("Continuation is called after its call/cc returned");
+    }
+    throw ContinuationJump{this, value};
+}
+
+// -----------------------------------------------------------
+// CallCC
+std::shared_ptr<Type> CallCC::Apply(std::shared_ptr<Type> arg, Context* context) {
+    auto func = AsType<Function>(Helper::GetOneEvaluated(arg, context));
+    auto continuation = Make<Continuation>();
+    struct Deactivate {
+        Continuation* continuation;
+
+        ~Deactivate() {
+            continuation->active = false;
+        }
+    } deactivate{continuation.get()};
+    try {
+        return func->Call({continuation}, context);
+    } catch (ContinuationJump& jump) {
+        if (jump.target != continuation.get()) {
+            throw;
+        }
+        return jump.value;
+    }
+}
+
+// -----------------------------------------------------------
+// Begin
+std::shared_ptr<Type> Begin::Apply(std::shared_ptr<Type> arg, Context* context) {
+    if (!IsType<Pair>(arg) || !AsType<Pair>(arg)->ProperList() || AsType<Pair>(arg)->Empty()) {
+        throw SyntaxError("begin expects at least one expression");
+    }
+    auto args = Helper::GetAll(arg);
+    for (size_t i = 0; i + 1 < args.size(); ++i) {
+        args[i]->Evaluate(context);
+    }
+    return args.back()->Evaluate(context);
+}
+
+// -----------------------------------------------------------
+// DefineSyntax
+std::shared_ptr<Type> DefineSyntax::Apply(std::shared_ptr<Type> arg, Context* context) {
+    Helper::CheckExclusive(context);
+    Helper::CheckPair(arg);
+    auto args = Helper::GetAll(arg);
+    if (!IsType<UnknownSymbol>(args[0])) {
+        throw SyntaxError("define-syntax expects a name");
+    }
+    auto spec = args[1];
+    if (!IsType<Pair>(spec) || !AsType<Pair>(spec)->ProperList() || AsType<Pair>(spec)->Empty() ||
+        !IsType<UnknownSymbol>(AsType<Pair>(spec)->GetFirst()) ||
+        AsType<UnknownSymbol>(AsType<Pair>(spec)->GetFirst())->name != "syntax-rules") {
+        throw SyntaxError("define-syntax expects syntax-rules");
+    }
+    auto parts = Helper::GetAll(spec);
+    if (parts.size() < 2 || !IsType<Pair>(parts[1]) || !AsType<Pair>(parts[1])->ProperList()) {
+        throw SyntaxError("syntax-rules expects a list of literals");
+    }
+    auto macro = Make<Macro>();
+    for (const auto& literal : Helper::GetAll(parts[1])) {
+        if (!IsType<UnknownSymbol>(literal)) {
+            throw SyntaxError("syntax-rules literal must be a symbol");
+        }
+        macro->literals.push_back(AsType<UnknownSymbol>(literal)->name);
+    }
+    for (size_t i = 2; i < parts.size(); ++i) {
+        Helper::CheckPair(parts[i]);
+        auto rule = Helper::GetAll(parts[i]);
+        if (!IsType<Pair>(rule[0]) || AsType<Pair>(rule[0])->Empty()) {
+            throw SyntaxError("syntax-rules pattern must be a form");
+        }
+        macro->rules.push_back({rule[0], rule[1]});
+    }
+    return context->Add(AsType<UnknownSymbol>(args[0])->name, macro);
+}
+
+// -----------------------------------------------------------
+// Do
+std::shared_ptr<Type> Do::Apply(std::shared_ptr<Type> arg, Context* context) {
+    if (!IsType<Pair>(arg) || !AsType<Pair>(arg)->ProperList()) {
+        throw SyntaxError("Invalid do");
+    }
+    auto args = Helper::GetAll(arg);
+    if (args.size() < 2 || !IsType<Pair>(args[0]) || !AsType<Pair>(args[0])->ProperList() ||
+        !IsType<Pair>(args[1]) || !AsType<Pair>(args[1])->ProperList() ||
+        AsType<Pair>(args[1])->Empty()) {
+        throw SyntaxError("do expects ((var init step) ...) (test expr ...) body ...");
+    }
+    std::vector<std::string> names;
+    std::vector<std::shared_ptr<Type>> values;
+    std::vector<std::pair<size_t, std::shared_ptr<Type>>> steps;
+    for (const auto& spec : Helper::GetAll(args[0])) {
+        if (!IsType<Pair>(spec) || !AsType<Pair>(spec)->ProperList()) {
+            throw SyntaxError("Invalid do variable");
+        }
+        auto parts = Helper::GetAll(spec);
+        if ((parts.size() != 2 && parts.size() != 3) || !IsType<UnknownSymbol>(parts[0])) {
+            throw SyntaxError("Invalid do variable");
+        }
+        if (parts.size() == 3) {
+            steps.emplace_back(names.size(), parts[2]);
+        }
+        names.push_back(AsType<UnknownSymbol>(parts[0])->name);
+        values.push_back(parts[1]->Evaluate(context));
+    }
+    auto exit = Helper::GetAll(args[1]);
+    std::vector<std::shared_ptr<Type>> body(args.begin() + 2, args.end());
+
+    // замыкание в теле должно видеть переменные своей итерации, тогда кадр новый на каждой
+    bool fresh_frames = CreatesClosures(args);
+    Context* frame = nullptr;
+    std::vector<std::shared_ptr<Type>*> cells(names.size());
+    auto bind = [&] {
+        frame = context->collector->Allocate(context);
+        for (size_t i = 0; i < names.size(); ++i) {
+            frame->Add(names[i], values[i]);
+            cells[i] = &frame->var[names[i]];
+        }
+    };
+    bind();
+    std::vector<std::shared_ptr<Type>> stepped(steps.size());
+    while (!Helper::ConvertToBool(exit[0]->Evaluate(frame))) {
+        context->collector->ChargeStep();
+        for (const auto& expr : body) {
+            expr->Evaluate(frame);
+        }
+        for (size_t i = 0; i < steps.size(); ++i) {
+            stepped[i] = steps[i].second->Evaluate(frame);
+        }
+        for (size_t i = 0; i < names.size(); ++i) {
+            values[i] = *cells[i];
+        }
+        for (size_t i = 0; i < steps.size(); ++i) {
+            values[steps[i].first] = std::move(stepped[i]);
+        }
+        if (fresh_frames) {
+            bind();
+        } else {
+            for (size_t i = 0; i < names.size(); ++i) {
+                *cells[i] = values[i];
+            }
+        }
+    }
+    std::shared_ptr<Type> result = Pair::EmptyPair();
+    for (size_t i = 1; i < exit.size(); ++i) {
+        result = exit[i]->Evaluate(frame);
+    }
+    return result;
+}
+
+// -----------------------------------------------------------
+// NamedLet
+std::shared_ptr<Type> NamedLet::Apply(std::shared_ptr<Type> arg, Context* context) {
+    if (!IsType<Pair>(arg) || !AsType<Pair>(arg)->ProperList()) {
+        throw SyntaxError("Invalid named let");
+    }
+    auto args = Helper::GetAll(arg);
+    if (args.size() < 3 || !IsType<UnknownSymbol>(args[0]) || !IsType<Pair>(args[1]) ||
+        !AsType<Pair>(args[1])->ProperList()) {
+        throw SyntaxError("named let expects name ((var init) ...) body ...");
+    }
+    std::string name = AsType<UnknownSymbol>(args[0])->name;
+    std::vector<std::string> names;
+    std::vector<std::shared_ptr<Type>> values;
+    for (const auto& binding : Helper::GetAll(args[1])) {
+        Helper::CheckPair(binding);
+        auto parts = Helper::GetAll(binding);
+        if (!IsType<UnknownSymbol>(parts[0])) {
+            throw SyntaxError("Invalid named let variable");
+        }
+        names.push_back(AsType<UnknownSymbol>(parts[0])->name);
+        values.push_back(parts[1]->Evaluate(context));
+    }
+    std::vector<std::shared_ptr<Type>> body(args.begin() + 2, args.end());
+
+    Context* frame = context->collector->Allocate(context);
+    if (!IsLoopBody(name, body)) {
+        // обычная рекурсивная функция name, видимая в своём теле
+        auto lambda_code = code;
+        if (!lambda_code) {
+            auto body_list =
+                AsType<Pair>(AsType<Pair>(AsType<Pair>(arg)->GetSecond())->GetSecond());
+            lambda_code = Make<LambdaCode>(names, body_list);
+        }
+        auto lambda = Make<Lambda>(lambda_code, frame);
+        frame->Add(name, lambda);
+        return lambda->Call(values, context);
+    }
+    std::vector<std::shared_ptr<Type>*> cells(names.size());
+    for (size_t i = 0; i < names.size(); ++i) {
+        frame->Add(names[i], values[i]);
+        cells[i] = &frame->var[names[i]];
+    }
+    while (true) {
+        context->collector->ChargeStep();
+        for (size_t i = 0; i + 1 < body.size(); ++i) {
+            body[i]->Evaluate(frame);
+        }
+        // спуск по хвостовым позициям до вызова name или обычного выражения
+        auto expr = body.back();
+        while (true) {
+            auto pair = IsType<Pair>(expr) ? AsType<Pair>(expr) : nullptr;
+            auto op = pair && !pair->Empty() ? pair->GetFirst() : nullptr;
+            if (IsType<If>(op)) {
+                auto parts = Helper::GetAll(pair->GetSecond());
+                if (Helper::ConvertToBool(parts[0]->Evaluate(frame))) {
+                    expr = parts[1];
+                } else if (parts.size() == 3) {
+                    expr = parts[2];
+                } else {
+                    return Pair::EmptyPair();
+                }
+            } else if (IsType<Begin>(op)) {
+                auto parts = Helper::GetAll(pair->GetSecond());
+                for (size_t i = 0; i + 1 < parts.size(); ++i) {
+                    parts[i]->Evaluate(frame);
+                }
+                expr = parts.back();
+            } else if (IsCallOf(op, name)) {
+                break;
+            } else {
+                return expr->Evaluate(frame);
+            }
+        }
+        auto call_args = Helper::GetAll(AsType<Pair>(expr)->GetSecond());
+        if (call_args.size() != names.size()) {
+            throw RuntimeError("Invalid number of args in Lambda");
+        }
+        for (size_t i = 0; i < call_args.size(); ++i) {
+            values[i] = call_args[i]->Evaluate(frame);
+        }
+        for (size_t i = 0; i < names.size(); ++i) {
+            *cells[i] = std::move(values[i]);
+        }
     }
-    return list;
 }
 
 // -----------------------------------------------------------
 // SymbolPred
 std::shared_ptr<Type> SymbolPred::Apply(std::shared_ptr<Type> arg, Context* context) {
     arg = Helper::GetOneEvaluated(arg, context);
-    return std::make_shared<Bool>(IsType<UnknownSymbol>(arg));
+    return Make<Bool>(IsType<UnknownSymbol>(arg));
 }
 
 // -----------------------------------------------------------
@@ -239,7 +975,7 @@ std::shared_ptr<Type> Define::Apply(std::shared_ptr<Type> arg, Context* context)
         auto func = AsType<UnknownSymbol>(func_and_args->GetFirst());
         auto lambda_args = func_and_args->GetSecond();
         auto body = pair->GetSecond();
-        auto lambda_create_arg = std::make_shared<Pair>(lambda_args, body);
+        auto lambda_create_arg = Make<Pair>(lambda_args, body);
         return context->Add(func->Repr(), LambdaCreate().Apply(lambda_create_arg, context));
     } else {
         throw SyntaxError("Define got Pair with first not Pair");
@@ -249,23 +985,31 @@ std::shared_ptr<Type> Define::Apply(std::shared_ptr<Type> arg, Context* context)
 // -----------------------------------------------------------
 // Set
 std::shared_ptr<Type> Set::Apply(std::shared_ptr<Type> arg, Context* context) {
+    Helper::CheckExclusive(context);
     Helper::CheckPair(arg);
     auto pair = AsType<Pair>(arg);
     auto symbol = AsType<UnknownSymbol>(pair->GetFirst());
     auto value = Helper::GetOneEvaluated(pair->GetSecond(), context);
-    context->Get(symbol->Repr()) = value;
+    // локальное имя со слотом, найденным при анализе (см. Compiler)
+    std::shared_ptr<Type>* local = nullptr;
+    if (auto resolved = std::dynamic_pointer_cast<LocalSymbol>(symbol)) {
+        local = resolved->Find(context);
+    }
+    auto& cell = local ? *local : context->Get(symbol->Repr());
+    if (IsType<Macro>(cell) || IsType<Macro>(value)) {
+        context->collector->ChangeMacros();
+    }
+    cell = value;
     return value;
 }
 
 // -----------------------------------------------------------
 // If
 std::shared_ptr<Type> If::Apply(std::shared_ptr<Type> arg, Context* context) {
-    std::vector<std::shared_ptr<Type>> args;
-    try {
-        args = Helper::GetAll(arg);
-    } catch (RuntimeError) {
+    if (!Helper::IsList(arg)) {
         throw SyntaxError("Set::GeAll()");
     }
+    auto args = Helper::GetAll(arg);
     if (args.size() != 2 && args.size() != 3) {
         throw SyntaxError("Invalid number of args in If");
     }
@@ -283,6 +1027,7 @@ std::shared_ptr<Type> If::Apply(std::shared_ptr<Type> arg, Context* context) {
 // -----------------------------------------------------------
 // SetCar
 std::shared_ptr<Type> SetCar::Apply(std::shared_ptr<Type> arg, Context* context) {
+    Helper::CheckExclusive(context);
     Helper::CheckPair(arg);
     auto args = Helper::GetAll(arg);
     std::string name = AsType<UnknownSymbol>(args[0])->Repr();
@@ -294,6 +1039,7 @@ std::shared_ptr<Type> SetCar::Apply(std::shared_ptr<Type> arg, Context* context)
 // -----------------------------------------------------------
 // SetCdr
 std::shared_ptr<Type> SetCdr::Apply(std::shared_ptr<Type> arg, Context* context) {
+    Helper::CheckExclusive(context);
     Helper::CheckPair(arg);
     auto args = Helper::GetAll(arg);
     std::string name = AsType<UnknownSymbol>(args[0])->Repr();
@@ -302,53 +1048,235 @@ std::shared_ptr<Type> SetCdr::Apply(std::shared_ptr<Type> arg, Context* context)
     return val;
 }
 
+// -----------------------------------------------------------
+// GetRuntimeStats
+std::shared_ptr<Type> GetRuntimeStats::Apply(std::shared_ptr<Type> arg, Context* context) {
+    if (!Helper::GetAll(arg).empty()) {
+        throw RuntimeError("runtime-stats takes no arguments");
+    }
+    RuntimeStats stats = context->collector->GetStats();
+    auto micros = [](std::chrono::nanoseconds time) {
+        return static_cast<size_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(time).count());
+    };
+    std::vector<std::pair<std::string, size_t>> entries = {
+        {"live-contexts", stats.live_contexts},
+        {"live-pairs", stats.live_pairs},
+        {"live-closures", stats.live_closures},
+        {"allocated-frames", stats.allocated_frames},
+        {"allocated-frame-bytes", stats.allocated_frame_bytes},
+        {"freed-contexts", stats.freed_contexts},
+        {"collections", stats.collections},
+        {"last-pause-us", micros(stats.last_pause)},
+        {"max-pause-us", micros(stats.max_pause)},
+        {"total-pause-us", micros(stats.total_pause)},
+        {"max-depth", stats.max_depth},
+        {"pooled-frames", stats.pooled_frames},
+        {"parse-cache-hits", stats.parse_cache_hits},
+        {"parse-cache-misses", stats.parse_cache_misses},
+    };
+    std::shared_ptr<Type> result = Pair::EmptyPair();
+    for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+        auto entry = Make<Pair>(Make<UnknownSymbol>(it->first),
+                                            Make<Integer>(it->second));
+        result = Make<Pair>(entry, result);
+    }
+    return result;
+}
+
+// -----------------------------------------------------------
+// LambdaCode
+LambdaCode::LambdaCode(std::vector<std::string> args, std::shared_ptr<Pair> body,
+                       std::shared_ptr<const std::vector<std::string>> layout)
+    : args(std::move(args)), body(std::move(body)), layout(std::move(layout)) {
+    if (this->body->Empty()) {
+        throw SyntaxError("Empty Lambda body");
+    }
+    body_lines = Helper::GetAll(this->body);
+    leaf = !CreatesClosures(body_lines);
+    if (!this->layout) {
+        this->layout =
+            std::make_shared<const std::vector<std::string>>(Compiler::Layout(this->args,
+                                                                              this->body));
+    }
+}
+
 // -----------------------------------------------------------
 // Lambda
+Lambda::Lambda(std::shared_ptr<const LambdaCode> code, Context* created_context)
+    : code(std::move(code)), created_context(created_context) {
+    for (const auto& name : this->code->args) {
+        created_context->collector->AddLocalName(name);
+    }
+    // кадры из пула, которые видит новое замыкание, должны пережить свой вызов
+    for (Context* context = created_context; context; context = context->parent) {
+        if (context->pooled) {
+            context->escaped = true;
+        }
+    }
+}
+
 std::shared_ptr<Type> Lambda::Apply(std::shared_ptr<Type> arg, Context* context) {
     auto passed_args = Helper::GetAll(arg);
-    if (passed_args.size() != args.size()) {
+    if (passed_args.size() != code->args.size()) {
         throw RuntimeError("Invalid number of args in Lambda");
     }
-    Context* eval_context = context->collector->Allocate(created_context);
-    for (size_t i = 0; i < args.size(); ++i) {
-        eval_context->Add(args[i], passed_args[i]->Evaluate(context));
+    for (auto& value : passed_args) {
+        value = value->Evaluate(context);
+    }
+    return Call(passed_args, context);
+}
+
+std::shared_ptr<Type> Lambda::Call(const std::vector<std::shared_ptr<Type>>& values,
+                                   Context* context) {
+    if (values.size() != code->args.size()) {
+        throw RuntimeError("Invalid number of args in Lambda");
     }
-    auto body_lines = Helper::GetAll(body);
-    if (body_lines.empty()) {
-        throw RuntimeError("Empty Lambda body");
+    context->collector->ChargeStep();
+    if (code->leaf) {
+        GarbageCollector::Frame frame(context->collector, created_context);
+        return Run(values, frame.context);
     }
-    for (size_t i = 0; i < body_lines.size() - 1; ++i) {
+    return Run(values, context->collector->Allocate(created_context));
+}
+
+std::shared_ptr<Type> Lambda::Run(const std::vector<std::shared_ptr<Type>>& values,
+                                  Context* eval_context) {
+    if (eval_context->layout != code->layout) {
+        eval_context->layout = code->layout;
+    }
+    eval_context->slots.resize(code->layout->size());
+    std::copy(values.begin(), values.end(), eval_context->slots.begin());
+    const auto& body_lines = code->body_lines;
+    for (size_t i = 0; i + 1 < body_lines.size(); ++i) {
         body_lines[i]->Evaluate(eval_context);
     }
-    return body_lines[body_lines.size() - 1]->Evaluate(eval_context);
+    return body_lines.back()->Evaluate(eval_context);
 }
 
 // -----------------------------------------------------------
-// LambdaCreate
-std::shared_ptr<Type> LambdaCreate::Apply(std::shared_ptr<Type> arg, Context* context) {
-    try {
-        auto pair = AsType<Pair>(arg);
-        auto lambda_args = Helper::GetAll(pair->GetFirst());
-        auto body = pair->GetSecond();
-        std::vector<std::string> args_name(lambda_args.size());
-        for (size_t i = 0; i < lambda_args.size(); ++i) {
-            args_name[i] = AsType<UnknownSymbol>(lambda_args[i])->Repr();
+// Memoized
+std::shared_ptr<Type> Memoized::Apply(std::shared_ptr<Type> arg, Context* context) {
+    auto values = Helper::GetAll(arg);
+    for (auto& value : values) {
+        value = value->Evaluate(context);
+    }
+    return Call(values, context);
+}
+
+std::shared_ptr<Type> Memoized::Call(const std::vector<std::shared_ptr<Type>>& values,
+                                     Context* context) {
+    Helper::CheckExclusive(context);
+    size_t hash = values.size();
+    for (const auto& value : values) {
+        // циклический ключ не хэшируется за конечное время, такой вызов не кэшируется
+        if (!Helper::Acyclic(value)) {
+            return func->Call(values, context);
+        }
+        hash = hash * 31 + Helper::Hash(value);
+    }
+    auto it = Find(hash, values);
+    if (it != entries.end()) {
+        entries.splice(entries.begin(), entries, it);
+        return it->value;
+    }
+    // ключ - копия списков: set-car! аргумента после вызова не должен менять ключ в корзине
+    std::vector<std::shared_ptr<Type>> args(values.size());
+    for (size_t i = 0; i < values.size(); ++i) {
+        args[i] = Pair::CopyData(values[i]);
+    }
+    auto value = func->Call(values, context);
+    entries.push_front({hash, std::move(args), value});
+    index.emplace(hash, entries.begin());
+    if (capacity != 0 && entries.size() > capacity) {
+        auto last = std::prev(entries.end());
+        auto [begin, end] = index.equal_range(last->hash);
+        for (auto pos = begin; pos != end; ++pos) {
+            if (pos->second == last) {
+                index.erase(pos);
+                break;
+            }
+        }
+        entries.pop_back();
+    }
+    return value;
+}
+
+std::list<Memoized::Entry>::iterator Memoized::Find(
+    size_t hash, const std::vector<std::shared_ptr<Type>>& values) {
+    auto [begin, end] = index.equal_range(hash);
+    for (auto pos = begin; pos != end; ++pos) {
+        const auto& args = pos->second->args;
+        if (args.size() != values.size()) {
+            continue;
+        }
+        bool equal = true;
+        for (size_t i = 0; equal && i < args.size(); ++i) {
+            equal = Helper::Equal(args[i], values[i]);
+        }
+        if (equal) {
+            return pos->second;
+        }
+    }
+    return entries.end();
+}
+
+// -----------------------------------------------------------
+// Memoize
+std::shared_ptr<Type> Memoize::Apply(std::shared_ptr<Type> arg, Context* context) {
+    auto args = Helper::GetAll(arg);
+    if (args.empty() || args.size() > 2) {
+        throw RuntimeError("memoize takes a function and an optional capacity");
+    }
+    auto func = AsType<Function>(args[0]->Evaluate(context));
+    int capacity = 0;
+    if (args.size() == 2) {
+        capacity = AsType<Integer>(args[1]->Evaluate(context))->GetValue();
+        if (capacity < 0) {
+            throw RuntimeError("memoize capacity must not be negative");
         }
-        return std::make_shared<Lambda>(args_name, AsType<Pair>(body), context);
-    } catch (RuntimeError) {
-        throw SyntaxError("LambdaCreate::Apply()");
     }
+    return Make<Memoized>(func, capacity);
 }
 
-template <typename T>
-bool IsType(std::shared_ptr<Type> type) {
-    return bool(std::dynamic_pointer_cast<T>(type));
+// -----------------------------------------------------------
+// DefineMemoized
+std::shared_ptr<Type> DefineMemoized::Apply(std::shared_ptr<Type> arg, Context* context) {
+    if (!IsType<Pair>(arg) || AsType<Pair>(arg)->Empty() ||
+        !IsType<Pair>(AsType<Pair>(arg)->GetFirst())) {
+        throw SyntaxError("define-memoized expects (define-memoized (name args) body)");
+    }
+    auto pair = AsType<Pair>(arg);
+    auto func_and_args = AsType<Pair>(pair->GetFirst());
+    auto func = AsType<UnknownSymbol>(func_and_args->GetFirst());
+    auto lambda_create_arg = Make<Pair>(func_and_args->GetSecond(), pair->GetSecond());
+    auto lambda = AsType<Function>(LambdaCreate().Apply(lambda_create_arg, context));
+    return context->Add(func->Repr(), Make<Memoized>(lambda, 0));
 }
 
-template <typename T>
-std::shared_ptr<T> AsType(std::shared_ptr<Type> type) {
-    if (!IsType<T>(type)) {
-        throw RuntimeError("Invalid type in AsType()");
+// -----------------------------------------------------------
+// LambdaCreate
+std::shared_ptr<Type> LambdaCreate::Apply(std::shared_ptr<Type> arg, Context* context) {
+    if (code) {
+        return Make<Lambda>(code, context);
+    }
+    // форма проверяется заранее: ошибка бросается один раз, без перехвата и повторного броска
+    if (!IsType<Pair>(arg) || AsType<Pair>(arg)->Empty()) {
+        throw SyntaxError("LambdaCreate::Apply()");
+    }
+    auto pair = AsType<Pair>(arg);
+    auto params = pair->GetFirst();
+    auto body = pair->GetSecond();
+    if (!Helper::IsList(params) || !Helper::IsList(body)) {
+        throw SyntaxError("LambdaCreate::Apply()");
+    }
+    auto lambda_args = Helper::GetAll(params);
+    std::vector<std::string> args_name(lambda_args.size());
+    for (size_t i = 0; i < lambda_args.size(); ++i) {
+        if (!IsType<UnknownSymbol>(lambda_args[i])) {
+            throw SyntaxError("LambdaCreate::Apply()");
+        }
+        args_name[i] = AsType<UnknownSymbol>(lambda_args[i])->Repr();
     }
-    return std::static_pointer_cast<T>(type);
+    return Make<Lambda>(Make<LambdaCode>(args_name, AsType<Pair>(body)), context);
 }
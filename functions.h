@@ -1,10 +1,28 @@
 #pragma once
 
+#include <climits>
+#include <cstdint>
+#include <functional>
+#include <list>
 #include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 #include "types.h"
 #include "error.h"
 
+struct LambdaCode;
+
+// результат целочисленной операции, посчитанной в int64_t
+inline int CheckedInt(int64_t value) {
+    if (value < INT_MIN || value > INT_MAX) {
+        throw RuntimeError("Integer overflow");
+    }
+    return static_cast<int>(value);
+}
+
 struct Quote : public Function {
     std::string Repr() override {
         return "'";
@@ -13,6 +31,12 @@ struct Quote : public Function {
     std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
 };
 
+// quote в дереве, которое вычисляется повторно (кэш разбора Interpreter): возвращает копию
+// литерала, чтобы set-car! одного вычисления не менял его для следующих
+struct LiteralQuote : public Quote {
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
 struct BooleanPred : public Function {
 
     std::string Repr() override {
@@ -55,12 +79,17 @@ struct NumberPred : public Function {
 };
 
 struct IntegerOperation : public Function {
-    virtual std::shared_ptr<Integer> Operation(std::shared_ptr<Integer> one,
-                                               std::shared_ptr<Integer> two) = 0;
+    virtual int Operation(int one, int two) = 0;
+
+    // -1 - нет начального значения
+    virtual int FirstElem() = 0;
 
-    virtual std::shared_ptr<Integer> FirstElem() = 0;
+    virtual int Reduce(const std::vector<int>& values);
 
     std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+
+    std::shared_ptr<Type> Call(const std::vector<std::shared_ptr<Type>>& values,
+                               Context* context) override;
 };
 
 struct Addition : public IntegerOperation {
@@ -68,14 +97,15 @@ struct Addition : public IntegerOperation {
         return "+";
     }
 
-    std::shared_ptr<Integer> Operation(std::shared_ptr<Integer> one,
-                                       std::shared_ptr<Integer> two) override {
-        return std::make_shared<Integer>(one->GetValue() + two->GetValue());
+    int Operation(int one, int two) override {
+        return CheckedInt(int64_t(one) + two);
     }
 
-    std::shared_ptr<Integer> FirstElem() override {
-        return std::make_shared<Integer>(0);
+    int FirstElem() override {
+        return 0;
     }
+
+    int Reduce(const std::vector<int>& values) override;
 };
 
 struct Subtraction : public IntegerOperation {
@@ -83,13 +113,12 @@ struct Subtraction : public IntegerOperation {
         return "-";
     }
 
-    std::shared_ptr<Integer> Operation(std::shared_ptr<Integer> one,
-                                       std::shared_ptr<Integer> two) override {
-        return std::make_shared<Integer>(one->GetValue() - two->GetValue());
+    int Operation(int one, int two) override {
+        return CheckedInt(int64_t(one) - two);
     }
 
-    std::shared_ptr<Integer> FirstElem() override {
-        return std::make_shared<Integer>(-1);
+    int FirstElem() override {
+        return -1;
     }
 };
 
@@ -98,14 +127,15 @@ struct Multiplication : public IntegerOperation {
         return "*";
     }
 
-    std::shared_ptr<Integer> Operation(std::shared_ptr<Integer> one,
-                                       std::shared_ptr<Integer> two) override {
-        return std::make_shared<Integer>(one->GetValue() * two->GetValue());
+    int Operation(int one, int two) override {
+        return CheckedInt(int64_t(one) * two);
     }
 
-    std::shared_ptr<Integer> FirstElem() override {
-        return std::make_shared<Integer>(1);
+    int FirstElem() override {
+        return 1;
     }
+
+    int Reduce(const std::vector<int>& values) override;
 };
 
 struct Division : public IntegerOperation {
@@ -113,17 +143,15 @@ struct Division : public IntegerOperation {
         return "/";
     }
 
-    std::shared_ptr<Integer> Operation(std::shared_ptr<Integer> one,
-                                       std::shared_ptr<Integer> two) override {
-        if (AsType<Integer>(two)->GetValue() == 0) {
+    int Operation(int one, int two) override {
+        if (two == 0) {
             throw RuntimeError("Division by zero");
         }
-        return std::make_shared<Integer>(AsType<Integer>(one)->GetValue() /
-                                         AsType<Integer>(two)->GetValue());
+        return CheckedInt(int64_t(one) / two);
     }
 
-    std::shared_ptr<Integer> FirstElem() override {
-        return std::make_shared<Integer>(-1);
+    int FirstElem() override {
+        return -1;
     }
 };
 
@@ -131,6 +159,9 @@ struct Compare : public Function {
     virtual bool Comparator(std::shared_ptr<Integer>, std::shared_ptr<Integer>) = 0;
 
     std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+
+    std::shared_ptr<Type> Call(const std::vector<std::shared_ptr<Type>>& values,
+                               Context* context) override;
 };
 
 struct Equal : public Compare {
@@ -184,10 +215,12 @@ struct GreaterEqual : public Compare {
 };
 
 struct MinMax : public Function {
-    virtual std::shared_ptr<Integer> Operation(std::shared_ptr<Integer> one,
-                                               std::shared_ptr<Integer> two) = 0;
+    virtual int Reduce(const std::vector<int>& values) = 0;
 
     std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+
+    std::shared_ptr<Type> Call(const std::vector<std::shared_ptr<Type>>& values,
+                               Context* context) override;
 };
 
 struct Min : public MinMax {
@@ -195,10 +228,7 @@ struct Min : public MinMax {
         return "min";
     }
 
-    std::shared_ptr<Integer> Operation(std::shared_ptr<Integer> one,
-                                       std::shared_ptr<Integer> two) override {
-        return std::make_shared<Integer>(std::min(one->GetValue(), two->GetValue()));
-    }
+    int Reduce(const std::vector<int>& values) override;
 };
 
 struct Max : public MinMax {
@@ -206,10 +236,34 @@ struct Max : public MinMax {
         return "max";
     }
 
-    std::shared_ptr<Integer> Operation(std::shared_ptr<Integer> one,
-                                       std::shared_ptr<Integer> two) override {
-        return std::make_shared<Integer>(std::max(one->GetValue(), two->GetValue()));
+    int Reduce(const std::vector<int>& values) override;
+};
+
+// сумма элементов списка
+struct Sum : public Function {
+    std::string Repr() override {
+        return "sum";
     }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
+// произведение элементов списка
+struct Product : public Function {
+    std::string Repr() override {
+        return "product";
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
+// (apply f a ... lst) - вызвать f с аргументами a ... и элементами lst
+struct ApplyFunc : public Function {
+    std::string Repr() override {
+        return "apply";
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
 };
 
 struct Abs : public Function {
@@ -298,6 +352,87 @@ struct ListTail : public Function {
     std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
 };
 
+// (map f lst ...) - список результатов f, останавливается на самом коротком списке
+struct Map : public Function {
+    std::string Repr() override {
+        return "map";
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
+// (filter pred lst) - элементы, для которых pred истинен
+struct Filter : public Function {
+    std::string Repr() override {
+        return "filter";
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
+// (fold f init lst) - (f elem acc) слева направо
+struct Fold : public Function {
+    std::string Repr() override {
+        return "fold";
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
+// склеить списки, последний аргумент не копируется
+struct Append : public Function {
+    std::string Repr() override {
+        return "append";
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
+struct Reverse : public Function {
+    std::string Repr() override {
+        return "reverse";
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
+struct Length : public Function {
+    std::string Repr() override {
+        return "length";
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
+// (assoc key alist) - первая пара с car, равным key, или #f
+struct Assoc : public Function {
+    std::string Repr() override {
+        return "assoc";
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
+// (member x lst) - хвост списка, начинающийся с x, или #f
+struct Member : public Function {
+    std::string Repr() override {
+        return "member";
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
+// (pmap f lst) - map, вычисляемый на общем пуле потоков. Функция без побочных эффектов
+// (без set!, set-car! и set-cdr!, в том числе в вызываемых ею глобальных лямбдах)
+// применяется к частям списка параллельно, иначе pmap работает как map
+struct PMap : public Function {
+    std::string Repr() override {
+        return "pmap";
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
 struct SymbolPred : public Function {
     std::string Repr() override {
         return "symbol?";
@@ -346,26 +481,209 @@ struct SetCdr : public Function {
     std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
 };
 
-struct Lambda : public Function {
+// счётчики сборщика в виде ассоциативного списка
+struct GetRuntimeStats : public Function {
+    std::string Repr() override {
+        return "runtime-stats";
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
+// Продолжение из call/cc. Поддерживаются только выходы вверх по стеку: после возврата из
+// call/cc продолжение неактивно и его вызов - ошибка
+struct Continuation : public Function {
+    bool active = true;
+
+    std::string Repr() override {
+        return "unknown continuation";
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
+// Бросается при вызове продолжения и ловится в его call/cc. Не наследуется от std::exception,
+// чтобы обработчики ошибок по пути его не перехватывали
+struct ContinuationJump {
+    Continuation* target;
+    std::shared_ptr<Type> value;
+};
+
+// Бросается, когда функция в потоке pmap собирается изменить общие данные (set!, кэш memoize,
+// раскрытие макроса); pmap тогда вычисляется заново последовательно. Не наследуется от
+// std::exception по той же причине, что и ContinuationJump
+struct SharedMutation {};
+
+// (call/cc f) - вызывает f с продолжением, вызов которого сразу возвращает значение из call/cc
+struct CallCC : public Function {
+    std::string name;
+
+    CallCC(std::string name = "call/cc") : name(std::move(name)) {
+    }
+
+    std::string Repr() override {
+        return name;
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
+// (begin e1 e2 ...) - вычисляет выражения по порядку, результат - значение последнего
+struct Begin : public Function {
+    std::string Repr() override {
+        return "begin";
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
+// (do ((var init step) ...) (test expr ...) body ...) - цикл в одном кадре: переменные
+// обновляются на месте. Если тело может создать замыкание, каждая итерация получает новый кадр
+struct Do : public Function {
+    std::string Repr() override {
+        return "do";
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
+// (named-let name ((var init) ...) body ...) - именованный let (см. макрос let). Если name
+// вызывается только в хвостовой позиции, тело выполняется циклом в одном кадре, иначе name
+// становится обычной рекурсивной функцией
+struct NamedLet : public Function {
+    // тело как функции name, см. LambdaCreate::code
+    std::shared_ptr<const LambdaCode> code;
+
+    std::string Repr() override {
+        return "named-let";
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
+// Макрос syntax-rules. Использования глобальных макросов раскрываются один раз при анализе
+// выражения (см. MacroExpander), остальные - при каждом вычислении формы через Apply
+struct Macro : public Function {
+    struct Rule {
+        std::shared_ptr<Type> pattern;
+        std::shared_ptr<Type> templ;
+    };
+
+    std::vector<std::string> literals;
+    std::vector<Rule> rules;
+
+    std::string Repr() override {
+        return "unknown macro";
+    }
+
+    // Раскрытие формы с аргументами args. Идентификаторы, которые вводит шаблон, помечаются
+    // номером раскрытия (UnknownSymbol::mark)
+    std::shared_ptr<Type> Expand(std::shared_ptr<Type> args);
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
+// (define-syntax name (syntax-rules (literal ...) (pattern template) ...))
+struct DefineSyntax : public Function {
+    std::string Repr() override {
+        return "define-syntax";
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
+// Общая часть замыканий одной формы lambda: разбирается один раз при анализе выражения (см.
+// Compiler) и разделяется всеми Lambda, созданными этой формой
+struct LambdaCode {
     std::vector<std::string> args;
-    std::shared_ptr<Type> body;
+    std::shared_ptr<Pair> body;
+    // выражения тела
+    std::vector<std::shared_ptr<Type>> body_lines;
+    // тело не создаёт замыканий, и кадр вызова можно взять из пула (см. GarbageCollector::Frame)
+    bool leaf = false;
+    // имена слотов кадра вызова, см. Compiler::Layout
+    std::shared_ptr<const std::vector<std::string>> layout;
+
+    // layout == nullptr - раскладка вычисляется по телу
+    LambdaCode(std::vector<std::string> args, std::shared_ptr<Pair> body,
+               std::shared_ptr<const std::vector<std::string>> layout = nullptr);
+};
+
+struct Lambda : public Function {
+    std::shared_ptr<const LambdaCode> code;
     Context* created_context;
 
-    Lambda(std::vector<std::string> args, std::shared_ptr<Pair> body, Context* created_context)
-        : args(args), body(body), created_context(created_context) {
-        if (body->Empty()) {
-            throw SyntaxError("Empty Lambda body");
-        }
-    }
+    Lambda(std::shared_ptr<const LambdaCode> code, Context* created_context);
 
     std::string Repr() override {
         return "unknown lambda";
     }
 
     std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+
+    std::shared_ptr<Type> Call(const std::vector<std::shared_ptr<Type>>& values,
+                               Context* context) override;
+
+private:
+    std::shared_ptr<Type> Run(const std::vector<std::shared_ptr<Type>>& values,
+                              Context* eval_context);
+};
+
+// Функция с кэшем результатов по структурному равенству аргументов. capacity = 0 - кэш без
+// ограничения, иначе вытесняется давно не использованный результат. Кэш не потокобезопасен
+struct Memoized : public Function {
+    struct Entry {
+        size_t hash;
+        std::vector<std::shared_ptr<Type>> args;
+        std::shared_ptr<Type> value;
+    };
+
+    std::shared_ptr<Function> func;
+    size_t capacity;
+    // в начале - недавно использованные
+    std::list<Entry> entries;
+    std::unordered_multimap<size_t, std::list<Entry>::iterator> index;
+
+    Memoized(std::shared_ptr<Function> func, size_t capacity)
+        : func(std::move(func)), capacity(capacity) {
+    }
+
+    std::string Repr() override {
+        return "unknown memoized";
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+
+    std::shared_ptr<Type> Call(const std::vector<std::shared_ptr<Type>>& values,
+                               Context* context) override;
+
+private:
+    std::list<Entry>::iterator Find(size_t hash, const std::vector<std::shared_ptr<Type>>& values);
+};
+
+// (memoize f [capacity])
+struct Memoize : public Function {
+    std::string Repr() override {
+        return "memoize";
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
+};
+
+// (define-memoized (f args) body) - define, оборачивающий функцию в memoize
+struct DefineMemoized : public Function {
+    std::string Repr() override {
+        return "define-memoized";
+    }
+
+    std::shared_ptr<Type> Apply(std::shared_ptr<Type> arg, Context* context) override;
 };
 
 struct LambdaCreate : public Function {
+    // разобранная форма; nullptr у общего экземпляра из фабрики, тогда LambdaCode строится при
+    // каждом вычислении
+    std::shared_ptr<const LambdaCode> code;
+
     std::string Repr() override {
         return "lambda";
     }
@@ -374,6 +692,13 @@ struct LambdaCreate : public Function {
 };
 
 struct Helper {
+    // изменение общих данных допустимо только вне потоков pmap, см. SharedMutation
+    static void CheckExclusive(Context* context) {
+        if (context->collector->IsWorker()) {
+            throw SharedMutation();
+        }
+    }
+
     static bool ConvertToBool(std::shared_ptr<Type> obj) {
         if (IsType<Bool>(obj)) {
             return AsType<Bool>(obj)->GetValue();
@@ -383,8 +708,8 @@ struct Helper {
 
     static std::shared_ptr<Type> GetOneEvaluated(std::shared_ptr<Type> obj, Context* context) {
         if (IsType<Pair>(obj)) {
-            auto next = AsType<Pair>(obj)->GetSecond();
-            if (IsType<Pair>(next) && AsType<Pair>(next)->Empty()) {
+            auto next = dynamic_cast<Pair*>(AsType<Pair>(obj)->PeekSecond());
+            if (next && next->Empty()) {
                 return AsType<Pair>(obj)->GetFirst()->Evaluate(context);
             }
             // else error
@@ -398,21 +723,144 @@ struct Helper {
             throw RuntimeError("GetAll() got not proper list");
         }
         std::vector<std::shared_ptr<Type>> result;
-        while (!head->Empty()) {
-            result.push_back(head->GetFirst());
-            head = AsType<Pair>(head->GetSecond());
+        result.reserve(head->Length());
+        // список держит obj, поэтому ячейки можно обходить по сырым указателям
+        for (Pair* cell = head.get(); !cell->Empty();
+             cell = static_cast<Pair*>(cell->PeekSecond())) {
+            result.push_back(cell->GetFirst());
+        }
+        return result;
+    }
+
+    // элементы собственного списка целых чисел в непрерывном буфере
+    static std::vector<int> GetIntegers(std::shared_ptr<Type> list) {
+        std::vector<int> result;
+        for (const auto& elem : GetAll(list)) {
+            result.push_back(AsType<Integer>(elem)->GetValue());
         }
         return result;
     }
 
+    static std::vector<int> GetIntegers(const std::vector<std::shared_ptr<Type>>& values) {
+        std::vector<int> result(values.size());
+        for (size_t i = 0; i < values.size(); ++i) {
+            result[i] = AsType<Integer>(values[i])->GetValue();
+        }
+        return result;
+    }
+
+    // структурное равенство: числа, bool и символы по значению, пары поэлементно. Значения
+    // держит вызывающий, поэтому обход идёт по сырым указателям
+    static bool Equal(const std::shared_ptr<Type>& one, const std::shared_ptr<Type>& two) {
+        std::vector<std::pair<Type*, Type*>> stack{{one.get(), two.get()}};
+        while (!stack.empty()) {
+            auto [a, b] = stack.back();
+            stack.pop_back();
+            if (a == b) {
+                continue;
+            }
+            if (auto x = dynamic_cast<Integer*>(a), y = dynamic_cast<Integer*>(b); x && y) {
+                if (x->GetValue() != y->GetValue()) {
+                    return false;
+                }
+            } else if (auto x = dynamic_cast<Bool*>(a), y = dynamic_cast<Bool*>(b); x && y) {
+                if (x->GetValue() != y->GetValue()) {
+                    return false;
+                }
+            } else if (auto x = dynamic_cast<UnknownSymbol*>(a),
+                       y = dynamic_cast<UnknownSymbol*>(b); x && y) {
+                if (x->name != y->name) {
+                    return false;
+                }
+            } else if (auto first = dynamic_cast<Pair*>(a), second = dynamic_cast<Pair*>(b);
+                       first && second) {
+                if (first->Empty() || second->Empty()) {
+                    if (first->Empty() != second->Empty()) {
+                        return false;
+                    }
+                    continue;
+                }
+                stack.emplace_back(first->PeekSecond(), second->PeekSecond());
+                stack.emplace_back(first->GetFirst().get(), second->GetFirst().get());
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // хэш, согласованный с Equal: функции и прочие объекты хэшируются по адресу
+    static size_t Hash(const std::shared_ptr<Type>& value) {
+        size_t hash = 0;
+        auto mix = [&hash](size_t part) {
+            hash ^= part + 0x9e3779b97f4a7c15 + (hash << 6) + (hash >> 2);
+        };
+        std::vector<Type*> stack{value.get()};
+        while (!stack.empty()) {
+            Type* top = stack.back();
+            stack.pop_back();
+            if (auto integer = dynamic_cast<Integer*>(top)) {
+                mix(std::hash<int>{}(integer->GetValue()));
+            } else if (auto boolean = dynamic_cast<Bool*>(top)) {
+                mix(boolean->GetValue() ? 1 : 2);
+            } else if (auto symbol = dynamic_cast<UnknownSymbol*>(top)) {
+                mix(std::hash<std::string>{}(symbol->name));
+            } else if (auto pair = dynamic_cast<Pair*>(top)) {
+                if (pair->Empty()) {
+                    mix(3);
+                } else {
+                    mix(4);
+                    stack.push_back(pair->PeekSecond());
+                    stack.push_back(pair->GetFirst().get());
+                }
+            } else {
+                mix(std::hash<Type*>{}(top));
+            }
+        }
+        return hash;
+    }
+
+    // значение без циклов, Equal и Hash обходят его за конечное число шагов. Общие подсписки
+    // допустимы: цикл - только пара, достижимая из самой себя
+    static bool Acyclic(const std::shared_ptr<Type>& value) {
+        if (!IsType<Pair>(value)) {
+            return true;
+        }
+        std::unordered_set<Type*> path, done;
+        // второй элемент - выход из пары после обхода её car и cdr
+        std::vector<std::pair<Type*, bool>> stack{{value.get(), false}};
+        while (!stack.empty()) {
+            auto [top, leave] = stack.back();
+            stack.pop_back();
+            if (leave) {
+                path.erase(top);
+                done.insert(top);
+                continue;
+            }
+            auto pair = dynamic_cast<Pair*>(top);
+            if (!pair || pair->Empty() || done.contains(top)) {
+                continue;
+            }
+            if (!path.insert(top).second) {
+                return false;
+            }
+            stack.emplace_back(top, true);
+            stack.emplace_back(pair->PeekSecond(), false);
+            stack.emplace_back(pair->GetFirst().get(), false);
+        }
+        return true;
+    }
+
+    // собственный список, проверка без исключений
+    static bool IsList(const std::shared_ptr<Type>& obj) {
+        return IsType<Pair>(obj) && AsType<Pair>(obj)->ProperList();
+    }
+
     static void CheckPair(std::shared_ptr<Type> obj) {
-        std::vector<std::shared_ptr<Type>> args;
-        try {
-            args = Helper::GetAll(obj);
-        } catch (RuntimeError) {
+        if (!IsList(obj)) {
             throw SyntaxError("CheckPair::GeAll()");
         }
-        if (args.size() != 2) {
+        if (AsType<Pair>(obj)->Length() != 2) {
             throw SyntaxError("CheckPair::args.size()");
         }
     }
@@ -0,0 +1,143 @@
+#include <atomic>
+#include <mutex>
+
+#include "interpreter_pool.h"
+
+namespace {
+
+std::atomic<uint64_t> next_pool_id = 0;
+
+}  // namespace
+
+struct InterpreterPool::State {
+    const std::vector<std::string> prelude;
+
+    std::mutex mutex;
+    // сбрасывается деструктором пула; State может пережить пул, пока на него ссылаются потоки
+    std::atomic<bool> alive = true;
+    std::vector<std::unique_ptr<Interpreter>> idle;
+    // изоляты завершившихся потоков: сбрасываются при повторной выдаче, в потоке-получателе,
+    // а не в деструкторе thread_local, когда объекты потока уже могут быть разрушены
+    std::vector<std::unique_ptr<Interpreter>> released;
+    std::unordered_map<std::thread::id, std::unique_ptr<Interpreter>> isolates;
+
+    explicit State(std::vector<std::string> prelude) : prelude(std::move(prelude)) {
+    }
+
+    void RunPrelude(Interpreter& interpreter) const {
+        for (const auto& line : prelude) {
+            interpreter.Run(line);
+        }
+    }
+
+    std::unique_ptr<Interpreter> Create() const {
+        auto interpreter = std::make_unique<Interpreter>();
+        RunPrelude(*interpreter);
+        return interpreter;
+    }
+
+    void Release(std::thread::id thread) {
+        std::lock_guard lock(mutex);
+        if (!alive) {
+            return;
+        }
+        auto it = isolates.find(thread);
+        if (it != isolates.end()) {
+            released.push_back(std::move(it->second));
+            isolates.erase(it);
+        }
+    }
+};
+
+struct InterpreterPool::LocalHandle {
+    Interpreter* interpreter;
+    std::shared_ptr<State> pool;
+
+    LocalHandle(Interpreter* interpreter, std::shared_ptr<State> pool)
+        : interpreter(interpreter), pool(std::move(pool)) {
+    }
+
+    LocalHandle(const LocalHandle&) = delete;
+
+    LocalHandle& operator=(const LocalHandle&) = delete;
+
+    ~LocalHandle() {
+        pool->Release(std::this_thread::get_id());
+    }
+};
+
+// изоляты, выданные этому потоку, по id пула. id не переиспользуются, поэтому запись
+// уничтоженного пула никогда не найдётся
+thread_local std::unordered_map<uint64_t, InterpreterPool::LocalHandle>
+    InterpreterPool::local_isolates_;
+
+InterpreterPool::InterpreterPool(std::vector<std::string> prelude)
+    : id_(next_pool_id++), state_(std::make_shared<State>(std::move(prelude))) {
+}
+
+InterpreterPool::~InterpreterPool() {
+    local_isolates_.erase(id_);
+    // изоляты разрушаются в этом потоке, а не в завершающемся потоке, держащем State
+    std::vector<std::unique_ptr<Interpreter>> isolates;
+    {
+        std::lock_guard lock(state_->mutex);
+        state_->alive = false;
+        isolates = std::move(state_->idle);
+        for (auto& isolate : state_->released) {
+            isolates.push_back(std::move(isolate));
+        }
+        for (auto& [thread, isolate] : state_->isolates) {
+            isolates.push_back(std::move(isolate));
+        }
+        state_->released.clear();
+        state_->isolates.clear();
+    }
+}
+
+Interpreter& InterpreterPool::Local() {
+    auto it = local_isolates_.find(id_);
+    if (it != local_isolates_.end()) {
+        return *it->second.interpreter;
+    }
+    std::unique_ptr<Interpreter> isolate;
+    bool stale = false;
+    {
+        std::lock_guard lock(state_->mutex);
+        if (!state_->idle.empty()) {
+            isolate = std::move(state_->idle.back());
+            state_->idle.pop_back();
+        } else if (!state_->released.empty()) {
+            isolate = std::move(state_->released.back());
+            state_->released.pop_back();
+            stale = true;
+        }
+    }
+    if (!isolate) {
+        isolate = state_->Create();
+    } else if (stale) {
+        isolate->Reset();
+        state_->RunPrelude(*isolate);
+    }
+    Interpreter* local = isolate.get();
+    {
+        std::lock_guard lock(state_->mutex);
+        state_->isolates[std::this_thread::get_id()] = std::move(isolate);
+    }
+    // записи уничтоженных пулов не нужны
+    std::erase_if(local_isolates_, [](const auto& entry) { return !entry.second.pool->alive; });
+    local_isolates_.try_emplace(id_, local, state_);
+    return *local;
+}
+
+void InterpreterPool::Prewarm(size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        auto created = state_->Create();
+        std::lock_guard lock(state_->mutex);
+        state_->idle.push_back(std::move(created));
+    }
+}
+
+size_t InterpreterPool::Size() {
+    std::lock_guard lock(state_->mutex);
+    return state_->idle.size() + state_->released.size() + state_->isolates.size();
+}
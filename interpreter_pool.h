@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "scheme.h"
+
+// Пул изолятов для многопоточного сервера. Каждый поток получает собственный Interpreter:
+// свои фабрика встроенных функций, сборщик, глобальное окружение и объекты Type. Изоляты не
+// разделяют значений, поэтому счётчики ссылок shared_ptr не трогаются из разных потоков, а
+// блокировка берётся только при первом обращении потока к пулу. Общим остаётся лишь пул
+// потоков pmap.
+//
+// prelude выполняется в каждом изоляте при создании, Prewarm создаёт изоляты заранее. Изолят
+// завершившегося потока возвращается в пул и перед выдачей другому потоку сбрасывается.
+class InterpreterPool {
+private:
+    // состояние пула, общее с записями потоков
+    struct State;
+    // запись потока о выданном ему изоляте, при завершении потока возвращает изолят
+    struct LocalHandle;
+
+    static thread_local std::unordered_map<uint64_t, LocalHandle> local_isolates_;
+
+    const uint64_t id_;
+    const std::shared_ptr<State> state_;
+
+public:
+    explicit InterpreterPool(std::vector<std::string> prelude = {});
+
+    ~InterpreterPool();
+
+    InterpreterPool(const InterpreterPool&) = delete;
+
+    InterpreterPool& operator=(const InterpreterPool&) = delete;
+
+    // изолят текущего потока; пока поток жив, возвращается один и тот же, после завершения
+    // потока изолят достанется другому потоку без прежних определений
+    Interpreter& Local();
+
+    std::string Run(std::string str) {
+        return Local().Run(std::move(str));
+    }
+
+    void Prewarm(size_t count);
+
+    // число созданных изолятов
+    size_t Size();
+};
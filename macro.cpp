@@ -0,0 +1,441 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "macro.h"
+#include "types.h"
+#include "functions.h"
+
+namespace {
+
+// Значение переменной шаблона. Под многоточием - последовательность значений по одному на
+// каждое повторение
+struct MatchTree {
+    std::shared_ptr<Type> value;
+    bool sequence = false;
+    std::vector<MatchTree> items;
+};
+
+using Bindings = std::unordered_map<std::string, MatchTree>;
+
+// метки раскрытий, общие для всех интерпретаторов
+std::atomic<uint64_t> mark_counter = 1;
+
+bool IsSymbolNamed(const std::shared_ptr<Type>& value, const char* name) {
+    return IsType<UnknownSymbol>(value) && AsType<UnknownSymbol>(value)->name == name;
+}
+
+// элементы списка и хвост после последней пары (nullptr у собственного списка)
+std::vector<std::shared_ptr<Type>> SplitList(std::shared_ptr<Type> list,
+                                             std::shared_ptr<Type>* tail) {
+    std::vector<std::shared_ptr<Type>> elems;
+    while (IsType<Pair>(list) && !AsType<Pair>(list)->Empty()) {
+        elems.push_back(AsType<Pair>(list)->GetFirst());
+        list = AsType<Pair>(list)->GetSecond();
+    }
+    *tail = IsType<Pair>(list) ? nullptr : list;
+    return elems;
+}
+
+// переменные образца, кроме литералов, _ и ...
+void CollectVariables(const std::shared_ptr<Type>& pattern,
+                      const std::vector<std::string>& literals, std::vector<std::string>* names) {
+    std::vector<std::shared_ptr<Type>> stack{pattern};
+    while (!stack.empty()) {
+        auto node = std::move(stack.back());
+        stack.pop_back();
+        if (IsType<UnknownSymbol>(node)) {
+            const std::string& name = AsType<UnknownSymbol>(node)->name;
+            if (name != "_" && name != "..." &&
+                std::find(literals.begin(), literals.end(), name) == literals.end()) {
+                names->push_back(name);
+            }
+        } else if (IsType<Pair>(node) && !AsType<Pair>(node)->Empty()) {
+            stack.push_back(AsType<Pair>(node)->GetFirst());
+            stack.push_back(AsType<Pair>(node)->GetSecond());
+        }
+    }
+}
+
+// имя, которое определяет форма тела (define x ...) или (define (f args) ...), иначе nullptr
+std::shared_ptr<UnknownSymbol> DefinedName(const std::shared_ptr<Type>& form) {
+    if (!IsType<Pair>(form) || AsType<Pair>(form)->Empty()) {
+        return nullptr;
+    }
+    auto op = AsType<Pair>(form)->GetFirst();
+    auto args = AsType<Pair>(form)->GetSecond();
+    if (!(IsType<Define>(op) || IsType<DefineMemoized>(op)) || !IsType<Pair>(args) ||
+        AsType<Pair>(args)->Empty()) {
+        return nullptr;
+    }
+    auto target = AsType<Pair>(args)->GetFirst();
+    if (IsType<Pair>(target) && !AsType<Pair>(target)->Empty()) {
+        target = AsType<Pair>(target)->GetFirst();
+    }
+    return IsType<UnknownSymbol>(target) ? AsType<UnknownSymbol>(target) : nullptr;
+}
+
+class Matcher {
+public:
+    explicit Matcher(const std::vector<std::string>& literals) : literals_(literals) {
+    }
+
+    bool Match(const std::shared_ptr<Type>& pattern, const std::shared_ptr<Type>& input,
+               Bindings* bindings) {
+        if (IsType<UnknownSymbol>(pattern)) {
+            const std::string& name = AsType<UnknownSymbol>(pattern)->name;
+            if (name == "_") {
+                return true;
+            }
+            if (std::find(literals_.begin(), literals_.end(), name) != literals_.end()) {
+                return IsSymbolNamed(input, name.c_str());
+            }
+            (*bindings)[name] = MatchTree{input, false, {}};
+            return true;
+        }
+        if (!IsType<Pair>(pattern)) {
+            return Helper::Equal(pattern, input);
+        }
+        if (AsType<Pair>(pattern)->Empty()) {
+            return IsType<Pair>(input) && AsType<Pair>(input)->Empty();
+        }
+        if (!IsType<Pair>(input)) {
+            return false;
+        }
+        std::shared_ptr<Type> pattern_tail;
+        auto elems = SplitList(pattern, &pattern_tail);
+        std::shared_ptr<Type> input_tail;
+        auto values = SplitList(input, &input_tail);
+        size_t ellipsis = elems.size();
+        for (size_t i = 1; i < elems.size(); ++i) {
+            if (IsSymbolNamed(elems[i], "...")) {
+                ellipsis = i - 1;
+                elems.erase(elems.begin() + i);
+                break;
+            }
+        }
+        if (ellipsis == elems.size()) {
+            return MatchFixed(elems, pattern_tail, values, input_tail, bindings);
+        }
+        if (pattern_tail || input_tail) {
+            return false;
+        }
+        size_t before = ellipsis;
+        size_t after = elems.size() - ellipsis - 1;
+        if (values.size() < before + after) {
+            return false;
+        }
+        size_t repeats = values.size() - before - after;
+        for (size_t i = 0; i < before; ++i) {
+            if (!Match(elems[i], values[i], bindings)) {
+                return false;
+            }
+        }
+        for (size_t i = 0; i < after; ++i) {
+            if (!Match(elems[ellipsis + 1 + i], values[before + repeats + i], bindings)) {
+                return false;
+            }
+        }
+        std::vector<std::string> names;
+        CollectVariables(elems[ellipsis], literals_, &names);
+        for (const auto& name : names) {
+            (*bindings)[name] = MatchTree{nullptr, true, {}};
+        }
+        for (size_t i = 0; i < repeats; ++i) {
+            Bindings repeat;
+            if (!Match(elems[ellipsis], values[before + i], &repeat)) {
+                return false;
+            }
+            for (const auto& name : names) {
+                (*bindings)[name].items.push_back(std::move(repeat[name]));
+            }
+        }
+        return true;
+    }
+
+private:
+    const std::vector<std::string>& literals_;
+
+    // (p1 ... pn) или (p1 ... pn . tail)
+    bool MatchFixed(const std::vector<std::shared_ptr<Type>>& elems,
+                    const std::shared_ptr<Type>& pattern_tail,
+                    const std::vector<std::shared_ptr<Type>>& values,
+                    const std::shared_ptr<Type>& input_tail, Bindings* bindings) {
+        if (values.size() < elems.size() || (!pattern_tail && values.size() != elems.size()) ||
+            (!pattern_tail && input_tail)) {
+            return false;
+        }
+        for (size_t i = 0; i < elems.size(); ++i) {
+            if (!Match(elems[i], values[i], bindings)) {
+                return false;
+            }
+        }
+        if (!pattern_tail) {
+            return true;
+        }
+        std::vector<std::shared_ptr<Type>> rest(values.begin() + elems.size(), values.end());
+        return Match(pattern_tail, Pair::MakeList(rest, input_tail), bindings);
+    }
+};
+
+class Instantiator {
+public:
+    explicit Instantiator(Bindings* bindings) : bindings_(bindings), mark_(mark_counter++) {
+    }
+
+    std::shared_ptr<Type> Instantiate(const std::shared_ptr<Type>& templ, bool in_quote) {
+        if (IsType<UnknownSymbol>(templ)) {
+            return InstantiateSymbol(templ, in_quote);
+        }
+        if (!IsType<Pair>(templ) || AsType<Pair>(templ)->Empty()) {
+            return templ;
+        }
+        auto pair = AsType<Pair>(templ);
+        if (IsType<Quote>(pair->GetFirst())) {
+            return Make<Pair>(pair->GetFirst(), Instantiate(pair->GetSecond(), true));
+        }
+        std::shared_ptr<Type> tail;
+        auto elems = SplitList(templ, &tail);
+        // (... ...) - многоточие как обычный символ
+        if (elems.size() == 2 && !tail && IsSymbolNamed(elems[0], "...")) {
+            return elems[1];
+        }
+        std::vector<std::shared_ptr<Type>> result;
+        for (size_t i = 0; i < elems.size(); ++i) {
+            if (i + 1 < elems.size() && IsSymbolNamed(elems[i + 1], "...")) {
+                InstantiateRepeated(elems[i], in_quote, &result);
+                ++i;
+            } else {
+                result.push_back(Instantiate(elems[i], in_quote));
+            }
+        }
+        return Pair::MakeList(result, tail ? Instantiate(tail, in_quote) : nullptr);
+    }
+
+private:
+    Bindings* bindings_;
+    uint64_t mark_;
+    std::unordered_map<std::string, std::shared_ptr<Type>> introduced_;
+
+    std::shared_ptr<Type> InstantiateSymbol(const std::shared_ptr<Type>& templ, bool in_quote) {
+        const std::string& name = AsType<UnknownSymbol>(templ)->name;
+        auto it = bindings_->find(name);
+        if (it != bindings_->end()) {
+            if (it->second.sequence) {
+                throw SyntaxError("Pattern variable " + name + " is used without ...");
+            }
+            return it->second.value;
+        }
+        if (in_quote) {
+            return templ;
+        }
+        // идентификатор, который вводит сам шаблон, помечается номером раскрытия
+        auto& introduced = introduced_[name];
+        if (!introduced) {
+            auto symbol = Make<UnknownSymbol>(name);
+            symbol->mark = mark_;
+            introduced = symbol;
+        }
+        return introduced;
+    }
+
+    void InstantiateRepeated(const std::shared_ptr<Type>& templ, bool in_quote,
+                             std::vector<std::shared_ptr<Type>>* result) {
+        std::vector<std::string> names;
+        CollectVariables(templ, {}, &names);
+        std::vector<std::string> repeated;
+        size_t repeats = 0;
+        for (const auto& name : names) {
+            auto it = bindings_->find(name);
+            if (it == bindings_->end() || !it->second.sequence) {
+                continue;
+            }
+            if (!repeated.empty() && it->second.items.size() != repeats) {
+                throw SyntaxError("Pattern variables under ... have different lengths");
+            }
+            repeats = it->second.items.size();
+            repeated.push_back(name);
+        }
+        if (repeated.empty()) {
+            throw SyntaxError("No pattern variable before ... in template");
+        }
+        std::vector<MatchTree> saved;
+        for (const auto& name : repeated) {
+            saved.push_back(std::move((*bindings_)[name]));
+        }
+        for (size_t i = 0; i < repeats; ++i) {
+            for (size_t j = 0; j < repeated.size(); ++j) {
+                (*bindings_)[repeated[j]] = saved[j].items[i];
+            }
+            result->push_back(Instantiate(templ, in_quote));
+        }
+        for (size_t j = 0; j < repeated.size(); ++j) {
+            (*bindings_)[repeated[j]] = std::move(saved[j]);
+        }
+    }
+};
+
+}  // namespace
+
+// -----------------------------------------------------------
+// Macro
+std::shared_ptr<Type> Macro::Expand(std::shared_ptr<Type> args) {
+    Matcher matcher(literals);
+    for (const auto& rule : rules) {
+        Bindings bindings;
+        // имя макроса в образце не сравнивается
+        if (matcher.Match(AsType<Pair>(rule.pattern)->GetSecond(), args, &bindings)) {
+            return Instantiator(&bindings).Instantiate(rule.templ, false);
+        }
+    }
+    throw SyntaxError("No syntax-rules pattern matches the form");
+}
+
+std::shared_ptr<Type> Macro::Apply(std::shared_ptr<Type> arg, Context* context) {
+    Helper::CheckExclusive(context);
+    Context* root = context->collector->Owner()->GetRoot();
+    auto expansion = MacroExpander().Expand(Expand(arg), root);
+    return expansion->Evaluate(context);
+}
+
+// -----------------------------------------------------------
+// MacroExpander
+std::shared_ptr<Type> MacroExpander::Expand(std::shared_ptr<Type> tree, Context* root) {
+    root_ = root;
+    expansions_ = 0;
+    try {
+        return ExpandExpression(tree);
+    } catch (...) {
+        // переименованные символы могут лежать в арене, которую освободит Interpreter::Reset
+        scopes_.clear();
+        throw;
+    }
+}
+
+std::shared_ptr<Macro> MacroExpander::FindMacro(const std::shared_ptr<Type>& op) {
+    if (!IsType<UnknownSymbol>(op)) {
+        return nullptr;
+    }
+    if (FindLocal(AsType<UnknownSymbol>(op))) {
+        return nullptr;
+    }
+    auto it = root_->var.find(AsType<UnknownSymbol>(op)->name);
+    if (it == root_->var.end() || !IsType<Macro>(it->second)) {
+        return nullptr;
+    }
+    return AsType<Macro>(it->second);
+}
+
+void MacroExpander::ExpandSequence(std::shared_ptr<Type> list) {
+    while (IsType<Pair>(list) && !AsType<Pair>(list)->Empty()) {
+        auto cell = AsType<Pair>(list);
+        cell->SetFirst(ExpandExpression(cell->GetFirst()));
+        list = cell->GetSecond();
+    }
+}
+
+const MacroExpander::Local* MacroExpander::FindLocal(const std::shared_ptr<UnknownSymbol>& symbol) {
+    for (size_t i = scopes_.size(); i-- > 0;) {
+        for (const auto& local : scopes_[i]) {
+            if (local.name == symbol->name && local.mark == symbol->mark) {
+                return &local;
+            }
+        }
+    }
+    return nullptr;
+}
+
+std::shared_ptr<Type> MacroExpander::Resolve(std::shared_ptr<Type> symbol) {
+    auto local = FindLocal(AsType<UnknownSymbol>(symbol));
+    if (local && local->renamed) {
+        return local->renamed;
+    }
+    // свободный символ, в том числе введённый шаблоном, ищется по имени как обычно
+    return symbol;
+}
+
+void MacroExpander::ExpandBody(std::shared_ptr<Type> params, std::shared_ptr<Type> body) {
+    std::vector<Local> scope;
+    // имя, введённое шаблоном, переименовывается, чтобы не перекрыть переменную вызывающего
+    auto bind = [&scope](const std::shared_ptr<UnknownSymbol>& symbol) {
+        Local local{symbol->name, symbol->mark, nullptr};
+        if (symbol->mark != 0) {
+            local.renamed = Make<UnknownSymbol>(symbol->name + "." + std::to_string(symbol->mark));
+        }
+        scope.push_back(local);
+        return local.renamed;
+    };
+    while (IsType<Pair>(params) && !AsType<Pair>(params)->Empty()) {
+        auto cell = AsType<Pair>(params);
+        if (IsType<UnknownSymbol>(cell->GetFirst())) {
+            if (auto renamed = bind(AsType<UnknownSymbol>(cell->GetFirst()))) {
+                cell->SetFirst(renamed);
+            }
+        }
+        params = cell->GetSecond();
+    }
+    // внутренние define видны во всём теле, как параметры; сами формы переименовывает Resolve
+    for (auto form = body; IsType<Pair>(form) && !AsType<Pair>(form)->Empty();
+         form = AsType<Pair>(form)->GetSecond()) {
+        if (auto name = DefinedName(AsType<Pair>(form)->GetFirst())) {
+            bind(name);
+        }
+    }
+    scopes_.push_back(std::move(scope));
+    ExpandSequence(body);
+    scopes_.pop_back();
+}
+
+std::shared_ptr<Type> MacroExpander::ExpandExpression(std::shared_ptr<Type> expr) {
+    while (IsType<Pair>(expr) && !AsType<Pair>(expr)->Empty()) {
+        auto macro = FindMacro(AsType<Pair>(expr)->GetFirst());
+        if (!macro) {
+            break;
+        }
+        if (++expansions_ > kMaxExpansions) {
+            throw SyntaxError("Too many macro expansions");
+        }
+        expr = macro->Expand(AsType<Pair>(expr)->GetSecond());
+    }
+    if (IsType<UnknownSymbol>(expr)) {
+        return Resolve(expr);
+    }
+    if (!IsType<Pair>(expr) || AsType<Pair>(expr)->Empty()) {
+        return expr;
+    }
+    auto pair = AsType<Pair>(expr);
+    auto op = pair->GetFirst();
+    if (IsType<Quote>(op) || IsType<DefineSyntax>(op)) {
+        return expr;
+    }
+    auto args = pair->GetSecond();
+    bool has_first = IsType<Pair>(args) && !AsType<Pair>(args)->Empty();
+    if (IsType<LambdaCreate>(op) && has_first) {
+        ExpandBody(AsType<Pair>(args)->GetFirst(), AsType<Pair>(args)->GetSecond());
+        return expr;
+    }
+    if ((IsType<Define>(op) || IsType<DefineMemoized>(op) || IsType<Set>(op)) && has_first) {
+        auto target = AsType<Pair>(args)->GetFirst();
+        auto rest = AsType<Pair>(args)->GetSecond();
+        if (IsType<Pair>(target) && !AsType<Pair>(target)->Empty()) {
+            // (define (f args) body)
+            auto name = AsType<Pair>(target)->GetFirst();
+            if (IsType<UnknownSymbol>(name)) {
+                AsType<Pair>(target)->SetFirst(Resolve(name));
+            }
+            ExpandBody(AsType<Pair>(target)->GetSecond(), rest);
+        } else {
+            if (IsType<UnknownSymbol>(target)) {
+                AsType<Pair>(args)->SetFirst(Resolve(target));
+            }
+            ExpandSequence(rest);
+        }
+        return expr;
+    }
+    ExpandSequence(expr);
+    return expr;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "types.h"
+#include "functions.h"
+
+// Проход по дереву после Interpreter::ParseTypes: формы, оператор которых - глобальный макрос,
+// заменяются раскрытием. Раскрытие выполняется один раз при анализе выражения, поэтому
+// производные формы (let, cond, ...) не стоят ничего при вычислении, а Optimizer и Compiler
+// видят уже раскрытый код. Параметры лямбд затеняют макросы с тем же именем.
+// Образцы и шаблоны syntax-rules - в Macro::Expand (macro.cpp)
+class MacroExpander {
+private:
+    // раскрытий на одно выражение: защита от макросов, которые раскрываются бесконечно
+    static constexpr size_t kMaxExpansions = 10000;
+
+    // Параметр лямбды. Параметр, введённый шаблоном макроса (mark != 0), получает новое имя
+    // renamed, и ссылки с той же меткой в теле заменяются на него: так временные переменные
+    // шаблона не перехватывают переменные в месте использования
+    struct Local {
+        std::string name;
+        uint64_t mark;
+        std::shared_ptr<Type> renamed;
+    };
+
+    Context* root_ = nullptr;
+    size_t expansions_ = 0;
+    // внутренний - последний
+    std::vector<std::vector<Local>> scopes_;
+
+    std::shared_ptr<Type> ExpandExpression(std::shared_ptr<Type> expr);
+
+    void ExpandSequence(std::shared_ptr<Type> list);
+
+    // тело лямбды с параметрами params
+    void ExpandBody(std::shared_ptr<Type> params, std::shared_ptr<Type> body);
+
+    std::shared_ptr<Macro> FindMacro(const std::shared_ptr<Type>& op);
+
+    const Local* FindLocal(const std::shared_ptr<UnknownSymbol>& symbol);
+
+    std::shared_ptr<Type> Resolve(std::shared_ptr<Type> symbol);
+
+public:
+    std::shared_ptr<Type> Expand(std::shared_ptr<Type> tree, Context* root);
+};
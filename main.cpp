@@ -1,383 +1,1471 @@
-#include <cassert>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <source_location>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "scheme.h"
+#include "interpreter_pool.h"
+#include "parser.h"
+#include "thread_pool.h"
+#include "test_runner.h"
 
 class SchemeTest {
 public:
-    void ExpectEq(std::string expression, const std::string& result) {
-        assert(interpreter_.Run(expression) == result);
+    SchemeTest(Engine engine = Engine::TREE) {
+        interpreter_.SetEngine(engine);
+    }
+
+    void ExpectEq(std::string expression, const std::string& result,
+                  std::source_location where = std::source_location::current()) {
+        std::string actual = interpreter_.Run(expression);
+        if (actual != result) {
+            FailCheck(where.file_name(), where.line(),
+                      expression + " gave " + actual + ", expected " + result);
+        }
     }
 
     void Execute(std::string expression) {
         interpreter_.Run(expression);
     }
 
+    template <typename E>
+    void ExpectError(std::string expression,
+                     std::source_location where = std::source_location::current()) {
+        try {
+            interpreter_.Run(expression);
+        } catch (const E&) {
+            return;
+        }
+        FailCheck(where.file_name(), where.line(), expression + " did not throw");
+    }
+
+    RuntimeStats Stats() const {
+        return interpreter_.GetStats();
+    }
+
 private:
     Interpreter interpreter_;
 };
 
+TEST_CASE(Boolean) {
+    SchemeTest t;
+
+    t.ExpectEq("#t", "#t");
+    t.ExpectEq("#f", "#f");
+
+    t.ExpectEq("(boolean? #t)", "#t");
+    t.ExpectEq("(boolean? #f)", "#t");
+    t.ExpectEq("(boolean? 1)", "#f");
+    t.ExpectEq("(boolean? '())", "#f");
+
+    t.ExpectEq("(not #f)", "#t");
+    t.ExpectEq("(not #t)", "#f");
+    t.ExpectEq("(not 1)", "#f");
+    t.ExpectEq("(not 0)", "#f");
+    t.ExpectEq("(not '())", "#f");
+
+    // (and <test>)
+    // The <test> expressions are evaluated from left to right, and the value of the first
+    // expression that evaluates to a false value is returned. Any remaining expressions are not
+    // evaluated. If all the expressions evaluate to true values, the value of the last expression
+    // is returned. If there are no expressions then #t is returned.
+
+    t.ExpectEq("(and)", "#t");
+    t.ExpectEq("(and (= 2 2) (> 2 1))", "#t");
+    t.ExpectEq("(and (= 2 2) (< 2 1))", "#f");
+    t.ExpectEq("(and 1 2 'c '(f g))", "(f g)");
+
+    // (or <test>)
+    // The <test> expressions are evaluated from left to right, and the value of the first
+    // expression that evaluates to a true value is returned. Any remaining expressions are not
+    // evaluated. If all expressions evaluate to false values, the value of the last expression is
+    // returned. If there are no expressions then #f is returned.
+
+    t.ExpectEq("(or)", "#f");
+    t.ExpectEq("(or (not (= 2 2)) (> 2 1))", "#t");
+    t.ExpectEq("(or #f (< 2 1))", "#f");
+    t.ExpectEq("(or #f 1)", "1");
+}
 
-int main() {
-    {
-        // Bolean
-        SchemeTest t;
-
-        t.ExpectEq("#t", "#t");
-        t.ExpectEq("#f", "#f");
-
-        t.ExpectEq("(boolean? #t)", "#t");
-        t.ExpectEq("(boolean? #f)", "#t");
-        t.ExpectEq("(boolean? 1)", "#f");
-        t.ExpectEq("(boolean? '())", "#f");
-
-        t.ExpectEq("(not #f)", "#t");
-        t.ExpectEq("(not #t)", "#f");
-        t.ExpectEq("(not 1)", "#f");
-        t.ExpectEq("(not 0)", "#f");
-        t.ExpectEq("(not '())", "#f");
-
-        // (and <test>)
-        // The <test> expressions are evaluated from left to right, and the value of the first
-        // expression that evaluates to a false value is returned. Any remaining expressions are not
-        // evaluated. If all the expressions evaluate to true values, the value of the last expression
-        // is returned. If there are no expressions then #t is returned.
-
-        t.ExpectEq("(and)", "#t");
-        t.ExpectEq("(and (= 2 2) (> 2 1))", "#t");
-        t.ExpectEq("(and (= 2 2) (< 2 1))", "#f");
-        t.ExpectEq("(and 1 2 'c '(f g))", "(f g)");
-
-        // (or <test>)
-        // The <test> expressions are evaluated from left to right, and the value of the first
-        // expression that evaluates to a true value is returned. Any remaining expressions are not
-        // evaluated. If all expressions evaluate to false values, the value of the last expression is
-        // returned. If there are no expressions then #f is returned.
-
-        t.ExpectEq("(or)", "#f");
-        t.ExpectEq("(or (not (= 2 2)) (> 2 1))", "#t");
-        t.ExpectEq("(or #f (< 2 1))", "#f");
-        t.ExpectEq("(or #f 1)", "1");
-    }
+TEST_CASE(Quote) {
+    SchemeTest t;
 
-    {
-        // Quote
-        SchemeTest t;
 
+    t.ExpectEq("(quote (1 2))", "(1 2)");
+    t.ExpectEq("'(1 2)", "(1 2)");
+}
 
-        t.ExpectEq("(quote (1 2))", "(1 2)");
-        t.ExpectEq("'(1 2)", "(1 2)");
-    }
+TEST_CASE(Integer) {
+    SchemeTest t;
+
+    t.ExpectEq("4", "4");
+    t.ExpectEq("-14", "-14");
+    t.ExpectEq("+14", "14");
+
+    t.ExpectEq("(number? -1)", "#t");
+    t.ExpectEq("(number? 1)", "#t");
+    t.ExpectEq("(number? #t)", "#f");
+
+    // =, <, >, <=, >=
+    // These procedures return #t if their arguments are (respectively): equal,
+    // monotonically increasing, monotonically decreasing, monotonically nondecreasing,
+    // or monotonically nonincreasing.
+
+    t.ExpectEq("(=)", "#t");
+    t.ExpectEq("(>)", "#t");
+    t.ExpectEq("(<)", "#t");
+    t.ExpectEq("(>=)", "#t");
+    t.ExpectEq("(<=)", "#t");
+
+    t.ExpectEq("(= 1 2)", "#f");
+    t.ExpectEq("(= 1 1)", "#t");
+    t.ExpectEq("(= 1 1 1)", "#t");
+    t.ExpectEq("(= 1 1 2)", "#f");
+
+    t.ExpectEq("(> 2 1)", "#t");
+    t.ExpectEq("(> 1 1)", "#f");
+    t.ExpectEq("(> 3 2 1)", "#t");
+    t.ExpectEq("(> 3 2 3)", "#f");
+
+    t.ExpectEq("(< 1 2)", "#t");
+    t.ExpectEq("(< 1 1)", "#f");
+    t.ExpectEq("(< 1 2 3)", "#t");
+    t.ExpectEq("(< 1 2 1)", "#f");
+
+    t.ExpectEq("(>= 2 1)", "#t");
+    t.ExpectEq("(>= 1 2)", "#f");
+    t.ExpectEq("(>= 3 3 2)", "#t");
+    t.ExpectEq("(>= 3 3 4)", "#f");
+
+    t.ExpectEq("(<= 2 1)", "#f");
+    t.ExpectEq("(<= 1 2)", "#t");
+    t.ExpectEq("(<= 3 3 4)", "#t");
+    t.ExpectEq("(<= 3 3 2)", "#f");
+
+    t.ExpectEq("(+ 1 2)", "3");
+    t.ExpectEq("(+ 1)", "1");
+    t.ExpectEq("(+ 1 (+ 3 4 5))", "13");
+    t.ExpectEq("(- 1 2)", "-1");
+    t.ExpectEq("(- 2 1)", "1");
+    t.ExpectEq("(- 2 1 1)", "0");
+    t.ExpectEq("(* 5 6)", "30");
+    t.ExpectEq("(* 5 6 7)", "210");
+    t.ExpectEq("(/ 4 2)", "2");
+    t.ExpectEq("(/ 4 2 2)", "1");
+
+    t.ExpectEq("(+)", "0");
+    t.ExpectEq("(*)", "1");
+
+    t.ExpectEq("(max 0)", "0");
+    t.ExpectEq("(min 0)", "0");
+
+    t.ExpectEq("(max 1 2)", "2");
+    t.ExpectEq("(min 1 2)", "1");
+
+    t.ExpectEq("(max 1 2 3 4 5)", "5");
+    t.ExpectEq("(min 1 2 3 4 5)", "1");
+
+    t.ExpectEq("(abs 10)", "10");
+    t.ExpectEq("(abs -10)", "10");
+}
 
-    {
-        // Integer
-        SchemeTest t;
-
-        t.ExpectEq("4", "4");
-        t.ExpectEq("-14", "-14");
-        t.ExpectEq("+14", "14");
-
-        t.ExpectEq("(number? -1)", "#t");
-        t.ExpectEq("(number? 1)", "#t");
-        t.ExpectEq("(number? #t)", "#f");
-
-        // =, <, >, <=, >=
-        // These procedures return #t if their arguments are (respectively): equal,
-        // monotonically increasing, monotonically decreasing, monotonically nondecreasing,
-        // or monotonically nonincreasing.
-
-        t.ExpectEq("(=)", "#t");
-        t.ExpectEq("(>)", "#t");
-        t.ExpectEq("(<)", "#t");
-        t.ExpectEq("(>=)", "#t");
-        t.ExpectEq("(<=)", "#t");
-
-        t.ExpectEq("(= 1 2)", "#f");
-        t.ExpectEq("(= 1 1)", "#t");
-        t.ExpectEq("(= 1 1 1)", "#t");
-        t.ExpectEq("(= 1 1 2)", "#f");
-
-        t.ExpectEq("(> 2 1)", "#t");
-        t.ExpectEq("(> 1 1)", "#f");
-        t.ExpectEq("(> 3 2 1)", "#t");
-        t.ExpectEq("(> 3 2 3)", "#f");
-
-        t.ExpectEq("(< 1 2)", "#t");
-        t.ExpectEq("(< 1 1)", "#f");
-        t.ExpectEq("(< 1 2 3)", "#t");
-        t.ExpectEq("(< 1 2 1)", "#f");
-
-        t.ExpectEq("(>= 2 1)", "#t");
-        t.ExpectEq("(>= 1 2)", "#f");
-        t.ExpectEq("(>= 3 3 2)", "#t");
-        t.ExpectEq("(>= 3 3 4)", "#f");
-
-        t.ExpectEq("(<= 2 1)", "#f");
-        t.ExpectEq("(<= 1 2)", "#t");
-        t.ExpectEq("(<= 3 3 4)", "#t");
-        t.ExpectEq("(<= 3 3 2)", "#f");
-
-        t.ExpectEq("(+ 1 2)", "3");
-        t.ExpectEq("(+ 1)", "1");
-        t.ExpectEq("(+ 1 (+ 3 4 5))", "13");
-        t.ExpectEq("(- 1 2)", "-1");
-        t.ExpectEq("(- 2 1)", "1");
-        t.ExpectEq("(- 2 1 1)", "0");
-        t.ExpectEq("(* 5 6)", "30");
-        t.ExpectEq("(* 5 6 7)", "210");
-        t.ExpectEq("(/ 4 2)", "2");
-        t.ExpectEq("(/ 4 2 2)", "1");
-
-        t.ExpectEq("(+)", "0");
-        t.ExpectEq("(*)", "1");
-
-        t.ExpectEq("(max 0)", "0");
-        t.ExpectEq("(min 0)", "0");
-
-        t.ExpectEq("(max 1 2)", "2");
-        t.ExpectEq("(min 1 2)", "1");
-
-        t.ExpectEq("(max 1 2 3 4 5)", "5");
-        t.ExpectEq("(min 1 2 3 4 5)", "1");
-
-        t.ExpectEq("(abs 10)", "10");
-        t.ExpectEq("(abs -10)", "10");
-    }
+TEST_CASE(List) {
+    SchemeTest t;
 
-    {
-        // List
-        SchemeTest t;
+    t.ExpectEq("'()", "()");
+    t.ExpectEq("'(1)", "(1)");
+    t.ExpectEq("'(1 2)", "(1 2)");
 
-        t.ExpectEq("'()", "()");
-        t.ExpectEq("'(1)", "(1)");
-        t.ExpectEq("'(1 2)", "(1 2)");
+    t.ExpectEq("'(1 . 2)", "(1 . 2)");
+
+    t.ExpectEq("'(1 2 . 3)", "(1 2 . 3)");
+    t.ExpectEq("'(1 2 . ())", "(1 2)");
+    t.ExpectEq("'(1 . (2 . ()))", "(1 2)");
 
-        t.ExpectEq("'(1 . 2)", "(1 . 2)");
+    t.ExpectEq("(pair? '(1 . 2))", "#t");
+    t.ExpectEq("(pair? '(1 2))", "#t");
+    t.ExpectEq("(pair? '())", "#f");
 
-        t.ExpectEq("'(1 2 . 3)", "(1 2 . 3)");
-        t.ExpectEq("'(1 2 . ())", "(1 2)");
-        t.ExpectEq("'(1 . (2 . ()))", "(1 2)");
+    t.ExpectEq("(null? '())", "#t");
+    t.ExpectEq("(null? '(1 2))", "#f");
+    t.ExpectEq("(null? '(1 . 2))", "#f");
 
-        t.ExpectEq("(pair? '(1 . 2))", "#t");
-        t.ExpectEq("(pair? '(1 2))", "#t");
-        t.ExpectEq("(pair? '())", "#f");
+    t.ExpectEq("(list? '())", "#t");
+    t.ExpectEq("(list? '(1 2))", "#t");
+    t.ExpectEq("(list? '(1 . 2))", "#f");
+    t.ExpectEq("(list? '(1 2 3 4 . 5))", "#f");
 
-        t.ExpectEq("(null? '())", "#t");
-        t.ExpectEq("(null? '(1 2))", "#f");
-        t.ExpectEq("(null? '(1 . 2))", "#f");
+    t.ExpectEq("(cons 1 2)", "(1 . 2)");
 
-        t.ExpectEq("(list? '())", "#t");
-        t.ExpectEq("(list? '(1 2))", "#t");
-        t.ExpectEq("(list? '(1 . 2))", "#f");
-        t.ExpectEq("(list? '(1 2 3 4 . 5))", "#f");
+    t.ExpectEq("(car '(1 . 2))", "1");
+    t.ExpectEq("(car '(1))", "1");
+    t.ExpectEq("(car '(1 2 3))", "1");
 
-        t.ExpectEq("(cons 1 2)", "(1 . 2)");
+    t.ExpectEq("(cdr '(1 . 2))", "2");
+    t.ExpectEq("(cdr '(1))", "()");
+    t.ExpectEq("(cdr '(1 2))", "(2)");
+    t.ExpectEq("(cdr '(1 2 3))", "(2 3)");
+    t.ExpectEq("(cdr '(1 2 3 . 4))", "(2 3 . 4)");
 
-        t.ExpectEq("(car '(1 . 2))", "1");
-        t.ExpectEq("(car '(1))", "1");
-        t.ExpectEq("(car '(1 2 3))", "1");
+    t.ExpectEq("(list)", "()");
+    t.ExpectEq("(list 1)", "(1)");
+    t.ExpectEq("(list 1 2 3)", "(1 2 3)");
 
-        t.ExpectEq("(cdr '(1 . 2))", "2");
-        t.ExpectEq("(cdr '(1))", "()");
-        t.ExpectEq("(cdr '(1 2))", "(2)");
-        t.ExpectEq("(cdr '(1 2 3))", "(2 3)");
-        t.ExpectEq("(cdr '(1 2 3 . 4))", "(2 3 . 4)");
+    t.ExpectEq("(list-ref '(1 2 3) 1)", "2");
+    t.ExpectEq("(list-tail '(1 2 3) 1)", "(2 3)");
+    t.ExpectEq("(list-tail '(1 2 3) 3)", "()");
+}
 
-        t.ExpectEq("(list)", "()");
-        t.ExpectEq("(list 1)", "(1)");
-        t.ExpectEq("(list 1 2 3)", "(1 2 3)");
+TEST_CASE(If) {
+    SchemeTest t;
 
-        t.ExpectEq("(list-ref '(1 2 3) 1)", "2");
-        t.ExpectEq("(list-tail '(1 2 3) 1)", "(2 3)");
-        t.ExpectEq("(list-tail '(1 2 3) 3)", "()");
-    }
+    t.ExpectEq("(if #t 0)", "0");
+    t.ExpectEq("(if #f 0)", "()");
+    t.ExpectEq("(if (= 2 2) (+ 1 10))", "11");
+    t.ExpectEq("(if (= 2 3) (+ 1 10) 5)", "5");
 
-    {
-        // If
-        SchemeTest t;
+    t.Execute("(define x 1)");
+
+    t.Execute("(if #f (set! x 2))");
+    t.ExpectEq("x", "1");
+
+    t.Execute("(if #t (set! x 4) (set! x 3))");
+    t.ExpectEq("x", "4");
+}
+
+TEST_CASE(SymbolsAreNotSelfEvaluating) {
+    SchemeTest t;
+    t.ExpectEq("'x", "x");
+    t.ExpectEq("(quote x)", "x");
+}
+
+TEST_CASE(SymbolPredicate) {
+    SchemeTest t;
+    t.ExpectEq("(symbol? 'x)", "#t");
+    t.ExpectEq("(symbol? 1)", "#f");
+}
+
+TEST_CASE(SymbolsAreUsedAsVariableNames) {
+    SchemeTest t;
+    t.Execute("(define x (+ 1 2))");
+    t.ExpectEq("x", "3");
+
+    t.Execute("(define x (+ 2 2))");
+    t.ExpectEq("x", "4");
+}
+
+TEST_CASE(SetOverrideVariables) {
+    SchemeTest t;
+
+    t.Execute("(define x 1)");
+    t.ExpectEq("x", "1");
+
+    t.Execute("(set! x (+ 2 4))");
+    t.ExpectEq("x", "6");
+}
+
+TEST_CASE(CopySemantics) {
+    SchemeTest t;
+
+    t.Execute("(define x 1)");
+    t.Execute("(define y x)");
+    t.ExpectEq("x", "1");
+    t.ExpectEq("y", "1");
+    t.Execute("(define x y)");
+    t.Execute("(set! y (+ 1 y))");
+    t.ExpectEq("y", "2");
+    t.ExpectEq("x", "1");
+}
+
+TEST_CASE(PairMutations) {
+    SchemeTest t;
+
+    t.Execute("(define x '(1 . 2))");
 
-        t.ExpectEq("(if #t 0)", "0");
-        t.ExpectEq("(if #f 0)", "()");
-        t.ExpectEq("(if (= 2 2) (+ 1 10))", "11");
-        t.ExpectEq("(if (= 2 3) (+ 1 10) 5)", "5");
+    t.Execute("(set-car! x 5)");
+    t.ExpectEq("(car x)", "5");
 
-        t.Execute("(define x 1)");
+    t.Execute("(set-cdr! x 6)");
+    t.ExpectEq("(cdr x)", "6");
 
-        t.Execute("(if #f (set! x 2))");
-        t.ExpectEq("x", "1");
+    t.Execute("(define z 1543)");
+
+    t.Execute("(set-cdr! x z)");
+    t.ExpectEq("(cdr x)", "1543");
+
+    t.Execute("(set-car! x z)");
+    t.ExpectEq("(car x)", "1543");
+}
+
+TEST_CASE(SimpleLambda) {
+    SchemeTest t;
+
+    t.ExpectEq("((lambda (x) (+ 1 x)) 5)", "6");
+}
+
+TEST_CASE(LambdaBodyHasImplicitBegin) {
+    SchemeTest t;
+
+    t.Execute("(define test (lambda (x) (set! x (* x 2)) (+ 1 x)))");
+    t.ExpectEq("(test 20)", "41");
+}
+
+TEST_CASE(SlowSum) {
+    SchemeTest t;
+
+    t.Execute("(define slow-add (lambda (x y) (if (= x 0) y (slow-add (- x 1) (+ y 1)))))");
+    t.ExpectEq("(slow-add 3 3)", "6");
+    t.ExpectEq("(slow-add 100 100)", "200");
+}
+
+TEST_CASE(LambdaClosure) {
+    SchemeTest t;
+
+    t.Execute("(define x 1)");
+
+    t.Execute(R"EOF(
+    (define range
+      (lambda (x)
+        (lambda ()
+          (set! x (+ x 1))
+          x)))
+                )EOF");
+
+    // (define range (lambda (x) (lambda () (set! x (+ x 1)) x)))
+
+    t.Execute("(define my-range (range 10))");
+    t.ExpectEq("(my-range)", "11");
+    t.ExpectEq("(my-range)", "12");
+    t.ExpectEq("(my-range)", "13");
+
+    t.ExpectEq("x", "1");
+}
+
+TEST_CASE(DefineLambdaSugar) {
+    SchemeTest t;
+
+    t.Execute("(define (inc x) (+ x 1))");
+    t.ExpectEq("(inc -1)", "0");
+
+    t.Execute("(define (add x y) (+ x y 1))");
+    t.ExpectEq("(add -10 10)", "1");
+
+    t.Execute("(define (zero) 0)");
+    t.ExpectEq("(zero)", "0");
+}
+
+TEST_CASE(LambdaMultipleRecurseCalls) {
+    SchemeTest t;
+
+    t.Execute("(define (fib x) (if (< x 3) 1 (+ (fib (- x 1)) (fib (- x 2)) )))");
+    t.ExpectEq("(fib 1)", "1");
+    t.ExpectEq("(fib 2)", "1");
+    t.ExpectEq("(fib 3)", "2");
+    t.ExpectEq("(fib 7)", "13");
+    t.ExpectEq("(fib 8)", "21");
+}
+
+TEST_CASE(MutualCalls) {
+    SchemeTest t;
+
+    t.Execute("(define (foo x) (if (< x 2) 42 (bar (- x 1))))");
+    t.Execute("(define (bar x) (if (< x 2) 24 (foo (/ x 2))))");
+    t.ExpectEq("(foo 3)", "42");
+    t.ExpectEq("(foo 6)", "24");
+    t.ExpectEq("(bar 7)", "42");
+    t.ExpectEq("(bar 13)", "24");
+}
+
+TEST_CASE(CyclicLocalContextDependencies) {
+    SchemeTest t;
+
+    t.Execute(R"EOF(
+    (define (foo x)
+        (define (bar) (set! x (+ (* x 2) 2)) x)
+        bar
+    )
+)EOF");
+    t.Execute("(define my-foo (foo 20))");
+    t.Execute("(define foo 1543)");
+    t.ExpectEq("(my-foo)", "42");
+}
+
+TEST_CASE(ClosuresSurviveCollection) {
+    SchemeTest t;
+
+    t.Execute("(define (mk x) (lambda () x))");
+    t.Execute("(define fs (list (mk 1) (mk 2)))");
+    t.ExpectEq("((car fs))", "1");
+    t.ExpectEq("((car (cdr fs)))", "2");
+
+    t.Execute("(define (a x) (define (b y) (lambda () (+ x y))) (b 2))");
+    t.Execute("(define f (a 1))");
+    t.ExpectEq("(f)", "3");
+}
+
+TEST_CASE(RuntimeStats) {
+    SchemeTest t;
+
+    t.Execute("(define (mk x) (lambda () x))");
+    t.Execute("(define fs (list (mk 1) (mk 2)))");
+    t.ExpectEq("(+ 1 (+ 2 (+ 3 4)))", "10");
+
+    RuntimeStats stats = t.Stats();
+    CHECK(stats.collections == 3);
+    CHECK(stats.live_closures == 3);
+    CHECK(stats.live_pairs == 2);
+    CHECK(stats.live_contexts == 3);
+    CHECK(stats.allocated_frames == 2);
+    CHECK(stats.max_depth == 4);
+    std::string text = stats.ToPrometheus();
+    CHECK(text.find("scheme_live_closures 3\n") != std::string::npos);
+    CHECK(text.find("scheme_allocated_frames_total 2\n") != std::string::npos);
+    CHECK(text.find("scheme_gc_pause_seconds_count 3\n") != std::string::npos);
+    CHECK(text.find("le=\"+Inf\"} 3\n") != std::string::npos);
+
+    t.ExpectEq("(list? (runtime-stats))", "#t");
+    t.ExpectEq("(cdr (assoc 'collections (runtime-stats)))", "4");
+}
+
+TEST_CASE(GlobalLookupCache) {
+    SchemeTest t;
+
+    t.Execute("(define x 1)");
+    t.Execute("(define (f) x)");
+    t.ExpectEq("(f)", "1");
+    t.Execute("(define (g x) (f))");
+    t.ExpectEq("(g 5)", "1");
+    t.Execute("(define (h x) x)");
+    t.ExpectEq("(h 7)", "7");
+    t.Execute("(define (k) (define x 3) x)");
+    t.ExpectEq("(k)", "3");
+    t.ExpectEq("x", "1");
+    t.Execute("(set! x 10)");
+    t.ExpectEq("(f)", "10");
+    t.Execute("(define x 11)");
+    t.ExpectEq("(f)", "11");
+
+    t.Execute("(define (mk c) (if c (define y 1)) (lambda () y))");
+    t.Execute("(define y 2)");
+    t.ExpectEq("((mk #f))", "2");
+    t.ExpectEq("((mk #t))", "1");
+    t.ExpectEq("((mk #f))", "2");
+
+    t.Execute("(define (fib n) (if (< n 3) 1 (+ (fib (- n 1)) (fib (- n 2)))))");
+    t.ExpectEq("(fib 15)", "610");
+    t.Execute("(define fib (lambda (n) 0))");
+    t.ExpectEq("(fib 15)", "0");
+}
+
+TEST_CASE(ConstantFolding) {
+    SchemeTest t;
+
+    t.Execute("(define (f x) (+ x (* 2 3) (car '(1 2))))");
+    t.ExpectEq("(f 1)", "8");
+    t.Execute("(define (g) (if (< 1 2) 'yes (undefined)))");
+    t.ExpectEq("(g)", "yes");
+    t.ExpectEq("(if #f 0)", "()");
+    t.ExpectEq("(cdr '(1 2 3))", "(2 3)");
+    t.ExpectEq("(and 1 (= 1 1) 'c)", "c");
+    t.ExpectEq("(or #f (< 2 1))", "#f");
+
+    t.Execute("(define x #f)");
+    t.ExpectEq("(and #t x 1)", "#f");
+    t.ExpectEq("(or #f x 1)", "1");
+    t.ExpectEq("(and 1 #f x)", "#f");
+
+    t.Execute("(define (h) (/ 1 0))");
+    t.ExpectError<RuntimeError>("(h)");
+    t.ExpectEq("(if #f (/ 1 0) 2)", "2");
+    t.ExpectError<NameError>("(car '(y))");
+    t.ExpectError<SyntaxError>("(define + 1)");
+
+    t.Execute("(define l (cdr '(1 2)))");
+    t.Execute("(set-car! l 5)");
+    t.ExpectEq("l", "(5)");
+    t.Execute("(define (fresh) (list 1 2))");
+    t.Execute("(define m (fresh))");
+    t.Execute("(set-car! m 5)");
+    t.ExpectEq("(fresh)", "(1 2)");
+
+    // car вычисляет выбранный элемент; формы из литерала не сворачиваются и видят настоящее
+    // окружение
+    t.Execute("(define z 1)");
+    t.Execute("(car '((define z 5)))");
+    t.ExpectEq("z", "5");
+    t.Execute("(define z 2)");
+    t.ExpectEq("((car '((lambda (a) (+ a z)))) 1)", "3");
+    t.ExpectEq("(car '(z))", "2");
+    t.ExpectEq("(list-ref '(1 #t 3) 1)", "#t");
+    t.ExpectEq("(list-tail '(1 2 3) 2)", "(3)");
+}
 
-        t.Execute("(if #t (set! x 4) (set! x 3))");
-        t.ExpectEq("x", "4");
+TEST_CASE(NumericReductions) {
+    SchemeTest t;
+
+    t.ExpectEq("(sum '())", "0");
+    t.ExpectEq("(sum '(1 2 3 4 5))", "15");
+    t.ExpectEq("(product '(1 2 3 4 5))", "120");
+    t.ExpectEq("(product '())", "1");
+    t.ExpectEq("(product '(65536 65536 0))", "0");
+    t.ExpectEq("(* 65536 65536 0)", "0");
+    t.ExpectError<RuntimeError>("(product '(65536 65536 2))");
+    t.ExpectError<RuntimeError>("(* 65536 -65536)");
+    t.ExpectEq("(apply + '(1 2 3))", "6");
+    t.ExpectEq("(apply + 10 '(1 2 3))", "16");
+    t.ExpectEq("(apply - '(10 2 3))", "5");
+    t.ExpectEq("(apply min '(4 2 8))", "2");
+    t.ExpectEq("(apply max '(4 2 8))", "8");
+    t.ExpectEq("(apply list 1 '(2 3))", "(1 2 3)");
+    t.ExpectEq("(apply car '((1 2)))", "1");
+    t.Execute("(define (add x y) (+ x y))");
+    t.ExpectEq("(apply add '(1 2))", "3");
+
+    t.Execute("(define big '(2147483647 1))");
+    t.ExpectError<RuntimeError>("(sum big)");
+    t.ExpectError<RuntimeError>("(apply + big)");
+    t.ExpectError<RuntimeError>("(+ 2147483647 1)");
+    t.ExpectEq("(sum '(2147483647 1 -2))", "2147483646");
+    t.ExpectError<RuntimeError>("(product '(65536 65536))");
+    t.ExpectError<RuntimeError>("(apply min '())");
+    t.ExpectError<RuntimeError>("(sum '(1 #t))");
+}
+
+TEST_CASE(ListLibrary) {
+    SchemeTest t;
+
+    t.ExpectEq("(map (lambda (x) (* x x)) '(1 2 3))", "(1 4 9)");
+    t.ExpectEq("(map + '(1 2 3) '(10 20))", "(11 22)");
+    t.ExpectEq("(map car '((1 2) (3 4)))", "(1 3)");
+    t.ExpectEq("(map (lambda (x) x) '())", "()");
+    t.ExpectEq("(filter (lambda (x) (> x 2)) '(1 2 3 4))", "(3 4)");
+    t.ExpectEq("(fold + 0 '(1 2 3))", "6");
+    t.ExpectEq("(fold cons '() '(1 2 3))", "(3 2 1)");
+    t.ExpectEq("(append)", "()");
+    t.ExpectEq("(append '(1 2) '(3) '() '(4 5))", "(1 2 3 4 5)");
+    t.ExpectEq("(append '(1) 2)", "(1 . 2)");
+    t.ExpectEq("(reverse '(1 2 3))", "(3 2 1)");
+    t.ExpectEq("(length '())", "0");
+    t.ExpectEq("(length '(1 2 3))", "3");
+    t.ExpectError<RuntimeError>("(length '(1 . 2))");
+    t.ExpectEq("(assoc 2 '((1 . a) (2 . b)))", "(2 . b)");
+    t.ExpectEq("(assoc '(x y) '((1 . a) ((x y) . b)))", "((x y) . b)");
+    t.ExpectEq("(assoc 3 '((1 . a)))", "#f");
+    t.ExpectEq("(member 2 '(1 2 3))", "(2 3)");
+    t.ExpectEq("(member 'c '(a b))", "#f");
+
+    t.Execute("(define (range n) (if (= n 0) '() (cons n (range (- n 1)))))");
+    t.Execute("(define xs (range 200))");
+    t.ExpectEq("(length (filter (lambda (x) (= 0 (- x (* 2 (/ x 2))))) xs))", "100");
+    t.ExpectEq("(fold (lambda (x acc) (+ x acc)) 0 (map (lambda (x) (* 2 x)) xs))", "40200");
+}
+
+TEST_CASE(ParallelMap) {
+    SchemeTest t;
+
+    t.Execute("(define (fib x) (if (< x 3) 1 (+ (fib (- x 1)) (fib (- x 2)))))");
+    t.ExpectEq("(pmap fib '(1 2 3 4 5 6 7 8 9 10))", "(1 1 2 3 5 8 13 21 34 55)");
+    t.ExpectEq("(pmap (lambda (x) (* x x)) '(1 2 3))", "(1 4 9)");
+    t.ExpectEq("(pmap (lambda (x) (map (lambda (y) (+ x y)) '(1 2))) '(10 20))",
+               "((11 12) (21 22))");
+    t.ExpectEq("(pmap (lambda (x) (pmap + (list x x))) '(1 2))", "((1 1) (2 2))");
+    t.ExpectEq("(pmap car '((1) (2)))", "(1 2)");
+    t.ExpectEq("(pmap fib '())", "()");
+
+    t.Execute("(define fs (pmap (lambda (x) (define y (* 2 x)) (lambda () y)) '(1 2 3)))");
+    t.ExpectEq("((car (cdr fs)))", "4");
+    t.ExpectEq("(map (lambda (f) (f)) fs)", "(2 4 6)");
+
+    t.Execute("(define counter 0)");
+    t.Execute("(define (bump x) (set! counter (+ counter 1)) x)");
+    t.ExpectEq("(pmap (lambda (x) (bump x)) '(1 2 3 4))", "(1 2 3 4)");
+    t.ExpectEq("counter", "4");
+
+    t.ExpectError<RuntimeError>("(pmap (lambda (x) (/ 1 x)) '(1 0 2))");
+    t.ExpectError<NameError>("(pmap (lambda (x) undefined) '(1 2))");
+    t.ExpectEq("(fib 10)", "55");
+}
+
+// общий пул из threads рабочих потоков на время случая: параллельные ветви проверяются и на
+// машине с одним ядром
+class SharedPoolScope {
+public:
+    explicit SharedPoolScope(size_t threads) : pool_(threads) {
+        ThreadPool::SetShared(&pool_);
     }
 
-    {
-        // SymbolsAreNotSelfEvaluating
-        SchemeTest t;
-        t.ExpectEq("'x", "x");
-        t.ExpectEq("(quote x)", "x");
+    ~SharedPoolScope() {
+        ThreadPool::SetShared(nullptr);
     }
 
-    {
-        // SymbolPredicate
-        SchemeTest t;
-        t.ExpectEq("(symbol? 'x)", "#t");
-        t.ExpectEq("(symbol? 1)", "#f");
+private:
+    ThreadPool pool_;
+};
+
+TEST_CASE(ParallelMapThreads) {
+    SharedPoolScope pool(3);
+    TestParallelMap();
+
+    // изменяющая функция приходит через список, и статическая проверка её не видит:
+    // pmap вычисляется последовательно
+    SchemeTest t;
+    t.Execute("(define n 0)");
+    t.Execute("(define (spin k) (let loop ((i k)) (if (= i 0) 0 (loop (- i 1)))))");
+    t.Execute("(define (bump x) (spin 300) (set! n (+ n 1)) x)");
+    t.Execute("(define (call p) ((car p) 1))");
+    t.Execute("(define (repeat v k) (if (= k 0) '() (cons v (repeat v (- k 1)))))");
+    t.ExpectEq("(length (pmap call (repeat (list bump) 40)))", "40");
+    t.ExpectEq("n", "40");
+    t.Execute("(define (apply-to f) (f 2))");
+    t.ExpectEq("(pmap apply-to (list bump (lambda (x) (* x x)) bump))", "(2 4 2)");
+    t.ExpectEq("n", "42");
+    t.Execute("(define sq (memoize (lambda (x) (* x x))))");
+    t.ExpectEq("(pmap apply-to (list sq sq sq sq))", "(4 4 4 4)");
+    t.ExpectEq("(pmap (lambda (x) (* x 10)) '(1 2 3 4 5 6 7 8))", "(10 20 30 40 50 60 70 80)");
+}
+
+TEST_CASE(InterpreterPool) {
+    InterpreterPool pool({"(define (sq x) (* x x))", "(define calls 0)"});
+    pool.Prewarm(2);
+    CHECK(pool.Size() == 2);
+
+    std::vector<std::thread> threads;
+    std::vector<char> ok(4, true);
+    for (int k = 0; k < 4; ++k) {
+        threads.emplace_back([&pool, &ok, k] {
+            Interpreter& local = pool.Local();
+            for (int i = 0; i < 50; ++i) {
+                ok[k] = ok[k] && &pool.Local() == &local;
+                ok[k] = ok[k] && pool.Run("(sq " + std::to_string(k + i) + ")") ==
+                                     std::to_string((k + i) * (k + i));
+                pool.Run("(set! calls (+ calls 1))");
+            }
+            ok[k] = ok[k] && pool.Run("calls") == "50";
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (char thread_ok : ok) {
+        CHECK(thread_ok);
     }
+    // поток мог получить изолят уже завершившегося потока
+    CHECK(pool.Size() >= 2 && pool.Size() <= 4);
+
+    pool.Run("(define only-here 1)");
+    // CHECK в другом потоке завершил бы процесс: результат проверяется после join
+    bool thrown = false;
+    std::thread other([&pool, &thrown] {
+        try {
+            pool.Run("only-here");
+        } catch (const NameError&) {
+            thrown = true;
+        }
+    });
+    other.join();
+    CHECK(thrown);
+    CHECK(pool.Run("only-here") == "1");
+
+    // изоляты завершившихся потоков переиспользуются без прежних определений
+    bool reused = true;
+    size_t size = pool.Size();
+    for (int k = 0; k < 16; ++k) {
+        std::thread churn([&pool, &reused, k] {
+            reused = reused && pool.Run("(sq 3)") == "9" && pool.Run("calls") == "0";
+            pool.Run("(set! calls " + std::to_string(k + 1) + ")");
+        });
+        churn.join();
+    }
+    CHECK(reused);
+    CHECK(pool.Size() == size);
+}
 
-    {
-        // SymbolsAreUsedAsVariableNames
-        SchemeTest t;
-        t.Execute("(define x (+ 1 2))");
-        t.ExpectEq("x", "3");
+TEST_CASE(RunBatch) {
+    Interpreter interpreter;
+    std::vector<std::string> batch = {"(define (sq x) (* x x))", "(sq 7)", "", "(car '())",
+                                      "undefined", "(+ 1", ")", "(sq 8)"};
+    auto results = interpreter.RunBatch(batch);
+    CHECK(results.size() == batch.size());
+    CHECK(results[1].Ok() && results[1].value == "49");
+    CHECK(results[2].Ok() && results[2].value.empty());
+    CHECK(results[3].error == ErrorKind::RUNTIME);
+    CHECK(results[4].error == ErrorKind::NAME);
+    CHECK(results[5].error == ErrorKind::SYNTAX);
+    CHECK(results[6].error == ErrorKind::SYNTAX);
+    CHECK(results[7].value == "64");
+    CHECK(interpreter.GetStats().collections == 1);
+
+    // замыкание в теле: кадры вызовов достаются сборщику
+    interpreter.Run("(define (loop n) (if (= n 0) 0 ((lambda () (loop (- n 1))))))");
+    interpreter.SetCollectionBudget(50);
+    size_t collections = interpreter.GetStats().collections;
+    results = interpreter.RunBatch(std::vector<std::string>(20, "(loop 100)"));
+    CHECK(results.back().value == "0");
+    CHECK(interpreter.GetStats().collections > collections + 1);
+
+    std::istringstream in("(define x 2) (* x 3)\n(car '()) x (+ x 1)) 5");
+    std::vector<RunResult> streamed;
+    interpreter.RunStream(in, [&streamed](const RunResult& result) {
+        streamed.push_back(result);
+    });
+    CHECK(streamed.size() == 6);
+    CHECK(streamed[1].value == "6");
+    CHECK(streamed[2].error == ErrorKind::RUNTIME);
+    CHECK(streamed[3].value == "2");
+    CHECK(streamed[4].value == "3");
+    CHECK(streamed[5].error == ErrorKind::SYNTAX);
+}
 
-        t.Execute("(define x (+ 2 2))");
-        t.ExpectEq("x", "4");
+TEST_CASE(TryRun) {
+    for (Engine engine : {Engine::TREE, Engine::COMPILED}) {
+        Interpreter interpreter;
+        interpreter.SetEngine(engine);
+        CHECK(interpreter.TryRun("(define (f x) (* x 2))").Ok());
+        CHECK(interpreter.TryRun("(f 21)").value == "42");
+        CHECK(interpreter.TryRun("").Ok());
+        CHECK(interpreter.TryRun("(f 1) (f 2)").error == ErrorKind::SYNTAX);
+        CHECK(interpreter.TryRun("(if 1)").error == ErrorKind::SYNTAX);
+        CHECK(interpreter.TryRun("(if 1 2 . 3)").error == ErrorKind::SYNTAX);
+        CHECK(interpreter.TryRun("(lambda (x 1) x)").error == ErrorKind::SYNTAX);
+        CHECK(interpreter.TryRun("(lambda x x)").error == ErrorKind::SYNTAX);
+        CHECK(interpreter.TryRun("(lambda (x) . x)").error == ErrorKind::SYNTAX);
+        CHECK(interpreter.TryRun("(set! y)").error == ErrorKind::SYNTAX);
+        CHECK(interpreter.TryRun("(g 1)").error == ErrorKind::NAME);
+        RunResult result = interpreter.TryRun("(car '())");
+        CHECK(result.error == ErrorKind::RUNTIME && !result.message.empty());
+        // после ошибки окружение не повреждено
+        CHECK(interpreter.TryRun("(f 5)").value == "10");
     }
+}
 
-    {
-        // SetOverrideVariables
-        SchemeTest t;
+TEST_CASE(CallCC) {
+    SchemeTest t;
 
-        t.Execute("(define x 1)");
-        t.ExpectEq("x", "1");
+    t.ExpectEq("(call/cc (lambda (k) 1))", "1");
+    t.ExpectEq("(call/cc (lambda (k) (+ 1 (k 42))))", "42");
+    t.ExpectEq("(+ 1 (call-with-current-continuation (lambda (k) (k 2) 10)))", "3");
 
-        t.Execute("(set! x (+ 2 4))");
-        t.ExpectEq("x", "6");
-    }
+    t.Execute(R"EOF(
+        (define (find-first pred lst)
+          (call/cc (lambda (return)
+            (map (lambda (x) (if (pred x) (return x) x)) lst)
+            #f)))
+    )EOF");
+    t.ExpectEq("(find-first (lambda (x) (> x 2)) '(1 2 3 4))", "3");
+    t.ExpectEq("(find-first (lambda (x) (> x 9)) '(1 2 3 4))", "#f");
 
-    {
-        // CopySemantics
-        SchemeTest t;
-
-        t.Execute("(define x 1)");
-        t.Execute("(define y x)");
-        t.ExpectEq("x", "1");
-        t.ExpectEq("y", "1");
-        t.Execute("(define x y)");
-        t.Execute("(set! y (+ 1 y))");
-        t.ExpectEq("y", "2");
-        t.ExpectEq("x", "1");
-    }
+    t.Execute(R"EOF(
+        (define (search n exit)
+          (if (= n 0) (exit 'found) (+ 1 (search (- n 1) exit))))
+    )EOF");
+    t.ExpectEq("(call/cc (lambda (k) (search 500 k)))", "found");
+    t.ExpectEq("(call/cc (lambda (outer) (+ 1 (call/cc (lambda (inner) (outer 5))))))", "5");
+    t.ExpectEq("(call/cc (lambda (outer) (+ 1 (call/cc (lambda (inner) (inner 5))))))", "6");
+
+    t.Execute("(define saved 0)");
+    t.ExpectEq("(call/cc (lambda (k) (set! saved k) 1))", "1");
+    t.ExpectError<RuntimeError>("(saved 2)");
+    t.ExpectError<RuntimeError>("(call/cc 1)");
+}
 
-    {
-        // PairMutations
-        SchemeTest t;
+TEST_CASE(Memoize) {
+    SchemeTest t;
 
-        t.Execute("(define x '(1 . 2))");
+    t.Execute(R"EOF(
+        (define-memoized (fib n)
+          (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+    )EOF");
+    t.ExpectEq("(fib 40)", "102334155");
+
+    t.Execute("(define calls 0)");
+    t.Execute("(define (count-len lst) (set! calls (+ calls 1)) (length lst))");
+    t.Execute("(define len (memoize count-len))");
+    t.ExpectEq("(len '(1 (2 3) a))", "3");
+    t.ExpectEq("(len (list 1 (list 2 3) 'a))", "3");
+    t.ExpectEq("calls", "1");
+    t.ExpectEq("(len '(1 (2 4) a))", "3");
+    t.ExpectEq("calls", "2");
+
+    t.Execute("(define calls 0)");
+    t.Execute("(define (twice x) (set! calls (+ calls 1)) (* x 2))");
+    t.Execute("(define small (memoize twice 2))");
+    t.ExpectEq("(small 1)", "2");
+    t.ExpectEq("(small 2)", "4");
+    t.ExpectEq("(small 1)", "2");
+    t.ExpectEq("(small 3)", "6");
+    t.ExpectEq("calls", "3");
+    t.ExpectEq("(small 1)", "2");
+    t.ExpectEq("calls", "3");
+    t.ExpectEq("(small 2)", "4");
+    t.ExpectEq("calls", "4");
+
+    // замыкания в кэше переживают сборку мусора
+    t.Execute("(define adder (memoize (lambda (n) (lambda (x) (+ x n)))))");
+    t.Execute("(adder 5)");
+    t.ExpectEq("((adder 5) 1)", "6");
+    t.ExpectEq("(pmap small '(1 2 3))", "(2 4 6)");
+
+    // циклический ключ не кэшируется, вызов идёт напрямую
+    t.Execute("(define calls 0)");
+    t.Execute("(define f (memoize (lambda (l) (set! calls (+ calls 1)) 1)))");
+    t.Execute("(define l (list 1 2))");
+    t.Execute("(define m (cdr l))");
+    t.ExpectEq("(begin (set-cdr! m l) 0)", "0");
+    t.ExpectEq("(f l)", "1");
+    t.ExpectEq("(f l)", "1");
+    t.ExpectEq("calls", "2");
+    t.Execute("(define k (list 1 2))");
+    t.ExpectEq("(begin (set-car! k k) 0)", "0");
+    t.ExpectEq("(f k)", "1");
+    t.ExpectEq("calls", "3");
+    // пары не отслеживаются сборщиком: разрываем циклы сами
+    t.Execute("(set-cdr! m '())");
+    t.Execute("(set-car! k 1)");
+    // общие подсписки циклом не считаются
+    t.Execute("(define s (list 1 2))");
+    t.ExpectEq("(f (list s s))", "1");
+    t.ExpectEq("(f (list s (list 1 2)))", "1");
+    t.ExpectEq("calls", "4");
+
+    // ключ - копия аргумента, изменение списка после вызова его не трогает
+    t.Execute("(define calls 0)");
+    t.Execute("(define k (list 1))");
+    t.ExpectEq("(f k)", "1");
+    t.Execute("(set-car! k 2)");
+    t.ExpectEq("(f k)", "1");
+    t.ExpectEq("(f (list 1))", "1");
+    t.ExpectEq("calls", "2");
+    // глубокий ключ копируется без рекурсии
+    t.Execute("(define calls 0)");
+    t.Execute("(define (nest n) (do ((i 0 (+ i 1)) (acc '() (list acc))) ((= i n) acc)))");
+    t.Execute("(begin (define deep (nest 100000)) 0)");
+    t.ExpectEq("(len deep)", "1");
+    t.ExpectEq("(len deep)", "1");
+    t.ExpectEq("calls", "1");
+
+    t.ExpectError<RuntimeError>("(memoize 1)");
+    t.ExpectError<RuntimeError>("(memoize twice -1)");
+    t.ExpectError<SyntaxError>("(define-memoized f 1)");
+}
 
-        t.Execute("(set-car! x 5)");
-        t.ExpectEq("(car x)", "5");
+TEST_CASE(Compiled) {
+    for (Engine engine : {Engine::TREE, Engine::COMPILED}) {
+        SchemeTest t(engine);
 
-        t.Execute("(set-cdr! x 6)");
-        t.ExpectEq("(cdr x)", "6");
+        t.Execute("(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))");
+        t.ExpectEq("(fib 20)", "6765");
+        t.ExpectEq("(if (> 1 2) 1)", "()");
+        t.ExpectEq("'(1 2)", "(1 2)");
 
-        t.Execute("(define z 1543)");
+        // внутренний define затеняет параметр внешней лямбды
+        t.Execute(R"EOF(
+            (define (outer x)
+              ((lambda ()
+                 (define y x)
+                 (define x 10)
+                 (+ x y))))
+        )EOF");
+        t.ExpectEq("(outer 1)", "11");
+
+        // define в кадре ещё не выполнен - имя ищется в глобальном окружении
+        t.Execute("(define z 100)");
+        t.Execute("(define (late flag) (if flag (define z 1) z) z)");
+        t.ExpectEq("(late #f)", "100");
+        t.ExpectEq("(late #t)", "1");
 
-        t.Execute("(set-cdr! x z)");
-        t.ExpectEq("(cdr x)", "1543");
+        t.Execute(R"EOF(
+            (define (make-counter)
+              (define count 0)
+              (lambda () (set! count (+ count 1)) count))
+        )EOF");
+        t.Execute("(define counter (make-counter))");
+        t.ExpectEq("(counter)", "1");
+        t.ExpectEq("(counter)", "2");
+
+        // особая форма под другим именем получает аргументы невычисленными
+        t.Execute("(define my-if if)");
+        t.ExpectEq("(my-if #t 1 undefined-name)", "1");
+        t.ExpectEq("((lambda (f) (f 2 3)) +)", "5");
+        t.ExpectEq("(map (lambda (x) (* x x)) '(1 2 3))", "(1 4 9)");
+        t.ExpectEq("(< 1 2 3)", "#t");
+        t.ExpectEq("(< 2 1 #t)", "#f");
 
-        t.Execute("(set-car! x z)");
-        t.ExpectEq("(car x)", "1543");
+        t.ExpectError<SyntaxError>("(if 1)");
+        t.ExpectError<RuntimeError>("(fib 1 2)");
+        t.ExpectError<RuntimeError>("(1 2)");
+        t.ExpectError<NameError>("(fib undefined-name)");
     }
+}
 
-    {
-        // SimpleLambda
-        SchemeTest t;
+TEST_CASE(Macros) {
+    for (Engine engine : {Engine::TREE, Engine::COMPILED}) {
+        SchemeTest t(engine);
 
-        t.ExpectEq("((lambda (x) (+ 1 x)) 5)", "6");
-    }
+        t.ExpectEq("(let ((x 1) (y 2)) (+ x y))", "3");
+        t.ExpectEq("(let () 5)", "5");
+        t.ExpectEq("(let* ((x 1) (y (+ x 1))) (* x y))", "2");
+        t.ExpectEq("(begin 1 2 3)", "3");
+        t.ExpectError<SyntaxError>("(begin)");
 
-    {
-        // LambdaBodyHasImplicitBegin
-        SchemeTest t;
+        t.Execute(R"EOF(
+            (define (sign x)
+              (cond ((< x 0) -1)
+                    ((= x 0) 0)
+                    (else 1)))
+        )EOF");
+        t.ExpectEq("(sign -5)", "-1");
+        t.ExpectEq("(sign 0)", "0");
+        t.ExpectEq("(sign 7)", "1");
+        t.ExpectEq("(cond (#f 1) (2))", "2");
+        t.ExpectEq("(when (> 2 1) 1 2)", "2");
+        t.ExpectEq("(unless (> 2 1) 1 2)", "()");
+        t.ExpectEq("(unless #f 1 2)", "2");
 
-        t.Execute("(define test (lambda (x) (set! x (* x 2)) (+ 1 x)))");
-        t.ExpectEq("(test 20)", "41");
-    }
+        t.Execute(R"EOF(
+            (define-syntax swap!
+              (syntax-rules ()
+                ((_ a b) (let ((tmp a)) (set! a b) (set! b tmp)))))
+        )EOF");
+        // tmp из шаблона не перехватывает переменную пользователя
+        t.Execute("(define tmp 1)");
+        t.Execute("(define other 2)");
+        t.Execute("(swap! tmp other)");
+        t.ExpectEq("(list tmp other)", "(2 1)");
 
-    {
-        // SlowSum
-        SchemeTest t;
+        t.Execute(R"EOF(
+            (define-syntax my-or
+              (syntax-rules ()
+                ((_) #f)
+                ((_ e) e)
+                ((_ e r ...) (let ((t e)) (if t t (my-or r ...))))))
+        )EOF");
+        t.ExpectEq("(let ((t 5)) (my-or #f t))", "5");
+        t.ExpectEq("(my-or)", "#f");
+
+        // внутренний define шаблона переименовывается так же, как параметр
+        t.Execute(R"EOF(
+            (define-syntax my-or2
+              (syntax-rules ()
+                ((_ a b) ((lambda () (define t a) (if t t b))))))
+        )EOF");
+        t.Execute("(define t 5)");
+        t.ExpectEq("(my-or2 #f t)", "5");
+        t.ExpectEq("(my-or2 3 t)", "3");
+        t.Execute(R"EOF(
+            (define-syntax call-twice
+              (syntax-rules ()
+                ((_ x) ((lambda () (define (f) x) (+ (f) (f)))))))
+        )EOF");
+        t.Execute("(define (f) 100)");
+        t.ExpectEq("(call-twice (f))", "200");
 
-        t.Execute("(define slow-add (lambda (x y) (if (= x 0) y (slow-add (- x 1) (+ y 1)))))");
-        t.ExpectEq("(slow-add 3 3)", "6");
-        t.ExpectEq("(slow-add 100 100)", "200");
+        t.Execute(R"EOF(
+            (define-syntax my-list-of-pairs
+              (syntax-rules ()
+                ((_ (a b ...) ...) '((a . (b ...)) ...))))
+        )EOF");
+        t.ExpectEq("(my-list-of-pairs (1 2 3) (4))", "((1 2 3) (4))");
+
+        // параметр лямбды затеняет макрос
+        t.ExpectEq("((lambda (when) (when 1)) (lambda (x) (+ x 1)))", "2");
+
+        // макрос, определённый после функции, раскрывается при вычислении
+        t.Execute("(define (use-late x) (late-inc x))");
+        t.Execute("(define-syntax late-inc (syntax-rules () ((_ x) (+ x 1))))");
+        t.ExpectEq("(use-late 41)", "42");
+
+        t.ExpectError<SyntaxError>("(swap! 1)");
+        t.ExpectError<SyntaxError>("(define-syntax bad (lambda (x) x))");
+        t.Execute("(define-syntax forever (syntax-rules () ((_ x) (forever x))))");
+        t.ExpectError<SyntaxError>("(forever 1)");
     }
+}
 
-    {
-        // LambdaClosure
-        SchemeTest t;
+TEST_CASE(Loops) {
+    for (Engine engine : {Engine::TREE, Engine::COMPILED}) {
+        // do, named let
+        SchemeTest t(engine);
+
+        size_t allocations = t.Stats().allocated_frames;
+        t.ExpectEq("(do ((i 0 (+ i 1)) (s 0 (+ s i))) ((= i 1000) s))", "499500");
+        t.ExpectEq("(let loop ((i 0) (s 0)) (if (= i 1000) s (loop (+ i 1) (+ s i))))", "499500");
+        // один кадр на цикл, а не на итерацию
+        CHECK(t.Stats().allocated_frames - allocations <= 2);
 
-        t.Execute("(define x 1)");
+        t.ExpectEq("(do ((i 0 (+ i 1))) ((= i 3)))", "()");
+        t.ExpectEq("(do ((i 0 (+ i 1)) (x 5)) ((= i 3) x) (set! x (+ x i)))", "8");
+        t.ExpectEq("(let loop ((i 0)) (cond ((= i 5) 'done) (else (loop (+ i 1)))))", "done");
+        t.ExpectEq("(let loop ((i 0)) (when (< i 3) (loop (+ i 1))))", "()");
 
+        // замыкания видят переменные своей итерации
         t.Execute(R"EOF(
-        (define range
-          (lambda (x)
-            (lambda ()
-              (set! x (+ x 1))
-              x)))
-                    )EOF");
+            (define fs (do ((i 0 (+ i 1)) (acc '() (cons (lambda () i) acc))) ((= i 3) acc)))
+        )EOF");
+        t.ExpectEq("(map (lambda (f) (f)) fs)", "(2 1 0)");
 
-        // (define range (lambda (x) (lambda () (set! x (+ x 1)) x)))
+        // вызов не в хвостовой позиции: обычная рекурсия
+        t.ExpectEq("(let f ((n 10)) (if (= n 0) 0 (+ n (f (- n 1)))))", "55");
+        t.Execute(R"EOF(
+            (define (upto n)
+              (let lp ((i n) (acc '())) (if (= i 0) acc (lp (- i 1) (cons i acc)))))
+        )EOF");
+        t.ExpectEq("(upto 4)", "(1 2 3 4)");
+
+        t.ExpectError<SyntaxError>("(do (i) (#t))");
+        t.ExpectError<SyntaxError>("(do ((i 0)))");
+        t.ExpectError<RuntimeError>("(let loop ((i 0)) (loop))");
+    }
+}
 
-        t.Execute("(define my-range (range 10))");
-        t.ExpectEq("(my-range)", "11");
-        t.ExpectEq("(my-range)", "12");
-        t.ExpectEq("(my-range)", "13");
+TEST_CASE(PooledFrames) {
+    for (Engine engine : {Engine::TREE, Engine::COMPILED}) {
+        // кадры вызовов из пула
+        SchemeTest t(engine);
+
+        t.Execute("(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))");
+        size_t allocations = t.Stats().allocated_frames;
+        size_t pooled = t.Stats().pooled_frames;
+        t.ExpectEq("(fib 15)", "610");
+        CHECK(t.Stats().allocated_frames == allocations);
+        CHECK(t.Stats().pooled_frames - pooled == 1973);
+
+        t.Execute("(define (adder x) (lambda (y) (+ x y)))");
+        t.Execute("(define add5 (adder 5))");
+        t.ExpectEq("(add5 (fib 5))", "10");
+
+        // макрос раскрывается в lambda во время вызова: кадр переходит к сборщику
+        t.Execute("(define (capture x) (make-thunk x))");
+        t.Execute("(define-syntax make-thunk (syntax-rules () ((_ e) (lambda () e))))");
+        t.Execute("(define th (capture 7))");
+        t.ExpectEq("(fib 10)", "55");
+        t.ExpectEq("(th)", "7");
+
+        t.Execute("(define (fail x) (car x))");
+        t.ExpectError<RuntimeError>("(fail 1)");
+        t.ExpectEq("(fib 10)", "55");
+    }
+}
+
+TEST_CASE(SlotFrames) {
+    for (Engine engine : {Engine::TREE, Engine::COMPILED}) {
+        // кадры-массивы слотов
+        SchemeTest t(engine);
 
-        t.ExpectEq("x", "1");
+        t.Execute(R"EOF(
+            (define (f x)
+              (define z (* x 2))
+              (define (g y) (+ y z))
+              (set! x (g x))
+              (list x z))
+        )EOF");
+        t.ExpectEq("(f 3)", "(9 6)");
+
+        // define, который ещё не выполнился, не закрывает внешнее имя
+        t.Execute("(define y 100)");
+        t.ExpectEq("((lambda (x) (if (= x 0) y (begin (define y x) y))) 0)", "100");
+        t.ExpectEq("((lambda (x) (if (= x 0) y (begin (define y x) y))) 5)", "5");
+        t.ExpectEq("((lambda (x) (define x 7) x) 1)", "7");
+
+        // имя вне раскладки: define из макроса, определённого позже функции
+        t.Execute("(define (h x) (late-define w x) (+ w 1))");
+        t.Execute("(define-syntax late-define (syntax-rules () ((_ n v) (define n v))))");
+        t.ExpectEq("(h 41)", "42");
+        t.ExpectError<NameError>("w");
+
+        // замыкания одной формы: общий разбор тела, свои кадры
+        t.Execute("(define (counter) (define n 0) (lambda () (set! n (+ n 1)) n))");
+        t.Execute("(define c1 (counter))");
+        t.Execute("(define c2 (counter))");
+        t.Execute("(c1)");
+        t.ExpectEq("(list (c1) (c2))", "(2 1)");
+        t.ExpectEq("(let tri ((i 3)) (if (= i 0) 0 (+ i (tri (- i 1)))))", "6");
+
+        // макрос, определённый позже, переносит локальное имя в кадр другой лямбды
+        t.Execute("(define (k x) (in-frame x))");
+        t.Execute("(define-syntax in-frame (syntax-rules () ((_ e) ((lambda (z) e) 10))))");
+        t.ExpectEq("(k 1)", "1");
     }
+}
 
-    {
-        // DefineLambdaSugar
-        SchemeTest t;
+TEST_CASE(CompactLists) {
+    // компактные списки
+    SchemeTest t;
+
+    t.Execute("(define l (list 1 2 3 4))");
+    t.ExpectEq("(list-ref l 3)", "4");
+    t.ExpectEq("(list-tail l 2)", "(3 4)");
+    t.ExpectEq("(length l)", "4");
+    t.ExpectError<RuntimeError>("(list-ref l 5)");
+
+    // ячейка из середины блока изменяется на месте
+    t.Execute("(define tail (list-tail l 2))");
+    t.Execute("(set-car! tail 7)");
+    t.ExpectEq("l", "(1 2 7 4)");
+
+    // cdr после set-cdr! лежит в таблице блока, остальные ячейки остаются живы
+    t.Execute("(define rest (cdr l))");
+    t.Execute("(set-cdr! rest '(8 9))");
+    t.ExpectEq("l", "(1 2 8 9)");
+    t.ExpectEq("tail", "(7 4)");
+    t.ExpectEq("(member 8 l)", "(8 9)");
+    t.Execute("(set-cdr! tail 5)");
+    t.ExpectEq("tail", "(7 . 5)");
+    t.ExpectEq("(cdr tail)", "5");
+    t.Execute("(set-cdr! tail '())");
+    t.ExpectEq("tail", "(7)");
+    t.ExpectEq("(length tail)", "1");
+
+    t.ExpectEq("'(1 (2 3) . 4)", "(1 (2 3) . 4)");
+    t.ExpectEq("(append '(1 2) 3)", "(1 2 . 3)");
+    t.ExpectEq("(map + '(1 2) '(10 20))", "(11 22)");
+    t.ExpectEq("(reverse '(1 2 3))", "(3 2 1)");
+}
 
-        t.Execute("(define (inc x) (+ x 1))");
-        t.ExpectEq("(inc -1)", "0");
+TEST_CASE(ListShape) {
+    // длина и собственность списка после изменений
+    SchemeTest t;
+
+    t.Execute("(define l (list 1 2 3))");
+    t.Execute("(define m (cons 0 l))");
+    t.ExpectEq("(length m)", "4");
+    t.ExpectEq("(list? m)", "#t");
+
+    t.Execute("(define second (cdr l))");
+    t.Execute("(set-cdr! second 5)");
+    t.ExpectEq("(list? l)", "#f");
+    t.ExpectEq("(list? m)", "#f");
+    t.ExpectError<RuntimeError>("(length m)");
+    t.ExpectEq("(list-ref m 2)", "2");
+
+    t.Execute("(set-cdr! second '(7 8 9))");
+    t.ExpectEq("(length m)", "6");
+    t.ExpectEq("(list-tail m 6)", "()");
+    t.ExpectError<RuntimeError>("(list-ref m 6)");
+    t.ExpectError<RuntimeError>("(list-tail m 7)");
+
+    // циклический список
+    t.Execute("(begin (set-cdr! second l) 0)");
+    t.ExpectEq("(list? m)", "#f");
+    t.ExpectError<RuntimeError>("(length l)");
+    t.ExpectEq("(list-ref l 5)", "2");
+    t.Execute("(set-cdr! second '())");
+    t.ExpectEq("(length m)", "3");
+    t.ExpectEq("m", "(0 1 2)");
+
+    // у каждого интерпретатора своя эпоха: set-cdr! в другом не сбрасывает кэши этого
+    ShapeEpoch mine;
+    ShapeEpoch theirs;
+    ShapeEpoch::Scope scope(&mine);
+    auto list = AsType<Pair>(Pair::MakeList({Make<Integer>(1), Make<Integer>(2)}));
+    CHECK(list->Length() == 2);
+    uint64_t before = mine.Load();
+    {
+        ShapeEpoch::Scope other(&theirs);
+        auto cell = AsType<Pair>(Pair::MakeList({Make<Integer>(3)}));
+        CHECK(cell->Length() == 1);
+        cell->SetSecond(Make<Integer>(4));
+        CHECK(!cell->ProperList());
+        // кэш, заполненный под чужим счётчиком, считается устаревшим
+        CHECK(list->Length() == 2);
+    }
+    CHECK(mine.Load() == before);
+    CHECK(list->Length() == 2);
+    list->SetSecond(Pair::EmptyPair());
+    CHECK(list->Length() == 1);
+}
 
-        t.Execute("(define (add x y) (+ x y 1))");
-        t.ExpectEq("(add -10 10)", "1");
+TEST_CASE(DeepNesting) {
+    // глубокая вложенность: SyntaxError вместо переполнения стека
+    auto nested = [](size_t depth) {
+        return "(length '" + std::string(depth, '(') + std::string(depth, ')') + ")";
+    };
+    Interpreter interpreter;
+    CHECK(interpreter.TryRun(nested(5000)).value == "1");
+    CHECK(interpreter.TryRun(nested(100000)).error == ErrorKind::SYNTAX);
+    CHECK(interpreter.TryRun(std::string(100000, '(')).error == ErrorKind::SYNTAX);
+    CHECK(interpreter.TryRun(std::string(100000, '\'') + "x").error == ErrorKind::SYNTAX);
+
+    interpreter.SetMaxNesting(10);
+    CHECK(interpreter.TryRun(nested(8)).value == "1");
+    CHECK(interpreter.TryRun(nested(9)).error == ErrorKind::SYNTAX);
+    CHECK(interpreter.TryRun("(+ 1 (+ 2 (+ 3 4)))").value == "10");
+    CHECK(interpreter.TryRun("'(1 (2 . 3) (quote x) . 4)").value == "(1 (2 . 3) (' . x) . 4)");
+}
 
-        t.Execute("(define (zero) 0)");
-        t.ExpectEq("(zero)", "0");
+TEST_CASE(DeepRelease) {
+    // освобождение длинных и глубоких структур не зависит от глубины стека
+    Interpreter interpreter;
+    interpreter.Run("(begin (define x (do ((i 0 (+ i 1)) (acc '() (cons i acc))) "
+                    "((= i 300000) acc))) 0)");
+    CHECK(interpreter.Run("(length x)") == "300000");
+    interpreter.Run("(define x 0)");
+    CHECK(interpreter.Run("(do ((i 0 (+ i 1)) (acc '() (list acc))) ((= i 300000) 0))") ==
+           "0");
+    std::string flat = "(length '(";
+    for (size_t i = 0; i < 300000; ++i) {
+        flat += "1 ";
     }
+    CHECK(interpreter.Run(flat + "))") == "300000");
+}
 
+TEST_CASE(ReadFile) {
+    // ReadFile: файл больше одного куска, границы кусков - между выражениями
+    std::string path = std::filesystem::temp_directory_path() / "scheme_read_file_test.scm";
     {
-        // LambdaMultipleRecurseCalls
-        SchemeTest t;
-
-        t.Execute("(define (fib x) (if (< x 3) 1 (+ (fib (- x 1)) (fib (- x 2)) )))");
-        t.ExpectEq("(fib 1)", "1");
-        t.ExpectEq("(fib 2)", "1");
-        t.ExpectEq("(fib 3)", "2");
-        t.ExpectEq("(fib 7)", "13");
-        t.ExpectEq("(fib 8)", "21");
+        std::ofstream out(path);
+        for (int i = 0; i < 30000; ++i) {
+            out << "(" << i << " (a . " << -i << ") 'b)\n";
+            out << "' " << i << "  quote\n";
+        }
     }
+    Interpreter interpreter;
+    CHECK(interpreter.ReadFile("data", path) == 90000);
+    CHECK(interpreter.Run("(length data)") == "90000");
+    CHECK(interpreter.Run("(list-ref data 0)") == "(0 (a . 0) (' . b))");
+    CHECK(interpreter.Run("(list-ref data 1)") == "(' . 0)");
+    CHECK(interpreter.Run("(list-ref data 89997)") == "(29999 (a . -29999) (' . b))");
+    CHECK(interpreter.Run("(list-ref data 89998)") == "(' . 29999)");
 
     {
-        // MutualCalls
-        SchemeTest t;
-
-        t.Execute("(define (foo x) (if (< x 2) 42 (bar (- x 1))))");
-        t.Execute("(define (bar x) (if (< x 2) 24 (foo (/ x 2))))");
-        t.ExpectEq("(foo 3)", "42");
-        t.ExpectEq("(foo 6)", "24");
-        t.ExpectEq("(bar 7)", "42");
-        t.ExpectEq("(bar 13)", "24");
+        std::ofstream out(path);
+        out << std::string(100000, ' ') << "(1 2) (3 . )";
+    }
+    bool thrown = false;
+    try {
+        interpreter.ReadFile("broken", path);
+    } catch (const SyntaxError&) {
+        thrown = true;
     }
+    CHECK(thrown);
+    std::filesystem::remove(path);
+
+    thrown = false;
+    try {
+        interpreter.ReadFile("missing", path);
+    } catch (const RuntimeError&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
 
-    {
-        // CyclicLocalContextDependencies
-        SchemeTest t;
+TEST_CASE(ParseCache) {
+    // кэш разбора
+    for (Engine engine : {Engine::TREE, Engine::COMPILED}) {
+        Interpreter interpreter;
+        interpreter.SetEngine(engine);
+        interpreter.Run("(define x 1)");
+        CHECK(interpreter.GetStats().parse_cache_misses == 0);
+
+        interpreter.SetParseCacheSize(2);
+        CHECK(interpreter.Run("(+ x 1)") == "2");
+        interpreter.Run("(define x 10)");
+        CHECK(interpreter.Run("(+ x 1)") == "11");
+        // дерево "()" - nullptr
+        CHECK(interpreter.TryRun("()").error == ErrorKind::RUNTIME);
+        CHECK(interpreter.TryRun("()").error == ErrorKind::RUNTIME);
+        auto stats = interpreter.GetStats();
+        CHECK(stats.parse_cache_hits == 2 && stats.parse_cache_misses == 3);
+        // вытеснены (define x 10) и (+ x 1)
+        interpreter.Run("(define x 10)");
+        interpreter.Run("(+ x 1)");
+        CHECK(interpreter.GetStats().parse_cache_misses == 5);
+
+        // литерал из кэша не изменён set-car! прошлого вызова
+        CHECK(interpreter.Run("(define y '(1 2))") == "(1 2)");
+        interpreter.Run("(set-car! y 5)");
+        CHECK(interpreter.Run("y") == "(5 2)");
+        CHECK(interpreter.Run("(define y '(1 2))") == "(1 2)");
+
+        // макрос, определённый позже, раскрывается в выражении из кэша
+        interpreter.Run("(define (twice v) (* v 3))");
+        CHECK(interpreter.Run("(twice 4)") == "12");
+        interpreter.Run("(define-syntax twice (syntax-rules () ((_ v) (* v 2))))");
+        CHECK(interpreter.Run("(twice 4)") == "8");
+        CHECK(interpreter.TryRun("(+ 1").error == ErrorKind::SYNTAX);
+        CHECK(interpreter.TryRun("(+ 1").error == ErrorKind::SYNTAX);
+
+        // разобранное дерево берётся из кэша, пока макросы не менялись
+        interpreter.SetParseCacheSize(8);
+        const std::string bump = "(begin (define p '(1 2 3)) (set-car! p (+ (car p) 1)) p)";
+        CHECK(interpreter.Run(bump) == "(2 2 3)");
+        size_t hits = interpreter.GetStats().parse_cache_hits;
+        CHECK(interpreter.Run(bump) == "(2 2 3)");
+        CHECK(interpreter.Run(bump) == "(2 2 3)");
+        CHECK(interpreter.GetStats().parse_cache_hits == hits + 2);
+
+        // переопределение макроса или замена его функцией сбрасывает разбор
+        CHECK(interpreter.Run("(twice 4)") == "8");
+        interpreter.Run("(define-syntax twice (syntax-rules () ((_ v) (* v 5))))");
+        CHECK(interpreter.Run("(twice 4)") == "20");
+        interpreter.Run("(define (twice v) (+ v 1))");
+        CHECK(interpreter.Run("(twice 4)") == "5");
+        interpreter.Run("(define-syntax twice (syntax-rules () ((_ v) (* v 2))))");
+        CHECK(interpreter.Run("(twice 4)") == "8");
+        interpreter.Run("(set! twice (lambda (v) (- v 1)))");
+        CHECK(interpreter.Run("(twice 4)") == "3");
+    }
 
-        t.Execute(R"EOF(
-        (define (foo x)
-            (define (bar) (set! x (+ (* x 2) 2)) x)
-            bar
-        )
-    )EOF");
-        t.Execute("(define my-foo (foo 20))");
-        t.Execute("(define foo 1543)");
-        t.ExpectEq("(my-foo)", "42");
+    // Reset арены забывает разобранные деревья, строки остаются в кэше
+    MemoryOptions options;
+    options.arena = true;
+    Interpreter interpreter(options);
+    interpreter.SetParseCacheSize(4);
+    size_t prelude = interpreter.MemoryUsed();
+    interpreter.Run("(define-syntax twice (syntax-rules () ((_ v) (* v 2))))");
+    CHECK(interpreter.Run("(twice 3)") == "6");
+    CHECK(interpreter.Run("(twice 3)") == "6");
+    interpreter.Reset();
+    CHECK(interpreter.MemoryUsed() == prelude);
+    size_t misses = interpreter.GetStats().parse_cache_misses;
+    CHECK(interpreter.TryRun("(twice 3)").error == ErrorKind::NAME);
+    CHECK(interpreter.Run("(quote (1 2))") == "(1 2)");
+    CHECK(interpreter.GetStats().parse_cache_misses == misses + 1);
+}
+
+TEST_CASE(MemoryLimit) {
+    // предел памяти интерпретатора
+    for (Engine engine : {Engine::TREE, Engine::COMPILED}) {
+        MemoryOptions options;
+        options.limit = 1 << 20;
+        Interpreter interpreter(options);
+        interpreter.SetEngine(engine);
+        CHECK(interpreter.MemoryUsed() > 0);
+        interpreter.Run(
+            "(define (build n) (let loop ((i n) (acc '())) (if (= i 0) acc "
+            "(loop (- i 1) (cons i acc)))))");
+        CHECK(interpreter.Run("(length (build 1000))") == "1000");
+        RunResult result = interpreter.TryRun("(length (build 1000000))");
+        CHECK(result.error == ErrorKind::RUNTIME);
+        CHECK(result.message.find("out of memory") != std::string::npos);
+        // после ошибки память списка освобождена, и интерпретатор продолжает работать
+        CHECK(interpreter.MemoryUsed() < options.limit / 2);
+        CHECK(interpreter.Run("(length (build 1000))") == "1000");
+        CHECK(interpreter.Run("(let ((x 2)) (* x 21))") == "42");
+    }
+}
+
+TEST_CASE(MemoryArena) {
+    // арена: память возвращается только в Reset
+    for (Engine engine : {Engine::TREE, Engine::COMPILED}) {
+        MemoryOptions options;
+        options.arena = true;
+        Interpreter interpreter(options);
+        interpreter.SetEngine(engine);
+        size_t prelude = interpreter.MemoryUsed();
+        interpreter.Run("(define (square x) (* x x))");
+        interpreter.Run("(define xs (list 1 2 3))");
+        CHECK(interpreter.Run("(map square xs)") == "(1 4 9)");
+        size_t used = interpreter.MemoryUsed();
+        CHECK(used > prelude);
+        interpreter.Run("(square 3)");
+        CHECK(interpreter.MemoryUsed() > used);
+
+        interpreter.Reset();
+        CHECK(interpreter.MemoryUsed() == prelude);
+        CHECK(interpreter.TryRun("(square 3)").error == ErrorKind::NAME);
+        CHECK(interpreter.TryRun("xs").error == ErrorKind::NAME);
+        CHECK(interpreter.Run("(let ((x 2)) (* x 21))") == "42");
+        CHECK(interpreter.Run("(define xs '(1 2))") == "(1 2)");
+
+        // после свёртки и раскрытия, прерванного ошибкой, в арену никто не ссылается
+        interpreter.Run("(define (g) (car '((define x 7))))");
+        CHECK(interpreter.Run("(g)") == "7");
+        interpreter.Run("(define-syntax two (syntax-rules () ((_ a b) a)))");
+        interpreter.Run("(define-syntax hide (syntax-rules () ((_ a) (lambda (t) (two a)))))");
+        CHECK(interpreter.TryRun("(hide 1)").error == ErrorKind::SYNTAX);
+        interpreter.Reset();
+        CHECK(interpreter.TryRun("(car '(x))").error == ErrorKind::NAME);
+        CHECK(interpreter.Run("(car '(1 2))") == "1");
+    }
+    // Reset без арены
+    Interpreter interpreter;
+    interpreter.Run("(define x 1)");
+    CHECK(interpreter.Run("x") == "1");
+    interpreter.Reset();
+    CHECK(interpreter.TryRun("x").error == ErrorKind::NAME);
+    CHECK(interpreter.Run("(cond (#f 1) (else 2))") == "2");
+}
+
+TEST_CASE(Fuel) {
+    // бюджет шагов и продолжение вычисления
+    for (Engine engine : {Engine::TREE, Engine::COMPILED}) {
+        Interpreter interpreter;
+        interpreter.SetEngine(engine);
+        interpreter.Run(
+            "(define (total n) (let loop ((i n) (acc 0)) (if (= i 0) acc "
+            "(loop (- i 1) (+ acc i)))))");
+        interpreter.Run("(define (fact n) (if (= n 0) 1 (* n (fact (- n 1)))))");
+
+        Evaluation quick = interpreter.Run("(total 100)", 1000);
+        CHECK(quick.Done() && quick.Result().value == "5050");
+
+        Evaluation slow = interpreter.Run("(+ (total 1000) (fact 10))", 100);
+        CHECK(!slow.Done());
+        CHECK(interpreter.TryRun("1").error == ErrorKind::RUNTIME);
+        // настройки и Evaluate тоже ждут конца вычисления, а не вмешиваются в него
+        auto busy = [](const std::function<void()>& call) {
+            try {
+                call();
+            } catch (const RuntimeError&) {
+                return true;
+            }
+            return false;
+        };
+        std::stringstream text("(total 10)");
+        Tokenizer tokenizer(&text);
+        std::shared_ptr<Object> tree = Read(&tokenizer);
+        CHECK(busy([&] { interpreter.Evaluate(tree); }));
+        CHECK(busy([&] { interpreter.SetParseCacheSize(4); }));
+        CHECK(busy([&] { interpreter.SetCollectionBudget(16); }));
+        CHECK(busy([&] { interpreter.SetMaxNesting(16); }));
+        CHECK(busy([&] { interpreter.SetEngine(engine); }));
+        size_t slices = 1;
+        while (!slow.Resume(100)) {
+            ++slices;
+        }
+        CHECK(slices > 5 && slow.Result().value == "4129300");
+        CHECK(interpreter.Run("1") == "1");
+        CHECK(interpreter.Evaluate(tree) == "55");
+
+        // бесконечный цикл отменяется
+        Evaluation endless = interpreter.Run("(let loop () (loop))", 1000);
+        CHECK(!endless.Done() && !endless.Resume(1000));
+        endless.Cancel();
+        CHECK(endless.Done() && endless.Result().error == ErrorKind::RUNTIME);
+        CHECK(interpreter.Run("(total 10)") == "55");
+
+        // определения завершённого вычисления видны, ошибка - в результате
+        CHECK(interpreter.Run("(define z 5)", 10).Result().value == "5");
+        CHECK(interpreter.Run("z") == "5");
+        CHECK(interpreter.Run("(car '())", 10).Result().error == ErrorKind::RUNTIME);
+        {
+            Evaluation dropped = interpreter.Run("(total 1000)", 10);
+        }
+        CHECK(interpreter.Run("(fact 5)") == "120");
     }
+    // интерпретатор удалён раньше вычисления
+    std::optional<Evaluation> orphan;
+    {
+        Interpreter interpreter;
+        orphan.emplace(interpreter.Run("(let loop () (loop))", 10));
+    }
+    CHECK(orphan->Done() && !orphan->Result().Ok());
+
+    // потоки pmap не тратили бы топливо: при бюджете pmap идёт последовательно
+    SharedPoolScope pool(3);
+    Interpreter interpreter;
+    Evaluation spin = interpreter.Run("(pmap (lambda (x) (let loop () (loop))) '(1 2 3 4))", 10);
+    CHECK(!spin.Done() && !spin.Resume(100));
+    spin.Cancel();
+    CHECK(spin.Done() && spin.Result().error == ErrorKind::RUNTIME);
+    Evaluation squares = interpreter.Run("(pmap (lambda (x) (* x x)) '(1 2 3 4))", 10);
+    CHECK(squares.Done() && squares.Result().value == "(1 4 9 16)");
+}
 
-    return 0;
+int main(int argc, char** argv) {
+    return RunTests(argc, argv);
 }
@@ -0,0 +1,48 @@
+#include <string>
+
+#include "memory.h"
+#include "error.h"
+
+thread_local std::pmr::memory_resource* MemoryScope::current_ = nullptr;
+
+LimitedResource::LimitedResource(std::pmr::memory_resource* upstream, size_t limit, bool arena)
+    : upstream_(upstream), limit_(limit) {
+    if (arena) {
+        arena_.emplace(upstream_);
+    }
+}
+
+void* LimitedResource::do_allocate(size_t bytes, size_t alignment) {
+    if (used_.fetch_add(bytes, std::memory_order_relaxed) + bytes > limit_) {
+        used_.fetch_sub(bytes, std::memory_order_relaxed);
+        throw RuntimeError("out of memory: interpreter limit is " + std::to_string(limit_) +
+                           " bytes");
+    }
+    try {
+        if (arena_) {
+            std::lock_guard lock(arena_mutex_);
+            return arena_->allocate(bytes, alignment);
+        }
+        return upstream_->allocate(bytes, alignment);
+    } catch (...) {
+        used_.fetch_sub(bytes, std::memory_order_relaxed);
+        throw;
+    }
+}
+
+void LimitedResource::do_deallocate(void* ptr, size_t bytes, size_t alignment) {
+    if (arena_) {
+        // память арены возвращается только в Reset
+        return;
+    }
+    upstream_->deallocate(ptr, bytes, alignment);
+    used_.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+void LimitedResource::Reset() {
+    if (arena_) {
+        std::lock_guard lock(arena_mutex_);
+        arena_->release();
+        used_.store(0, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+
+// Ресурс памяти, из которого интерпретатор выделяет значения Type и контексты, пока
+// выполняется его код (см. MemoryScope). Нет ресурса - обычный operator new
+class MemoryScope {
+private:
+    static thread_local std::pmr::memory_resource* current_;
+
+    std::pmr::memory_resource* previous_;
+
+public:
+    explicit MemoryScope(std::pmr::memory_resource* resource) : previous_(current_) {
+        current_ = resource;
+    }
+
+    MemoryScope(const MemoryScope&) = delete;
+    MemoryScope& operator=(const MemoryScope&) = delete;
+
+    ~MemoryScope() {
+        current_ = previous_;
+    }
+
+    // nullptr - ресурс не задан
+    static std::pmr::memory_resource* Current() {
+        return current_;
+    }
+};
+
+// make_shared из текущего ресурса. Аллокатор хранится в управляющем блоке, поэтому значение
+// возвращается в свой ресурс, где бы ни было удалено
+template <class T, class... Args>
+std::shared_ptr<T> Make(Args&&... args) {
+    if (auto resource = MemoryScope::Current()) {
+        return std::allocate_shared<T>(std::pmr::polymorphic_allocator<T>(resource),
+                                       std::forward<Args>(args)...);
+    }
+    return std::make_shared<T>(std::forward<Args>(args)...);
+}
+
+// Ресурс с пределом: выделение сверх limit байт - RuntimeError, после которого интерпретатор
+// продолжает работать. В режиме арены память берётся из monotonic_buffer_resource,
+// освобождение ничего не стоит, а Reset отдаёт всю арену сразу; счётчик тогда растёт до Reset.
+// Потоки pmap выделяют из того же ресурса, поэтому счётчик атомарный, а арена под мьютексом
+class LimitedResource : public std::pmr::memory_resource {
+private:
+    std::pmr::memory_resource* upstream_;
+    size_t limit_;
+    std::atomic<size_t> used_ = 0;
+    std::optional<std::pmr::monotonic_buffer_resource> arena_;
+    std::mutex arena_mutex_;
+
+    void* do_allocate(size_t bytes, size_t alignment) override;
+
+    void do_deallocate(void* ptr, size_t bytes, size_t alignment) override;
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+public:
+    LimitedResource(std::pmr::memory_resource* upstream, size_t limit, bool arena);
+
+    size_t Used() const {
+        return used_.load(std::memory_order_relaxed);
+    }
+
+    bool IsArena() const {
+        return arena_.has_value();
+    }
+
+    // Освобождает арену целиком. Все выделенные из неё объекты должны быть уже разрушены
+    void Reset();
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 
 #include "error.h"
 
@@ -33,6 +34,36 @@ public:
     }
 };
 
+// Освобождает ссылки refs без рекурсии. Деструктор последнего владельца списка освобождал бы
+// cdr, тот - свой cdr и так далее, по кадру стека на элемент. Здесь последние ссылки
+// откладываются в очередь потока, и её разбирает только внешний вызов: деструкторы, вызванные
+// при разборе, лишь добавляют в очередь свои ссылки. Глубина стека не зависит от длины и
+// вложенности структуры
+template <class T, size_t N>
+void ReleaseDeferred(std::shared_ptr<T> (&refs)[N]) {
+    thread_local std::vector<std::shared_ptr<T>> pending;
+    thread_local bool draining = false;
+    for (auto& ref : refs) {
+        // ссылка не последняя - её освобождение ничего не разрушит
+        if (ref && ref.use_count() == 1) {
+            pending.push_back(std::move(ref));
+        }
+    }
+    if (draining) {
+        return;
+    }
+    draining = true;
+    while (!pending.empty()) {
+        auto ref = std::move(pending.back());
+        pending.pop_back();
+    }
+    draining = false;
+    // после большой структуры очередь не держит память
+    if (pending.capacity() > 4096) {
+        pending.shrink_to_fit();
+    }
+}
+
 class Cell : public Object {
     std::shared_ptr<Object> first_, second_;
 
@@ -44,6 +75,11 @@ public:
         : first_(first), second_(second) {
     }
 
+    ~Cell() override {
+        std::shared_ptr<Object> refs[] = {std::move(first_), std::move(second_)};
+        ReleaseDeferred(refs);
+    }
+
     void SetFirst(std::shared_ptr<Object> first) {
         first_ = first;
     }
@@ -71,5 +107,6 @@ std::shared_ptr<T> As(const std::shared_ptr<Object>& obj) {
 
 template <class T>
 bool Is(const std::shared_ptr<Object>& obj) {
-    return bool(std::dynamic_pointer_cast<T>(obj));
+    // без копии shared_ptr: проверка не трогает счётчик ссылок
+    return dynamic_cast<T*>(obj.get()) != nullptr;
 }
@@ -0,0 +1,179 @@
+#include <memory>
+#include <vector>
+
+#include "optimizer.h"
+#include "types.h"
+#include "functions.h"
+
+std::shared_ptr<Type> Optimizer::Fold(std::shared_ptr<Type> tree) {
+    return FoldExpression(tree);
+}
+
+bool Optimizer::IsConstant(const std::shared_ptr<Type>& expr) {
+    if (IsType<Integer>(expr) || IsType<Bool>(expr) || IsType<Function>(expr)) {
+        return true;
+    }
+    if (IsType<Pair>(expr)) {
+        auto pair = AsType<Pair>(expr);
+        return !pair->Empty() && IsType<Quote>(pair->GetFirst());
+    }
+    return false;
+}
+
+bool Optimizer::IsPure(const std::shared_ptr<Type>& func) {
+    // cons и list не сворачиваем: каждый вызов должен создавать новый изменяемый список
+    return IsType<IntegerOperation>(func) || IsType<Compare>(func) || IsType<MinMax>(func) ||
+           IsType<Sum>(func) || IsType<Product>(func) || IsType<Abs>(func) ||
+           IsType<Not>(func) || IsType<BooleanPred>(func) || IsType<NumberPred>(func) ||
+           IsType<PairPred>(func) || IsType<NullPred>(func) || IsType<ListPred>(func) ||
+           IsType<SymbolPred>(func) || IsType<Car>(func) || IsType<Cdr>(func) ||
+           IsType<ListRef>(func) || IsType<ListTail>(func);
+}
+
+bool Optimizer::HasProperArgs(const std::shared_ptr<Pair>& expr) {
+    auto args = expr->GetSecond();
+    return IsType<Pair>(args) && AsType<Pair>(args)->ProperList();
+}
+
+std::shared_ptr<Type> Optimizer::ConstantValue(const std::shared_ptr<Type>& expr) {
+    if (IsType<Pair>(expr) && !AsType<Pair>(expr)->Empty() &&
+        IsType<Quote>(AsType<Pair>(expr)->GetFirst())) {
+        return AsType<Pair>(expr)->GetSecond();
+    }
+    return expr;
+}
+
+bool Optimizer::IsPlainData(const std::shared_ptr<Type>& value) {
+    Type* current = value.get();
+    while (auto pair = dynamic_cast<Pair*>(current)) {
+        if (pair->Empty()) {
+            return true;
+        }
+        Type* first = pair->GetFirst().get();
+        if (!dynamic_cast<Integer*>(first) && !dynamic_cast<Bool*>(first)) {
+            return false;
+        }
+        current = pair->PeekSecond();
+    }
+    return !current || dynamic_cast<Integer*>(current) || dynamic_cast<Bool*>(current);
+}
+
+std::shared_ptr<Type> Optimizer::MakeConstant(std::shared_ptr<Type> value) {
+    if (IsType<Pair>(value) || IsType<UnknownSymbol>(value)) {
+        return Make<Pair>(quote_, value);
+    }
+    return value;
+}
+
+void Optimizer::FoldSequence(std::shared_ptr<Type> list) {
+    while (IsType<Pair>(list) && !AsType<Pair>(list)->Empty()) {
+        auto cell = AsType<Pair>(list);
+        cell->SetFirst(FoldExpression(cell->GetFirst()));
+        list = cell->GetSecond();
+    }
+}
+
+std::shared_ptr<Type> Optimizer::FoldExpression(std::shared_ptr<Type> expr) {
+    if (!IsType<Pair>(expr) || AsType<Pair>(expr)->Empty()) {
+        return expr;
+    }
+    auto pair = AsType<Pair>(expr);
+    auto op = pair->GetFirst();
+    if (!IsType<Function>(op)) {
+        FoldSequence(pair);
+        return pair;
+    }
+    if (IsType<Quote>(op) || IsType<DefineSyntax>(op)) {
+        return pair;
+    }
+    auto args = pair->GetSecond();
+    if (IsType<LambdaCreate>(op) || IsType<Define>(op) || IsType<DefineMemoized>(op) ||
+        IsType<Set>(op) || IsType<SetCar>(op) || IsType<SetCdr>(op)) {
+        // первый аргумент - имя или список параметров, остальное вычисляется
+        if (IsType<Pair>(args) && !AsType<Pair>(args)->Empty()) {
+            FoldSequence(AsType<Pair>(args)->GetSecond());
+        }
+        return pair;
+    }
+    FoldSequence(args);
+    if (IsType<If>(op)) {
+        return FoldIf(pair);
+    }
+    if (IsType<And>(op) || IsType<Or>(op)) {
+        return FoldAndOr(pair, IsType<And>(op));
+    }
+    return FoldCall(pair);
+}
+
+std::shared_ptr<Type> Optimizer::FoldIf(std::shared_ptr<Pair> expr) {
+    if (!HasProperArgs(expr)) {
+        return expr;
+    }
+    auto args = Helper::GetAll(expr->GetSecond());
+    if ((args.size() != 2 && args.size() != 3) || !IsConstant(args[0])) {
+        return expr;
+    }
+    if (Helper::ConvertToBool(ConstantValue(args[0]))) {
+        return args[1];
+    }
+    if (args.size() == 2) {
+        return MakeConstant(Pair::EmptyPair());
+    }
+    return args[2];
+}
+
+std::shared_ptr<Type> Optimizer::FoldAndOr(std::shared_ptr<Pair> expr, bool is_and) {
+    if (!HasProperArgs(expr)) {
+        return expr;
+    }
+    auto args = Helper::GetAll(expr->GetSecond());
+    if (args.empty()) {
+        return Make<Bool>(is_and);
+    }
+    // константы, не влияющие на результат, выкидываем; константа, на которой вычисление
+    // остановится, становится последним аргументом. Последний аргумент - значение формы
+    std::vector<std::shared_ptr<Type>> kept;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (i + 1 == args.size() || !IsConstant(args[i])) {
+            kept.push_back(args[i]);
+            continue;
+        }
+        bool value = Helper::ConvertToBool(ConstantValue(args[i]));
+        if (value != is_and) {
+            kept.push_back(args[i]);
+            break;
+        }
+    }
+    if (kept.size() == 1) {
+        return kept[0];
+    }
+    expr->SetSecond(Pair::MakeList(kept));
+    return expr;
+}
+
+std::shared_ptr<Type> Optimizer::FoldCall(std::shared_ptr<Pair> expr) {
+    auto op = expr->GetFirst();
+    if (!IsPure(op) || !HasProperArgs(expr)) {
+        return expr;
+    }
+    auto args = Helper::GetAll(expr->GetSecond());
+    for (const auto& arg : args) {
+        if (!IsConstant(arg)) {
+            return expr;
+        }
+    }
+    // car вычисляет выбранный элемент, а форму из литерала нужно вычислять в настоящем
+    // окружении. Поэтому списки сворачиваются, только если в них одни числа и #t/#f
+    if ((IsType<Car>(op) || IsType<Cdr>(op) || IsType<ListRef>(op) || IsType<ListTail>(op)) &&
+        (args.empty() || !IsPlainData(ConstantValue(args[0])))) {
+        return expr;
+    }
+    // своё пустое окружение на каждую свёртку: между свёртками ничего не сохраняется
+    GarbageCollector scratch;
+    try {
+        return MakeConstant(AsType<Function>(op)->Apply(expr->GetSecond(), scratch.GetRoot()));
+    } catch (const std::runtime_error&) {
+        // ошибка должна возникнуть при вычислении, а не при разборе
+        return expr;
+    }
+}
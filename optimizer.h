@@ -0,0 +1,43 @@
+#pragma once
+
+#include <memory>
+
+#include "types.h"
+#include "functions.h"
+
+// Проход по дереву после Interpreter::ParseTypes: сворачивает применения чистых встроенных
+// функций к константам, отбрасывает мёртвые ветки if и упрощает and/or с константами.
+// Встроенные имена разрешаются в объекты Function ещё при разборе, а define, set! и параметры
+// лямбд не принимают их как имена, поэтому переопределить встроенную функцию нельзя и
+// свёртка не меняет смысла программы.
+class Optimizer {
+private:
+    std::shared_ptr<Quote> quote_ = std::make_shared<Quote>();
+
+    std::shared_ptr<Type> FoldExpression(std::shared_ptr<Type> expr);
+
+    void FoldSequence(std::shared_ptr<Type> list);
+
+    std::shared_ptr<Type> FoldIf(std::shared_ptr<Pair> expr);
+
+    std::shared_ptr<Type> FoldAndOr(std::shared_ptr<Pair> expr, bool is_and);
+
+    std::shared_ptr<Type> FoldCall(std::shared_ptr<Pair> expr);
+
+    std::shared_ptr<Type> MakeConstant(std::shared_ptr<Type> value);
+
+    static bool HasProperArgs(const std::shared_ptr<Pair>& expr);
+
+    // значение константы без вычисления; quote хранит данные во втором элементе пары
+    static std::shared_ptr<Type> ConstantValue(const std::shared_ptr<Type>& expr);
+
+    // число, #t/#f или список из них: вычисление такого значения не обращается к окружению
+    static bool IsPlainData(const std::shared_ptr<Type>& value);
+
+public:
+    std::shared_ptr<Type> Fold(std::shared_ptr<Type> tree);
+
+    static bool IsConstant(const std::shared_ptr<Type>& expr);
+
+    static bool IsPure(const std::shared_ptr<Type>& func);
+};
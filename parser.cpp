@@ -1,85 +1,144 @@
 #include <memory>
+#include <vector>
 
 #include "object.h"
 #include "parser.h"
 #include "error.h"
 
-std::shared_ptr<Object> Read(Tokenizer* tokenizer, bool is_first) {
-    Token token = tokenizer->GetToken();
-    tokenizer->Next();
-    std::shared_ptr<Object> ret_val;
-    if (SymbolToken* symbol = std::get_if<SymbolToken>(&token)) {
-        ret_val = std::make_shared<Symbol>(symbol->name);
-    } else if (std::get_if<QuoteToken>(&token)) {
-        ret_val = std::make_shared<Cell>(std::make_shared<Symbol>("'"), Read(tokenizer, false));
-    } else if (std::get_if<QuoteTokenWord>(&token)) {
-        ret_val = std::make_shared<Symbol>("'");
-    } else if (std::get_if<DotToken>(&token)) {
-        ret_val = std::make_shared<Symbol>(".");
-    } else if (BracketToken* bracket = std::get_if<BracketToken>(&token)) {
-        if (*bracket == BracketToken::OPEN) {
-            ret_val = ReadList(tokenizer);
-        } else if (*bracket == BracketToken::CLOSE) {
-            ret_val = std::make_shared<Symbol>(")");
-        }
-    } else if (ConstantToken* constant = std::get_if<ConstantToken>(&token)) {
-        ret_val = std::make_shared<Number>(constant->value);
-    }
-    // Ошибка
-    if (is_first && !tokenizer->IsEnd()) {
-        throw SyntaxError("is_first = true, but !tokenizer->IsEnd()");
-    }
-    return ret_val;
-}
+namespace {
 
-bool SymbolEqual(std::shared_ptr<Object> object_ptr, const std::string& str) {
-    return Is<Symbol>(object_ptr) && As<Symbol>(object_ptr)->GetName() == str;
-}
+// Недочитанная форма: список после "(" или datum после "'"
+struct ReadFrame {
+    enum class State {
+        // ждёт datum после "'"
+        QUOTE,
+        // первый элемент списка
+        FIRST,
+        // (quote datum)
+        QUOTE_WORD,
+        // очередной элемент списка
+        ELEMENT,
+        // ")" после хвоста пары
+        CLOSE,
+    };
 
-std::shared_ptr<Object> ReadList(Tokenizer* tokenizer) {
-    auto object_ptr = Read(tokenizer, false);
-    if (SymbolEqual(object_ptr, ")")) {
-        return nullptr;
-    }
-    if (SymbolEqual(object_ptr, ".")) {
-        throw SyntaxError("SymbolEqual(object_ptr, .)");
-    }
-    // (quote
-    if (SymbolEqual(object_ptr, "'")) {
-        auto ret_val = std::make_shared<Cell>(object_ptr, Read(tokenizer, false));
-        tokenizer->Next();
-        return ret_val;
-    }
-    auto ret_cell = std::make_shared<Cell>(object_ptr, nullptr);
-    auto last_cell = ret_cell;
+    State state;
+    std::shared_ptr<Cell> head;
+    std::shared_ptr<Cell> last;
     bool last_dot = false;
-    while (true) {
-        object_ptr = Read(tokenizer, false);
-        if (!last_dot && SymbolEqual(object_ptr, ")")) {
-            return ret_cell;
+};
+
+enum class Special { NONE, CLOSE, DOT, QUOTE };
+
+// Читает один datum. Вложенные списки и quote - кадры на стеке stack, а не рекурсия;
+// in_list - "(" уже прочитана
+std::shared_ptr<Object> ReadDatum(Tokenizer* tokenizer, bool in_list, size_t max_nesting) {
+    using State = ReadFrame::State;
+    std::vector<ReadFrame> stack;
+    auto push = [&](State state) {
+        if (stack.size() >= max_nesting) {
+            throw SyntaxError("Read() nesting is too deep");
         }
-        if (SymbolEqual(object_ptr, ".")) {
-            last_dot = true;
+        stack.push_back({state, nullptr, nullptr});
+    };
+    if (in_list) {
+        push(State::FIRST);
+    }
+    while (true) {
+        Token token = tokenizer->GetToken();
+        tokenizer->Next();
+        std::shared_ptr<Object> object_ptr;
+        // ")", "." и quote - символы, как их возвращает Read, но сравниваются по токену
+        Special special = Special::NONE;
+        if (SymbolToken* symbol = std::get_if<SymbolToken>(&token)) {
+            object_ptr = std::make_shared<Symbol>(std::move(symbol->name));
+        } else if (std::get_if<QuoteToken>(&token)) {
+            push(State::QUOTE);
             continue;
+        } else if (std::get_if<QuoteTokenWord>(&token)) {
+            object_ptr = std::make_shared<Symbol>("'");
+            special = Special::QUOTE;
+        } else if (std::get_if<DotToken>(&token)) {
+            object_ptr = std::make_shared<Symbol>(".");
+            special = Special::DOT;
+        } else if (BracketToken* bracket = std::get_if<BracketToken>(&token)) {
+            if (*bracket == BracketToken::OPEN) {
+                push(State::FIRST);
+                continue;
+            }
+            object_ptr = std::make_shared<Symbol>(")");
+            special = Special::CLOSE;
+        } else if (ConstantToken* constant = std::get_if<ConstantToken>(&token)) {
+            object_ptr = std::make_shared<Number>(constant->value);
         }
-        if (Is<Cell>(object_ptr) && !last_dot) {
-            last_cell->SetSecond(std::make_shared<Cell>(object_ptr, nullptr));
-            last_cell = As<Cell>(last_cell->GetSecond());
-        } else if (last_dot) {
-            last_cell->SetSecond(object_ptr);
-            if (SymbolEqual(object_ptr, ")") || SymbolEqual(object_ptr, "(") ||
-                SymbolEqual(object_ptr, ".")) {
-                throw SyntaxError("Readlist() ')' or '(' or '.' in pair");
+        // прочитанный datum отдаётся верхнему кадру; завершённый кадр сам становится datum
+        // для кадра под ним
+        while (true) {
+            if (stack.empty()) {
+                return object_ptr;
             }
-            object_ptr = Read(tokenizer, false);
-            if (!SymbolEqual(object_ptr, ")")) {
-                throw SyntaxError("Readlist() expected ')' after pair");
+            ReadFrame& frame = stack.back();
+            if (frame.state == State::QUOTE) {
+                object_ptr = std::make_shared<Cell>(std::make_shared<Symbol>("'"), object_ptr);
+            } else if (frame.state == State::FIRST) {
+                if (special == Special::CLOSE) {
+                    object_ptr = nullptr;
+                } else if (special == Special::DOT) {
+                    throw SyntaxError("SymbolEqual(object_ptr, .)");
+                } else if (special == Special::QUOTE) {
+                    frame.state = State::QUOTE_WORD;
+                    frame.head = std::make_shared<Cell>(object_ptr, nullptr);
+                    break;
+                } else {
+                    frame.state = State::ELEMENT;
+                    frame.head = frame.last = std::make_shared<Cell>(object_ptr, nullptr);
+                    break;
+                }
+            } else if (frame.state == State::QUOTE_WORD) {
+                frame.head->SetSecond(object_ptr);
+                tokenizer->Next();
+                object_ptr = frame.head;
+            } else if (frame.state == State::ELEMENT) {
+                if (!frame.last_dot && special == Special::CLOSE) {
+                    object_ptr = frame.head;
+                } else if (special == Special::DOT) {
+                    frame.last_dot = true;
+                    break;
+                } else if (frame.last_dot) {
+                    frame.last->SetSecond(object_ptr);
+                    if (special == Special::CLOSE || special == Special::DOT) {
+                        throw SyntaxError("Readlist() ')' or '(' or '.' in pair");
+                    }
+                    frame.state = State::CLOSE;
+                    break;
+                } else {
+                    frame.last->SetSecond(std::make_shared<Cell>(object_ptr, nullptr));
+                    frame.last = As<Cell>(frame.last->GetSecond());
+                    break;
+                }
+            } else {
+                if (special != Special::CLOSE) {
+                    throw SyntaxError("Readlist() expected ')' after pair");
+                }
+                object_ptr = frame.head;
             }
-            return ret_cell;
-        } else {
-            last_cell->SetSecond(std::make_shared<Cell>(object_ptr, nullptr));
-            last_cell = As<Cell>(last_cell->GetSecond());
+            stack.pop_back();
+            special = Special::NONE;
         }
-        last_dot = false;
     }
 }
+
+}  // namespace
+
+std::shared_ptr<Object> Read(Tokenizer* tokenizer, bool is_first, size_t max_nesting) {
+    auto ret_val = ReadDatum(tokenizer, false, max_nesting);
+    // Ошибка
+    if (is_first && !tokenizer->IsEnd()) {
+        throw SyntaxError("is_first = true, but !tokenizer->IsEnd()");
+    }
+    return ret_val;
+}
+
+std::shared_ptr<Object> ReadList(Tokenizer* tokenizer, size_t max_nesting) {
+    return ReadDatum(tokenizer, true, max_nesting);
+}
@@ -1,10 +1,17 @@
 #pragma once
 
+#include <cstddef>
 #include <memory>
 
 #include "object.h"
 #include "tokenizer.h"
 
-std::shared_ptr<Object> Read(Tokenizer* tokenizer, bool is_first = true);
+// Глубина вложенности списков и quote по умолчанию. Чтение и разбор используют стек в куче,
+// более глубокий ввод - SyntaxError, а не переполнение стека
+constexpr size_t kDefaultMaxNesting = 10000;
 
-std::shared_ptr<Object> ReadList(Tokenizer* tokenizer);
+std::shared_ptr<Object> Read(Tokenizer* tokenizer, bool is_first = true,
+                             size_t max_nesting = kDefaultMaxNesting);
+
+// остаток списка после прочитанной "("
+std::shared_ptr<Object> ReadList(Tokenizer* tokenizer, size_t max_nesting = kDefaultMaxNesting);
@@ -1,57 +1,767 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <iterator>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <sstream>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "scheme.h"
 #include "object.h"
 #include "tokenizer.h"
 #include "parser.h"
 #include "types.h"
+#include "thread_pool.h"
 
-std::shared_ptr<Type> Interpreter::ParseTypes(std::shared_ptr<Object> obj) {
+std::shared_ptr<Type> Interpreter::ParseAtom(const std::shared_ptr<Object>& obj) {
     if (!obj) {
         return Pair::EmptyPair();
     }
     if (Is<Number>(obj)) {
-        return std::make_shared<Integer>(As<Number>(obj)->GetValue());
+        return Make<Integer>(As<Number>(obj)->GetValue());
     }
     if (Is<Symbol>(obj)) {
-        auto sym = As<Symbol>(obj);
-        std::string name = sym->GetName();
+        const std::string& name = static_cast<Symbol*>(obj.get())->GetName();
         if (name == "#t" || name == "#f") {
-            return std::make_shared<Bool>(name);
+            return Make<Bool>(name);
         }
         if (func_factory_.HasFunction(name)) {
             return func_factory_.GetFunction(name);
         } else {
-            return std::make_shared<UnknownSymbol>(As<Symbol>(obj)->GetName());
+            return Make<UnknownSymbol>(name);
         }
     }
-    if (Is<Cell>(obj)) {
-        auto cell = As<Cell>(obj);
-        std::shared_ptr<Type> first = ParseTypes(cell->GetFirst());
-        std::shared_ptr<Type> second = ParseTypes(cell->GetSecond());
-        return std::make_shared<Pair>(first, second);
-    }
     throw RuntimeError("You can not be here");
 }
 
+std::shared_ptr<Type> Interpreter::ParseTypes(std::shared_ptr<Object> obj, bool data) {
+    // Список, элементы которого разбираются. quote - (quote . datum), ждёт datum
+    struct Frame {
+        std::shared_ptr<Object> rest;
+        std::vector<std::shared_ptr<Type>> values;
+        bool data;
+        bool quote;
+        // разбирается хвост несобственного списка
+        bool in_tail = false;
+    };
+    std::vector<Frame> stack;
+    while (true) {
+        if (Is<Cell>(obj)) {
+            if (stack.size() >= max_nesting_) {
+                throw SyntaxError("ParseTypes() nesting is too deep");
+            }
+            auto cell = As<Cell>(obj);
+            // (quote . datum): литерал - данные, его списки компактные (см. Pair::MakeCompactList)
+            if (!data && Is<Symbol>(cell->GetFirst()) &&
+                As<Symbol>(cell->GetFirst())->GetName() == "'") {
+                stack.push_back({nullptr, {ParseAtom(cell->GetFirst())}, data, true});
+                obj = cell->GetSecond();
+                data = true;
+            } else {
+                stack.push_back({cell->GetSecond(), {}, data, false});
+                obj = cell->GetFirst();
+            }
+            continue;
+        }
+        auto value = ParseAtom(obj);
+        // поднимаемся, пока верхний кадр не запросит следующий элемент
+        while (true) {
+            if (stack.empty()) {
+                return value;
+            }
+            Frame& frame = stack.back();
+            if (frame.quote) {
+                value = Make<Pair>(frame.values[0], value);
+                stack.pop_back();
+                continue;
+            }
+            std::shared_ptr<Type> tail;
+            if (frame.in_tail) {
+                tail = value;
+            } else {
+                frame.values.push_back(value);
+                if (frame.rest) {
+                    data = frame.data;
+                    if (Is<Cell>(frame.rest)) {
+                        auto cell = As<Cell>(frame.rest);
+                        obj = cell->GetFirst();
+                        frame.rest = cell->GetSecond();
+                    } else {
+                        obj = std::move(frame.rest);
+                        frame.in_tail = true;
+                    }
+                    break;
+                }
+            }
+            value = frame.data ? Pair::MakeCompactList(frame.values, tail)
+                               : Pair::MakeList(frame.values, tail);
+            stack.pop_back();
+        }
+    }
+}
+
+namespace {
+
+// непустой список, в том числе несобственный
+bool IsList(const std::shared_ptr<Type>& value) {
+    return IsType<Pair>(value) && !AsType<Pair>(value)->Empty();
+}
+
+// Литералы quote разобранного дерева, которое будет вычисляться повторно, копируются при
+// каждом вычислении (см. LiteralQuote). Атомы не изменяются, поэтому копировать нужно только
+// списки
+void ProtectLiterals(const std::shared_ptr<Type>& tree, const std::shared_ptr<Function>& quote) {
+    std::vector<std::shared_ptr<Type>> nodes{tree};
+    while (!nodes.empty()) {
+        auto node = std::move(nodes.back());
+        nodes.pop_back();
+        if (IsType<ConstantNode>(node)) {
+            auto constant = AsType<ConstantNode>(node);
+            constant->copy = IsList(constant->value);
+            continue;
+        }
+        if (IsType<CallNode>(node)) {
+            // особая форма или макрос, известные только при вычислении, получают исходный список
+            nodes.push_back(AsType<CallNode>(node)->raw_args);
+        }
+        if (IsType<Node>(node)) {
+            AsType<Node>(node)->Children(&nodes);
+            continue;
+        }
+        if (!IsType<Pair>(node) || AsType<Pair>(node)->Empty()) {
+            continue;
+        }
+        auto pair = AsType<Pair>(node);
+        auto op = pair->GetFirst();
+        if (IsType<Quote>(op)) {
+            if (IsList(pair->GetSecond())) {
+                pair->SetFirst(quote);
+            }
+            continue;
+        }
+        if (IsType<DefineSyntax>(op)) {
+            continue;
+        }
+        nodes.push_back(op);
+        nodes.push_back(pair->GetSecond());
+    }
+}
+
+}  // namespace
+
+void ParseCache::SetCapacity(size_t capacity) {
+    capacity_ = capacity;
+    while (entries_.size() > capacity_) {
+        index_.erase(entries_.back().text);
+        entries_.pop_back();
+    }
+}
+
+ParseCache::Entry* ParseCache::Find(const std::string& str) {
+    auto it = index_.find(str);
+    if (it == index_.end()) {
+        return nullptr;
+    }
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return &*it->second;
+}
+
+ParseCache::Entry* ParseCache::Insert(std::string str, std::shared_ptr<Object> tree) {
+    if (capacity_ == 0) {
+        return nullptr;
+    }
+    if (entries_.size() == capacity_) {
+        index_.erase(entries_.back().text);
+        entries_.pop_back();
+    }
+    entries_.push_front({std::move(str), std::move(tree), nullptr, 0, Engine::TREE});
+    index_.emplace(entries_.front().text, entries_.begin());
+    return &entries_.front();
+}
+
+void ParseCache::DropAnalyzed() {
+    for (auto& entry : entries_) {
+        entry.analyzed = nullptr;
+    }
+}
+
+std::shared_ptr<Object> Interpreter::ReadExpression(const std::string& str) {
+    MemoryBuffer buffer(str.data(), str.size());
+    std::istream in(&buffer);
+    Tokenizer tokenizer(&in);
+    std::shared_ptr<Object> tree = Read(&tokenizer, true, max_nesting_);
+    if (!tokenizer.IsEnd()) {
+        throw SyntaxError("!!tokenizer.IsEnd() in Run()");
+    }
+    return tree;
+}
+
 std::string Interpreter::Run(std::string str) {
+    CheckIdle();
+    return RunExpression(std::move(str));
+}
+
+std::string Interpreter::RunExpression(std::string str) {
     if (str.empty()) {
         return "";
     }
-    std::stringstream ss(std::move(str));
-    Tokenizer tokenizer(&ss);
-    std::shared_ptr<Object> tree = Read(&tokenizer);
-    if (!tokenizer.IsEnd()) {
-        throw SyntaxError("!!tokenizer.IsEnd() in Run()");
+    if (parse_cache_.Capacity() == 0) {
+        std::string evaluated = EvaluateTree(ReadExpression(str));
+        collector_.Clear();
+        return evaluated;
+    }
+    auto entry = parse_cache_.Find(str);
+    collector_.CountParse(entry != nullptr);
+    if (!entry) {
+        auto tree = ReadExpression(str);
+        entry = parse_cache_.Insert(std::move(str), std::move(tree));
+    }
+    MemoryScope scope(resource_.get());
+    ShapeEpoch::Scope epoch(&shape_epoch_);
+    // entry принадлежит кэшу: на время вычисления дерево держит своя ссылка, и вытеснение или
+    // повторный разбор записи его не освободят
+    std::shared_ptr<Type> analyzed = entry->analyzed;
+    if (!analyzed || entry->macro_version != collector_.MacroVersion() ||
+        entry->engine != engine_) {
+        entry->analyzed = nullptr;
+        // версия до вычисления: define-syntax в самом выражении делает разбор устаревшим
+        uint64_t macro_version = collector_.MacroVersion();
+        analyzed = Analyze(entry->tree);
+        ProtectLiterals(analyzed, literal_quote_);
+        entry->analyzed = analyzed;
+        entry->macro_version = macro_version;
+        entry->engine = engine_;
     }
-    std::string evaluated = Evaluate(tree);
+    std::string evaluated = analyzed->Evaluate(collector_.GetRoot())->Repr();
     collector_.Clear();
     return evaluated;
 }
 
+namespace {
+
+// Производные формы, определённые через syntax-rules
+const char* const kPrelude[] = {
+    R"EOF(
+    (define-syntax let
+      (syntax-rules ()
+        ((_ ((name value) ...) body1 body2 ...)
+         ((lambda (name ...) body1 body2 ...) value ...))
+        ((_ tag ((name value) ...) body1 body2 ...)
+         (named-let tag ((name value) ...) body1 body2 ...))))
+    )EOF",
+    R"EOF(
+    (define-syntax let*
+      (syntax-rules ()
+        ((_ () body1 body2 ...) (let () body1 body2 ...))
+        ((_ ((name1 value1) (name value) ...) body1 body2 ...)
+         (let ((name1 value1)) (let* ((name value) ...) body1 body2 ...)))))
+    )EOF",
+    R"EOF(
+    (define-syntax cond
+      (syntax-rules (else)
+        ((_ (else e1 e2 ...)) (begin e1 e2 ...))
+        ((_ (test)) test)
+        ((_ (test) clause1 clause2 ...) (let ((t test)) (if t t (cond clause1 clause2 ...))))
+        ((_ (test e1 e2 ...)) (if test (begin e1 e2 ...)))
+        ((_ (test e1 e2 ...) clause1 clause2 ...)
+         (if test (begin e1 e2 ...) (cond clause1 clause2 ...)))))
+    )EOF",
+    R"EOF(
+    (define-syntax when
+      (syntax-rules ()
+        ((_ test e1 e2 ...) (if test (begin e1 e2 ...)))))
+    )EOF",
+    R"EOF(
+    (define-syntax unless
+      (syntax-rules ()
+        ((_ test e1 e2 ...) (if (not test) (begin e1 e2 ...)))))
+    )EOF",
+};
+
+template <typename Body>
+RunResult Guarded(Body&& body) {
+    RunResult result;
+    try {
+        result.value = body();
+    } catch (const SyntaxError& e) {
+        result.error = ErrorKind::SYNTAX;
+        result.message = e.what();
+    } catch (const NameError& e) {
+        result.error = ErrorKind::NAME;
+        result.message = e.what();
+    } catch (const RuntimeError& e) {
+        result.error = ErrorKind::RUNTIME;
+        result.message = e.what();
+    }
+    return result;
+}
+
+// ")" и "." вне списка Read возвращает символами
+void CheckTopLevel(const std::shared_ptr<Object>& tree) {
+    if (Is<Symbol>(tree)) {
+        const std::string& name = As<Symbol>(tree)->GetName();
+        if (name == ")" || name == ".") {
+            throw SyntaxError("Unexpected " + name);
+        }
+    }
+}
+
+// Файл, отображённый в память только для чтения
+class MappedFile {
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+
+public:
+    explicit MappedFile(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw RuntimeError("read-file: can not open " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw RuntimeError("read-file: can not stat " + path);
+        }
+        size_ = st.st_size;
+        if (size_ > 0) {
+            void* addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (addr == MAP_FAILED) {
+                throw RuntimeError("read-file: can not map " + path);
+            }
+            data_ = static_cast<const char*>(addr);
+        } else {
+            close(fd);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (data_) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    const char* Data() const {
+        return data_;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+};
+
+// минимальный кусок файла данных на поток
+constexpr size_t kReadFileChunk = 1 << 16;
+
+// Границы не более чем chunks кусков: пробелы вне скобок, перед которыми не стоит "'", поэтому
+// каждый кусок состоит из целых выражений верхнего уровня. Просмотр только считает скобки и
+// заканчивается на последней границе
+std::vector<size_t> SplitTopLevel(const char* data, size_t size, size_t chunks) {
+    std::vector<size_t> bounds{0};
+    long depth = 0;
+    char last = ' ';
+    for (size_t i = 0; i < size && bounds.size() < chunks; ++i) {
+        char c = data[i];
+        if (c == '(') {
+            ++depth;
+        } else if (c == ')') {
+            --depth;
+        } else if (c == ' ' || c == '\n') {
+            if (depth == 0 && last != '\'' && i >= size / chunks * bounds.size()) {
+                bounds.push_back(i);
+            }
+            continue;
+        }
+        last = c;
+    }
+    bounds.push_back(size);
+    return bounds;
+}
+
+// Отмена приостановленного вычисления. Как и ContinuationJump, не наследуется от
+// std::exception, чтобы обработчики ошибок по пути его не перехватывали
+struct EvaluationCancelled {};
+
+}  // namespace
+
+// Поток вычисления и поток владельца работают по очереди: владелец ждёт, пока вычисление не
+// остановится (кончилось топливо или завершилось), а вычисление в Refuel ждёт Resume
+struct Evaluation::State : public FuelTank {
+    enum class Phase { RUNNING, SUSPENDED, DONE };
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    Phase phase = Phase::RUNNING;
+    bool cancelled = false;
+    RunResult result;
+    // исключение, которое не перехватывает Guarded; пробрасывается из Run или Resume
+    std::exception_ptr error;
+
+    void Refuel() override {
+        std::unique_lock lock(mutex);
+        while (fuel == 0 && !cancelled) {
+            phase = Phase::SUSPENDED;
+            changed.notify_all();
+            changed.wait(lock, [this] { return phase == Phase::RUNNING; });
+        }
+        if (cancelled) {
+            throw EvaluationCancelled();
+        }
+    }
+
+    void Finish(RunResult value, std::exception_ptr exception) {
+        std::lock_guard lock(mutex);
+        result = std::move(value);
+        error = exception;
+        phase = Phase::DONE;
+        changed.notify_all();
+    }
+
+    // ждёт остановки вычисления
+    void Wait() {
+        std::unique_lock lock(mutex);
+        changed.wait(lock, [this] { return phase != Phase::RUNNING; });
+    }
+
+    void Continue(size_t more, bool cancel) {
+        {
+            std::lock_guard lock(mutex);
+            fuel += more;
+            cancelled = cancelled || cancel;
+            phase = Phase::RUNNING;
+            changed.notify_all();
+        }
+        Wait();
+    }
+
+    void RethrowError() {
+        if (error) {
+            std::rethrow_exception(std::exchange(error, nullptr));
+        }
+    }
+};
+
+// Один поток на интерпретатор выполняет его вычисления с бюджетом по очереди. Новый поток на
+// каждый Run стоил бы его создания и join на каждом коротком вычислении
+class Interpreter::EvaluationThread {
+private:
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::function<void()> task_;
+    bool stop_ = false;
+    std::thread thread_;
+
+    void Loop() {
+        std::unique_lock lock(mutex_);
+        while (true) {
+            ready_.wait(lock, [this] { return stop_ || task_; });
+            if (!task_) {
+                return;
+            }
+            auto task = std::exchange(task_, nullptr);
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+public:
+    EvaluationThread() : thread_([this] { Loop(); }) {
+    }
+
+    ~EvaluationThread() {
+        {
+            std::lock_guard lock(mutex_);
+            stop_ = true;
+        }
+        ready_.notify_one();
+        thread_.join();
+    }
+
+    // интерпретатор занят, пока задача не завершилась, поэтому предыдущая уже взята
+    void Post(std::function<void()> task) {
+        {
+            std::lock_guard lock(mutex_);
+            task_ = std::move(task);
+        }
+        ready_.notify_one();
+    }
+};
+
+Evaluation::Evaluation(std::unique_ptr<State> state) : state_(std::move(state)) {
+}
+
+Evaluation::Evaluation(Evaluation&& other) noexcept = default;
+
+Evaluation& Evaluation::operator=(Evaluation&& other) noexcept {
+    if (this != &other) {
+        Cancel();
+        state_ = std::move(other.state_);
+    }
+    return *this;
+}
+
+Evaluation::~Evaluation() {
+    Cancel();
+}
+
+bool Evaluation::Done() const {
+    std::lock_guard lock(state_->mutex);
+    return state_->phase == State::Phase::DONE;
+}
+
+const RunResult& Evaluation::Result() const {
+    if (!Done()) {
+        throw RuntimeError("Evaluation is not finished");
+    }
+    return state_->result;
+}
+
+bool Evaluation::Resume(size_t fuel) {
+    if (!Done()) {
+        state_->Continue(fuel, false);
+        state_->RethrowError();
+    }
+    return Done();
+}
+
+void Evaluation::Cancel() {
+    if (state_ && !Done()) {
+        state_->Continue(0, true);
+    }
+}
+
+Interpreter::Interpreter() : Interpreter(MemoryOptions()) {
+}
+
+Interpreter::Interpreter(const MemoryOptions& options)
+    : literal_quote_(std::make_shared<LiteralQuote>()) {
+    if (options.limit || options.arena ||
+        options.upstream != std::pmr::new_delete_resource()) {
+        resource_ = std::make_unique<LimitedResource>(
+            options.upstream, options.limit ? options.limit : SIZE_MAX, options.arena);
+    }
+    LoadPrelude();
+}
+
+Interpreter::~Interpreter() {
+    if (active_) {
+        active_->Continue(0, true);
+    }
+}
+
+void Interpreter::LoadPrelude() {
+    // без сборки мусора: prelude не должен попадать в статистику сборщика
+    for (const char* form : kPrelude) {
+        std::istringstream in(form);
+        Tokenizer tokenizer(&in);
+        EvaluateTree(Read(&tokenizer));
+    }
+}
+
+void Interpreter::CollectIfOverBudget() {
+    if (collector_.AllocatedSinceClear() >= collection_budget_) {
+        collector_.Clear();
+    }
+}
+
+void Interpreter::CheckIdle() const {
+    if (active_) {
+        throw RuntimeError("Interpreter is busy with a suspended evaluation");
+    }
+}
+
+Evaluation Interpreter::Run(std::string str, size_t fuel) {
+    CheckIdle();
+    auto state = std::make_unique<Evaluation::State>();
+    state->fuel = fuel;
+    if (!evaluation_thread_) {
+        evaluation_thread_ = std::make_unique<EvaluationThread>();
+    }
+    active_ = state.get();
+    collector_.SetFuel(active_);
+    evaluation_thread_->Post([this, state = active_, str = std::move(str)]() mutable {
+        RunResult result;
+        std::exception_ptr error;
+        try {
+            result = Guarded([&] { return RunExpression(std::move(str)); });
+        } catch (const EvaluationCancelled&) {
+            result.error = ErrorKind::RUNTIME;
+            result.message = "Evaluation is cancelled";
+        } catch (...) {
+            error = std::current_exception();
+        }
+        if (!result.Ok() || error) {
+            collector_.Clear();
+        }
+        collector_.SetFuel(nullptr);
+        active_ = nullptr;
+        state->Finish(std::move(result), error);
+    });
+    Evaluation evaluation(std::move(state));
+    evaluation.state_->Wait();
+    evaluation.state_->RethrowError();
+    return evaluation;
+}
+
+RunResult Interpreter::TryRun(std::string str) {
+    RunResult result = Guarded([&] { return Run(std::move(str)); });
+    if (!result.Ok() && !active_) {
+        // Run собирает мусор только после успешного вычисления
+        collector_.Clear();
+    }
+    return result;
+}
+
+std::vector<RunResult> Interpreter::RunBatch(std::span<const std::string> items) {
+    CheckIdle();
+    std::vector<RunResult> results;
+    results.reserve(items.size());
+    std::istream in(nullptr);
+    for (const std::string& item : items) {
+        results.push_back(Guarded([&] {
+            MemoryBuffer buffer(item.data(), item.size());
+            in.rdbuf(&buffer);
+            Tokenizer tokenizer(&in);
+            if (tokenizer.IsEnd()) {
+                return std::string();
+            }
+            std::shared_ptr<Object> tree = Read(&tokenizer, true, max_nesting_);
+            CheckTopLevel(tree);
+            return EvaluateTree(tree);
+        }));
+        CollectIfOverBudget();
+    }
+    collector_.Clear();
+    return results;
+}
+
+void Interpreter::RunStream(std::istream& in,
+                            const std::function<void(const RunResult&)>& callback) {
+    CheckIdle();
+    std::optional<Tokenizer> tokenizer;
+    RunResult result = Guarded([&] {
+        tokenizer.emplace(&in);
+        return std::string();
+    });
+    if (!result.Ok()) {
+        callback(result);
+        return;
+    }
+    while (!tokenizer->IsEnd()) {
+        std::shared_ptr<Object> tree;
+        result = Guarded([&] {
+            tree = Read(&*tokenizer, false, max_nesting_);
+            CheckTopLevel(tree);
+            return std::string();
+        });
+        if (!result.Ok()) {
+            callback(result);
+            break;
+        }
+        callback(Guarded([&] { return EvaluateTree(tree); }));
+        CollectIfOverBudget();
+    }
+    collector_.Clear();
+}
+
+size_t Interpreter::ReadFile(const std::string& name, const std::string& path) {
+    CheckIdle();
+    MemoryScope scope(resource_.get());
+    ShapeEpoch::Scope epoch(&shape_epoch_);
+    MappedFile file(path);
+    ThreadPool& pool = ThreadPool::Shared();
+    size_t chunks = std::min(file.Size() / kReadFileChunk + 1, 4 * pool.Concurrency());
+    auto bounds = SplitTopLevel(file.Data(), file.Size(), chunks);
+    // ParseTypes только читает func_factory_, поэтому куски разбираются независимо
+    std::vector<std::vector<std::shared_ptr<Type>>> parts(bounds.size() - 1);
+    pool.ParallelFor(parts.size(), [&](size_t part) {
+        MemoryBuffer buffer(file.Data() + bounds[part], bounds[part + 1] - bounds[part]);
+        std::istream in(&buffer);
+        Tokenizer tokenizer(&in);
+        while (!tokenizer.IsEnd()) {
+            std::shared_ptr<Object> tree = Read(&tokenizer, false, max_nesting_);
+            CheckTopLevel(tree);
+            parts[part].push_back(ParseTypes(tree, true));
+        }
+    });
+    std::vector<std::shared_ptr<Type>> values;
+    for (auto& part : parts) {
+        values.insert(values.end(), std::make_move_iterator(part.begin()),
+                      std::make_move_iterator(part.end()));
+    }
+    collector_.GetRoot()->Add(name, Pair::MakeCompactList(values));
+    return values.size();
+}
+
+void Interpreter::SetParseCacheSize(size_t entries) {
+    CheckIdle();
+    parse_cache_.SetCapacity(entries);
+}
+
+void Interpreter::SetCollectionBudget(size_t contexts) {
+    CheckIdle();
+    collection_budget_ = contexts;
+}
+
+void Interpreter::SetMaxNesting(size_t depth) {
+    CheckIdle();
+    max_nesting_ = depth;
+}
+
+void Interpreter::SetEngine(Engine engine) {
+    CheckIdle();
+    engine_ = engine;
+}
+
+std::shared_ptr<Type> Interpreter::Analyze(std::shared_ptr<Object> tree) {
+    std::shared_ptr<Type> type =
+        optimizer_.Fold(expander_.Expand(ParseTypes(tree), collector_.GetRoot()));
+    if (engine_ == Engine::COMPILED) {
+        return compiler_.Compile(type);
+    }
+    return compiler_.Resolve(type);
+}
+
 std::string Interpreter::Evaluate(std::shared_ptr<Object> tree) {
-    std::shared_ptr<Type> type = ParseTypes(tree);
-    return type->Evaluate(collector_.GetRoot())->Repr();
+    CheckIdle();
+    return EvaluateTree(std::move(tree));
+}
+
+std::string Interpreter::EvaluateTree(std::shared_ptr<Object> tree) {
+    MemoryScope scope(resource_.get());
+    ShapeEpoch::Scope epoch(&shape_epoch_);
+    return Analyze(tree)->Evaluate(collector_.GetRoot())->Repr();
+}
+
+size_t Interpreter::MemoryUsed() const {
+    return resource_ ? resource_->Used() : 0;
+}
+
+void Interpreter::Reset() {
+    CheckIdle();
+    parse_cache_.DropAnalyzed();
+    collector_.Reset();
+    if (resource_) {
+        resource_->Reset();
+    }
+    LoadPrelude();
+}
+
+RuntimeStats Interpreter::GetStats() const {
+    return collector_.GetStats();
 }
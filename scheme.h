@@ -1,22 +1,247 @@
 #pragma once
 
+#include <cstddef>
+#include <functional>
+#include <istream>
+#include <list>
 #include <memory>
+#include <span>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "object.h"
+#include "parser.h"
 #include "types.h"
 #include "function_factory.h"
+#include "optimizer.h"
+#include "compiler.h"
+#include "macro.h"
+#include "memory.h"
+
+// TREE - вычисление дерева Pair через Function::Apply, COMPILED - дерево узлов Compiler
+enum class Engine { TREE, COMPILED };
+
+enum class ErrorKind { NONE, SYNTAX, NAME, RUNTIME };
+
+// Результат одного выражения пакета: значение или ошибка без исключения
+struct RunResult {
+    std::string value;
+    ErrorKind error = ErrorKind::NONE;
+    std::string message;
+
+    bool Ok() const {
+        return error == ErrorKind::NONE;
+    }
+};
+
+// LRU-кэш разобранных выражений по тексту. Хранит дерево Read и дерево после разбора в типы,
+// раскрытия макросов, свёртки и компиляции. Второе зависит от определённых макросов и режима
+// вычисления, поэтому верно, пока они те же, что при разборе; иначе разбирается заново из
+// дерева Read. Литералы quote в нём копируются при каждом вычислении, так что set-car!
+// литерала из прошлого вызова не влияет на следующий
+class ParseCache {
+public:
+    struct Entry {
+        std::string text;
+        // дерево Read; может быть nullptr: так Read читает "()"
+        std::shared_ptr<Object> tree;
+        // nullptr - ещё не разобрано или разбор устарел
+        std::shared_ptr<Type> analyzed;
+        // GarbageCollector::MacroVersion и режим на момент разбора
+        uint64_t macro_version = 0;
+        Engine engine = Engine::TREE;
+    };
+
+private:
+    size_t capacity_ = 0;
+    // последний использованный - первый
+    std::list<Entry> entries_;
+    // ключ - строка из entries_, она не перемещается
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;
+
+public:
+    size_t Capacity() const {
+        return capacity_;
+    }
+
+    void SetCapacity(size_t capacity);
+
+    // nullptr - выражения нет в кэше
+    Entry* Find(const std::string& str);
+
+    // при нулевой ёмкости - nullptr
+    Entry* Insert(std::string str, std::shared_ptr<Object> tree);
+
+    // забывает разобранные деревья: они выделены из памяти интерпретатора (см. Interpreter::Reset)
+    void DropAnalyzed();
+};
+
+// Память значений и контекстов интерпретатора. По умолчанию - обычная куча без предела
+struct MemoryOptions {
+    std::pmr::memory_resource* upstream = std::pmr::new_delete_resource();
+    // байт, 0 - без предела. Выделение сверх предела - RuntimeError "out of memory"
+    size_t limit = 0;
+    // монотонная арена: освобождение ничего не стоит, память возвращается только в Reset
+    bool arena = false;
+};
+
+// Вычисление с бюджетом шагов, см. Interpreter::Run(str, fuel). Выполняется в потоке
+// вычислений интерпретатора, который ждёт, пока вычисление приостановлено. Пока оно не
+// завершено, интерпретатор занят. Удаление незавершённого вычисления отменяет его
+class Evaluation {
+private:
+    friend class Interpreter;
+
+    struct State;
+
+    std::unique_ptr<State> state_;
+
+    explicit Evaluation(std::unique_ptr<State> state);
+
+public:
+    Evaluation(Evaluation&& other) noexcept;
+
+    Evaluation& operator=(Evaluation&& other) noexcept;
+
+    ~Evaluation();
+
+    bool Done() const;
+
+    // результат завершённого вычисления, до завершения - RuntimeError
+    const RunResult& Result() const;
+
+    // продолжает вычисление с fuel шагами; возвращает Done()
+    bool Resume(size_t fuel);
+
+    // отменяет вычисление: результат - RuntimeError, определения до отмены сохраняются
+    void Cancel();
+};
 
 class Interpreter {
 private:
+    // объявлен первым: значения, выделенные из ресурса, разрушаются раньше него
+    std::unique_ptr<LimitedResource> resource_;
+
+    // эпоха кэшей формы списков этого интерпретатора
+    ShapeEpoch shape_epoch_;
+
     FunctionFactory func_factory_;
 
     GarbageCollector collector_;
 
-    std::shared_ptr<Type> ParseTypes(std::shared_ptr<Object> obj);
+    MacroExpander expander_;
+
+    Optimizer optimizer_;
+
+    Compiler compiler_;
+
+    Engine engine_ = Engine::TREE;
+
+    ParseCache parse_cache_;
+
+    // quote в деревьях кэша разбора: возвращает копию литерала
+    std::shared_ptr<Function> literal_quote_;
+
+    // сколько контекстов может накопиться внутри пакета до сборки
+    size_t collection_budget_ = 1 << 16;
+
+    // глубина вложенности, допустимая при чтении и разборе выражения
+    size_t max_nesting_ = kDefaultMaxNesting;
+
+    // незавершённое вычисление с бюджетом
+    Evaluation::State* active_ = nullptr;
+
+    // поток для вычислений с бюджетом, создаётся при первом Run(str, fuel)
+    class EvaluationThread;
+
+    // объявлен последним: поток останавливается раньше, чем разрушается то, что он использует
+    std::unique_ptr<EvaluationThread> evaluation_thread_;
+
+    void CollectIfOverBudget();
+
+    // RuntimeError, если интерпретатор занят незавершённым вычислением
+    void CheckIdle() const;
+
+    // Run без проверки занятости
+    std::string RunExpression(std::string str);
+
+    // Evaluate без проверки занятости: для Run, пакетов и prelude
+    std::string EvaluateTree(std::shared_ptr<Object> tree);
+
+    // одно выражение, весь текст str
+    std::shared_ptr<Object> ReadExpression(const std::string& str);
+
+    // число, символ или nullptr - пустой список
+    std::shared_ptr<Type> ParseAtom(const std::shared_ptr<Object>& obj);
+
+    // data - разбирается литерал внутри quote. Без рекурсии, вложенность - до max_nesting_
+    std::shared_ptr<Type> ParseTypes(std::shared_ptr<Object> obj, bool data = false);
+
+    // производные формы из prelude: let, let*, cond, when, unless
+    void LoadPrelude();
+
+    // разбор в типы, раскрытие макросов, свёртка и компиляция (в режиме TREE - только
+    // связывание локальных имён со слотами, см. Compiler::Resolve)
+    std::shared_ptr<Type> Analyze(std::shared_ptr<Object> tree);
 
 public:
+    Interpreter();
+
+    explicit Interpreter(const MemoryOptions& options);
+
+    // отменяет незавершённое вычисление с бюджетом
+    ~Interpreter();
+
     std::string Run(std::string str);
 
+    // Run, который тратит не больше fuel шагов (вызовов лямбд и итераций циклов). Если топливо
+    // кончилось, вычисление приостанавливается, и его можно продолжить через Resume. Вычисление
+    // идёт в потоке интерпретатора, который создаётся при первом вызове и затем
+    // переиспользуется; каждый Run и Resume - две передачи управления между потоками
+    Evaluation Run(std::string str, size_t fuel);
+
+    // Run без исключений: ошибка возвращается в RunResult. Для скриптов, которые часто
+    // завершаются ошибкой
+    RunResult TryRun(std::string str);
+
+    // Выражения выполняются по очереди в одном окружении, ошибка одного не прерывает пакет.
+    // Сборка мусора - в конце пакета или по бюджету выделений
+    std::vector<RunResult> RunBatch(std::span<const std::string> items);
+
+    // Читает из потока выражения подряд и отдаёт результат каждого в callback. После
+    // синтаксической ошибки чтение останавливается
+    void RunStream(std::istream& in, const std::function<void(const RunResult&)>& callback);
+
+    // Файл данных path отображается в память, выражения верхнего уровня разбираются как
+    // литералы quote кусками в пуле потоков, и их список связывается с глобальным именем name.
+    // Возвращает число выражений
+    size_t ReadFile(const std::string& name, const std::string& path);
+
+    // Настройки и Evaluate, как и Run, во время приостановленного вычисления - RuntimeError
+    void SetCollectionBudget(size_t contexts);
+
+    // Run берёт разобранное дерево повторяющихся выражений из кэша на entries выражений,
+    // 0 - кэш выключен (по умолчанию)
+    void SetParseCacheSize(size_t entries);
+
+    // Чтение и разбор глубже depth уровней вложенности - SyntaxError. По умолчанию
+    // kDefaultMaxNesting (parser.h)
+    void SetMaxNesting(size_t depth);
+
+    void SetEngine(Engine engine);
+
+    // Байт, выделенных из ресурса интерпретатора; 0 - MemoryOptions по умолчанию
+    size_t MemoryUsed() const;
+
+    // Забывает все глобальные определения и освобождает память значений (арену - целиком),
+    // затем заново загружает prelude. Настройки интерпретатора и деревья Read в кэше разбора
+    // сохраняются
+    void Reset();
+
     std::string Evaluate(std::shared_ptr<Object> tree);
+
+    RuntimeStats GetStats() const;
 };
@@ -0,0 +1,397 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <malloc.h>
+
+#include "test_runner.h"
+
+// -----------------------------------------------------------
+// Учёт памяти: глобальные operator new и delete считают выделения и занятые байты. Размер
+// блока берётся из malloc_usable_size, поэтому delete без размера вычитает ровно столько же
+
+namespace {
+
+std::atomic<size_t> allocations{0};
+std::atomic<size_t> live_bytes{0};
+std::atomic<size_t> peak_bytes{0};
+
+void* Allocate(size_t size) {
+    void* ptr = std::malloc(size ? size : 1);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    size_t live =
+        live_bytes.fetch_add(malloc_usable_size(ptr), std::memory_order_relaxed) +
+        malloc_usable_size(ptr);
+    size_t peak = peak_bytes.load(std::memory_order_relaxed);
+    while (live > peak &&
+           !peak_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+    return ptr;
+}
+
+void Deallocate(void* ptr) {
+    if (ptr) {
+        live_bytes.fetch_sub(malloc_usable_size(ptr), std::memory_order_relaxed);
+        std::free(ptr);
+    }
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+    return Allocate(size);
+}
+
+void* operator new[](size_t size) {
+    return Allocate(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    Deallocate(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    Deallocate(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    Deallocate(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    Deallocate(ptr);
+}
+
+namespace {
+
+// -----------------------------------------------------------
+// Реестр случаев
+
+struct TestCase {
+    const char* name;
+    void (*body)();
+};
+
+std::vector<TestCase>& Registry() {
+    static std::vector<TestCase> tests;
+    return tests;
+}
+
+struct Measurement {
+    double time_ms = 0;
+    size_t allocations = 0;
+    size_t peak_bytes = 0;
+};
+
+// -----------------------------------------------------------
+// JSON базовой линии: объекты, строки и числа - всё, что пишет WriteBaseline
+
+struct Json {
+    std::map<std::string, Json> object;
+    double number = 0;
+
+    const Json* Find(const std::string& key) const {
+        auto it = object.find(key);
+        return it == object.end() ? nullptr : &it->second;
+    }
+
+    double Number(const std::string& key, double fallback) const {
+        const Json* value = Find(key);
+        return value ? value->number : fallback;
+    }
+};
+
+class JsonParser {
+private:
+    const std::string& text_;
+    size_t pos_ = 0;
+
+    void SkipSpaces() {
+        while (pos_ < text_.size() && std::isspace(static_cast<unsigned char>(text_[pos_]))) {
+            ++pos_;
+        }
+    }
+
+    void Expect(char c) {
+        SkipSpaces();
+        if (pos_ >= text_.size() || text_[pos_] != c) {
+            throw std::runtime_error("baseline: expected '" + std::string(1, c) + "' at " +
+                                     std::to_string(pos_));
+        }
+        ++pos_;
+    }
+
+    std::string ParseString() {
+        Expect('"');
+        size_t end = text_.find('"', pos_);
+        if (end == std::string::npos) {
+            throw std::runtime_error("baseline: unterminated string");
+        }
+        std::string result = text_.substr(pos_, end - pos_);
+        pos_ = end + 1;
+        return result;
+    }
+
+public:
+    explicit JsonParser(const std::string& text) : text_(text) {
+    }
+
+    // вложенность базовой линии - три уровня, рекурсия здесь безопасна
+    Json Parse() {
+        Json result;
+        SkipSpaces();
+        if (pos_ < text_.size() && text_[pos_] == '{') {
+            ++pos_;
+            SkipSpaces();
+            if (pos_ < text_.size() && text_[pos_] == '}') {
+                ++pos_;
+                return result;
+            }
+            while (true) {
+                std::string key = ParseString();
+                Expect(':');
+                result.object[key] = Parse();
+                SkipSpaces();
+                if (pos_ < text_.size() && text_[pos_] == ',') {
+                    ++pos_;
+                    continue;
+                }
+                Expect('}');
+                return result;
+            }
+        }
+        char* end = nullptr;
+        result.number = std::strtod(text_.c_str() + pos_, &end);
+        if (end == text_.c_str() + pos_) {
+            throw std::runtime_error("baseline: expected number at " + std::to_string(pos_));
+        }
+        pos_ = end - text_.c_str();
+        return result;
+    }
+};
+
+// Допуски: замер больше базового значения в factor раз (для времени - ещё и больше чем на
+// slack_ms) - регрессия. Значения по умолчанию переопределяются разделом "tolerance" файла и
+// разделом "tolerance" отдельного случая
+struct Tolerance {
+    double time = 1.5;
+    double time_slack_ms = 20;
+    double allocations = 1.1;
+    double peak_bytes = 1.25;
+
+    void Override(const Json* json) {
+        if (!json) {
+            return;
+        }
+        time = json->Number("time", time);
+        time_slack_ms = json->Number("time_slack_ms", time_slack_ms);
+        allocations = json->Number("allocations", allocations);
+        peak_bytes = json->Number("peak_bytes", peak_bytes);
+    }
+};
+
+Json LoadBaseline(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("baseline: can not open " + path);
+    }
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    std::string text = buffer.str();
+    return JsonParser(text).Parse();
+}
+
+// список регрессий случая, пустой - укладывается в допуски
+std::vector<std::string> Compare(const Measurement& measured, const Json& base,
+                                 Tolerance tolerance) {
+    tolerance.Override(base.Find("tolerance"));
+    std::vector<std::string> regressions;
+    auto check = [&](const char* what, double value, double limit) {
+        if (value > limit) {
+            std::ostringstream out;
+            out << what << " " << value << " > " << limit;
+            regressions.push_back(out.str());
+        }
+    };
+    double time_ms = base.Number("time_ms", measured.time_ms);
+    check("time_ms", measured.time_ms,
+          std::max(time_ms * tolerance.time, time_ms + tolerance.time_slack_ms));
+    check("allocations", measured.allocations,
+          base.Number("allocations", measured.allocations) * tolerance.allocations);
+    check("peak_bytes", measured.peak_bytes,
+          base.Number("peak_bytes", measured.peak_bytes) * tolerance.peak_bytes);
+    return regressions;
+}
+
+// Пишет замеры; допуски отдельных случаев и общий раздел "tolerance" берутся из old
+void WriteBaseline(const std::string& path, const std::vector<std::string>& names,
+                   const std::vector<Measurement>& measured, const Json& old) {
+    std::ofstream out(path);
+    auto write_tolerance = [&out](const Json& tolerance) {
+        out << "\"tolerance\": {";
+        bool first = true;
+        for (const auto& [key, value] : tolerance.object) {
+            out << (first ? "" : ", ") << "\"" << key << "\": " << value.number;
+            first = false;
+        }
+        out << "}";
+    };
+    out << "{\n";
+    if (const Json* tolerance = old.Find("tolerance")) {
+        out << "  ";
+        write_tolerance(*tolerance);
+        out << ",\n";
+    }
+    out << "  \"cases\": {\n";
+    const Json* old_cases = old.Find("cases");
+    for (size_t i = 0; i < names.size(); ++i) {
+        out << "    \"" << names[i] << "\": {\"time_ms\": " << measured[i].time_ms
+            << ", \"allocations\": " << measured[i].allocations
+            << ", \"peak_bytes\": " << measured[i].peak_bytes;
+        const Json* old_case = old_cases ? old_cases->Find(names[i]) : nullptr;
+        if (const Json* tolerance = old_case ? old_case->Find("tolerance") : nullptr) {
+            out << ", ";
+            write_tolerance(*tolerance);
+        }
+        out << "}" << (i + 1 < names.size() ? "," : "") << "\n";
+    }
+    out << "  }\n}\n";
+}
+
+// один прогон случая; сообщение об ошибке - в error
+Measurement RunCase(const TestCase& test, std::string* error) {
+    Measurement result;
+    size_t allocations_before = allocations.load();
+    size_t live_before = live_bytes.load();
+    peak_bytes.store(live_before);
+    auto start = std::chrono::steady_clock::now();
+    try {
+        test.body();
+    } catch (const std::exception& e) {
+        *error = e.what();
+    } catch (...) {
+        // случай не должен обрывать весь прогон, что бы он ни бросил
+        *error = "unknown exception";
+    }
+    result.time_ms =
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+            .count();
+    result.allocations = allocations.load() - allocations_before;
+    result.peak_bytes = peak_bytes.load() - std::min(live_before, peak_bytes.load());
+    return result;
+}
+
+}  // namespace
+
+bool RegisterTest(const char* name, void (*body)()) {
+    Registry().push_back({name, body});
+    return true;
+}
+
+void FailCheck(const char* file, int line, const std::string& message) {
+    throw TestFailure(std::string(file) + ":" + std::to_string(line) + ": " + message);
+}
+
+int RunTests(int argc, char** argv) {
+    std::string filter;
+    std::string baseline_path;
+    std::string write_path;
+    size_t repeat = 1;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "missing value for " << arg << "\n";
+            return 2;
+        }
+        if (arg == "--filter") {
+            filter = argv[++i];
+        } else if (arg == "--repeat") {
+            repeat = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--baseline") {
+            baseline_path = argv[++i];
+        } else if (arg == "--write-baseline") {
+            write_path = argv[++i];
+        } else {
+            std::cerr << "unknown option " << arg << "\n";
+            return 2;
+        }
+    }
+
+    Json baseline;
+    const std::string& load_path = baseline_path.empty() ? write_path : baseline_path;
+    if (!load_path.empty() && (!baseline_path.empty() || std::ifstream(load_path))) {
+        baseline = LoadBaseline(load_path);
+    }
+    Tolerance tolerance;
+    tolerance.Override(baseline.Find("tolerance"));
+    const Json* base_cases = baseline.Find("cases");
+
+    size_t failed = 0;
+    size_t regressed = 0;
+    std::vector<std::string> names;
+    std::vector<Measurement> measured;
+    for (const TestCase& test : Registry()) {
+        if (std::string(test.name).find(filter) == std::string::npos) {
+            continue;
+        }
+        // минимум по повторам: шум планировщика только увеличивает замеры
+        Measurement best;
+        std::string error;
+        for (size_t k = 0; k < repeat && error.empty(); ++k) {
+            Measurement run = RunCase(test, &error);
+            if (k == 0 || run.time_ms < best.time_ms) {
+                best.time_ms = run.time_ms;
+            }
+            if (k == 0 || run.allocations < best.allocations) {
+                best.allocations = run.allocations;
+            }
+            if (k == 0 || run.peak_bytes < best.peak_bytes) {
+                best.peak_bytes = run.peak_bytes;
+            }
+        }
+        std::printf("[%s] %-30s %10.2f ms %10zu allocs %10zu peak bytes\n",
+                    error.empty() ? " OK " : "FAIL", test.name, best.time_ms, best.allocations,
+                    best.peak_bytes);
+        if (!error.empty()) {
+            std::printf("       %s\n", error.c_str());
+            ++failed;
+            continue;
+        }
+        names.push_back(test.name);
+        measured.push_back(best);
+        if (baseline_path.empty()) {
+            continue;
+        }
+        const Json* base = base_cases ? base_cases->Find(test.name) : nullptr;
+        if (!base) {
+            std::printf("       no baseline\n");
+            continue;
+        }
+        auto regressions = Compare(best, *base, tolerance);
+        for (const auto& regression : regressions) {
+            std::printf("       regression: %s\n", regression.c_str());
+        }
+        regressed += !regressions.empty();
+    }
+    std::fflush(stdout);
+
+    if (!write_path.empty()) {
+        WriteBaseline(write_path, names, measured, baseline);
+    }
+    std::printf("%zu cases, %zu failed, %zu regressed\n", names.size() + failed, failed,
+                regressed);
+    return failed || regressed ? 1 : 0;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+// Тесты и замеры производительности. Каждый случай - функция, объявленная через TEST_CASE.
+// Раннер выполняет случаи по отдельности: проваленная проверка завершает только свой случай.
+// Для каждого случая измеряются время, число выделений памяти (operator new во всех потоках) и
+// пик занятой памяти относительно начала случая; с --baseline замеры сравниваются с файлом
+// baseline.json с допусками. Запуск:
+//
+//   scheme [--filter подстрока] [--repeat N] [--baseline файл] [--write-baseline файл]
+
+// проваленная проверка CHECK или исключение из тестируемого кода
+class TestFailure : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+bool RegisterTest(const char* name, void (*body)());
+
+[[noreturn]] void FailCheck(const char* file, int line, const std::string& message);
+
+int RunTests(int argc, char** argv);
+
+#define CHECK(condition)                               \
+    do {                                               \
+        if (!(condition)) {                            \
+            FailCheck(__FILE__, __LINE__, #condition); \
+        }                                              \
+    } while (false)
+
+// Случай - функция Test<name>, регистрируется при статической инициализации, поэтому случаи
+// выполняются в порядке определения в файле
+#define TEST_CASE(name)                                                          \
+    void Test##name();                                                           \
+    [[maybe_unused]] const bool kTest##name = RegisterTest(#name, Test##name); \
+    void Test##name()
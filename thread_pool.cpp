@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <atomic>
+#include <exception>
+
+#include "thread_pool.h"
+#include "memory.h"
+#include "types.h"
+
+struct ThreadPool::Job {
+    const std::function<void(size_t)>* body;
+    size_t count;
+    // ресурс памяти вызывающего потока, потоки пула выделяют из него же
+    std::pmr::memory_resource* resource;
+    // и эпоха кэшей формы списков
+    ShapeEpoch* shape_epoch;
+    std::atomic<size_t> next = 0;
+    std::atomic<bool> failed = false;
+    size_t finished = 0;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable done;
+
+    void Run() {
+        MemoryScope scope(resource);
+        ShapeEpoch::Scope epoch(shape_epoch);
+        size_t completed = 0;
+        for (size_t i = next++; i < count; i = next++) {
+            if (!failed) {
+                try {
+                    (*body)(i);
+                } catch (...) {
+                    std::lock_guard lock(mutex);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                    failed = true;
+                }
+            }
+            ++completed;
+        }
+        if (completed > 0) {
+            std::lock_guard lock(mutex);
+            finished += completed;
+            if (finished == count) {
+                done.notify_all();
+            }
+        }
+    }
+};
+
+ThreadPool::ThreadPool(size_t threads) {
+    for (size_t i = 0; i < threads; ++i) {
+        workers_.emplace_back([this] { WorkerLoop(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    ready_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+namespace {
+
+std::atomic<ThreadPool*> shared_override = nullptr;
+
+}  // namespace
+
+ThreadPool& ThreadPool::Shared() {
+    if (ThreadPool* pool = shared_override.load(std::memory_order_acquire)) {
+        return *pool;
+    }
+    static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+    return pool;
+}
+
+void ThreadPool::SetShared(ThreadPool* pool) {
+    shared_override.store(pool, std::memory_order_release);
+}
+
+void ThreadPool::WorkerLoop() {
+    while (true) {
+        std::shared_ptr<Job> job;
+        {
+            std::unique_lock lock(mutex_);
+            ready_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+            job = std::move(queue_.front());
+            queue_.pop_front();
+        }
+        job->Run();
+    }
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)>& body) {
+    if (count == 0) {
+        return;
+    }
+    auto job = std::make_shared<Job>();
+    job->body = &body;
+    job->count = count;
+    job->resource = MemoryScope::Current();
+    job->shape_epoch = ShapeEpoch::Installed();
+    size_t helpers = std::min(workers_.size(), count - 1);
+    if (helpers > 0) {
+        {
+            std::lock_guard lock(mutex_);
+            for (size_t i = 0; i < helpers; ++i) {
+                queue_.push_back(job);
+            }
+        }
+        ready_.notify_all();
+    }
+    job->Run();
+    std::unique_lock lock(job->mutex);
+    job->done.wait(lock, [&job] { return job->finished == job->count; });
+    if (job->error) {
+        std::rethrow_exception(job->error);
+    }
+}
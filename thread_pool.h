@@ -0,0 +1,47 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Общий пул потоков процесса. Вызывающий поток сам участвует в ParallelFor и ждёт только
+// задачи, которые уже выполняются в пуле, поэтому вложенные вызовы не блокируют друг друга.
+class ThreadPool {
+private:
+    struct Job;
+
+    std::vector<std::thread> workers_;
+    std::deque<std::shared_ptr<Job>> queue_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    bool stop_ = false;
+
+    void WorkerLoop();
+
+public:
+    explicit ThreadPool(size_t threads);
+
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    static ThreadPool& Shared();
+
+    // Подменяет общий пул, nullptr - пул по умолчанию. Пока пул используется, его не меняют
+    static void SetShared(ThreadPool* pool);
+
+    // число потоков, включая вызывающий
+    size_t Concurrency() const {
+        return workers_.size() + 1;
+    }
+
+    // body(i) для всех i из [0, count). Первое исключение пробрасывается вызывающему
+    void ParallelFor(size_t count, const std::function<void(size_t)>& body);
+};
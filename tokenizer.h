@@ -4,6 +4,7 @@
 #include <variant>
 #include <optional>
 #include <istream>
+#include <streambuf>
 #include <cctype>
 
 #include "error.h"
@@ -47,6 +48,15 @@ struct ConstantToken {
 using Token =
     std::variant<ConstantToken, BracketToken, SymbolToken, QuoteToken, QuoteTokenWord, DotToken>;
 
+// Поток над чужим буфером без копирования, для пакетного чтения выражений
+class MemoryBuffer : public std::streambuf {
+public:
+    MemoryBuffer(const char* data, size_t size) {
+        char* begin = const_cast<char*>(data);
+        setg(begin, begin, begin + size);
+    }
+};
+
 class Tokenizer {
     std::istream* in_;
 
@@ -55,16 +65,16 @@ class Tokenizer {
     bool is_end_ = false;
 
     bool StartSymbol(char c) {
-        //        a-zA-Z<=>*#
+        //        a-zA-Z<=>*#_
         return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '<' || c == '=' ||
-               c == '/' || c == '>' || c == '*' || c == '#';
+               c == '/' || c == '>' || c == '*' || c == '#' || c == '_';
     }
 
     bool IsSymbol(char c) {
-        //        a-zA-Z<=>*#0-9?!-
+        //        a-zA-Z<=>*#0-9?!-/_
         return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '<' || c == '=' ||
                c == '>' || c == '*' || c == '#' || ('0' <= c && c <= '9') || c == '?' || c == '!' ||
-               c == '-';
+               c == '-' || c == '/' || c == '_';
     }
 
     bool IsDigit(char c) {
@@ -116,7 +126,16 @@ public:
         } else if (c == '\'') {
             token_ = QuoteToken{};
         } else if (c == '.') {
-            token_ = DotToken{};
+            if (in_->peek() != '.') {
+                token_ = DotToken{};
+            } else {
+                // многоточие в шаблонах syntax-rules
+                in_->get();
+                if (in_->get() != '.') {
+                    throw SyntaxError("tokenizer Next() ..");
+                }
+                token_ = SymbolToken{"..."};
+            }
         } else if (c == '-' || c == '+') {
             if (IsDigit(in_->peek())) {
                 token_ = ConstantToken{ParseNumber() * (c == '-' ? -1 : 1)};
@@ -1,42 +1,113 @@
+#include <algorithm>
+#include <cstddef>
 #include <memory>
 #include <queue>
 #include <vector>
 #include <unordered_set>
 #include <iostream>
+#include <sstream>
 
 #include "types.h"
 #include "functions.h"
 
-template <typename T>
-bool IsType(std::shared_ptr<Type> type) {
-    return bool(std::dynamic_pointer_cast<T>(type));
+std::shared_ptr<Type> Context::Add(const std::string& name, std::shared_ptr<Type> val) {
+    if (parent) {
+        collector->AddLocalName(name);
+    } else if (!collector->IsWorker()) {
+        auto it = var.find(name);
+        if (IsType<Macro>(val) || (it != var.end() && IsType<Macro>(it->second))) {
+            collector->ChangeMacros();
+        }
+    }
+    if (layout) {
+        const auto& names = *layout;
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (names[i] == name) {
+                slots[i] = val;
+                return val;
+            }
+        }
+    }
+    var[name] = val;
+    return val;
 }
 
-template <typename T>
-std::shared_ptr<T> AsType(std::shared_ptr<Type> type) {
-    if (!IsType<T>(type)) {
-        throw RuntimeError("Invalid type in AsType()");
+namespace {
+
+// заголовок перед контекстом: ресурс, из которого он выделен
+constexpr size_t kContextHeader = alignof(std::max_align_t);
+
+}  // namespace
+
+void* Context::operator new(size_t size) {
+    std::pmr::memory_resource* resource = MemoryScope::Current();
+    if (!resource) {
+        resource = std::pmr::new_delete_resource();
     }
-    return std::static_pointer_cast<T>(type);
+    auto block = static_cast<char*>(
+        resource->allocate(size + kContextHeader, alignof(std::max_align_t)));
+    *reinterpret_cast<std::pmr::memory_resource**>(block) = resource;
+    return block + kContextHeader;
+}
+
+void Context::operator delete(void* ptr, size_t size) {
+    auto block = static_cast<char*>(ptr) - kContextHeader;
+    auto resource = *reinterpret_cast<std::pmr::memory_resource**>(block);
+    resource->deallocate(block, size + kContextHeader, alignof(std::max_align_t));
 }
 
 void GarbageCollector::Clear() {
+    auto start = std::chrono::steady_clock::now();
     std::queue<Context*> bfs;
     std::unordered_set<Context*> keep;
-    bfs.push(root_);
-    keep.insert(root_);
+    std::unordered_set<Type*> seen;
+    std::vector<Type*> values;
+    size_t pairs = 0;
+    size_t closures = 0;
+    auto visit = [&](Context* context) {
+        if (context && !keep.contains(context)) {
+            keep.insert(context);
+            bfs.push(context);
+        }
+    };
+    visit(root_);
     while (!bfs.empty()) {
         Context* context = bfs.front();
         bfs.pop();
-        for (auto [v, type_ptr] : context->var) {
-            if (!IsType<Lambda>(type_ptr)) {
+        // контекст лямбды ссылается на родителя, поэтому его тоже нужно сохранить
+        visit(context->parent);
+        for (auto& slot : context->slots) {
+            values.push_back(slot.get());
+        }
+        for (auto& [v, type_ptr] : context->var) {
+            values.push_back(type_ptr.get());
+        }
+        // лямбды могут лежать внутри списков, обходим значения без рекурсии
+        while (!values.empty()) {
+            Type* value = values.back();
+            values.pop_back();
+            if (!value || seen.contains(value)) {
                 continue;
             }
-            auto func_ptr = AsType<Lambda>(type_ptr);
-            Context* next_context = func_ptr->created_context;
-            if (!keep.contains(next_context)) {
-                keep.insert(next_context);
-                bfs.push(next_context);
+            seen.insert(value);
+            if (auto pair = dynamic_cast<Pair*>(value)) {
+                if (!pair->Empty()) {
+                    ++pairs;
+                    values.push_back(pair->GetFirst().get());
+                    values.push_back(pair->PeekSecond());
+                }
+            } else if (auto func_ptr = dynamic_cast<Lambda*>(value)) {
+                ++closures;
+                visit(func_ptr->created_context);
+            } else if (auto memoized = dynamic_cast<Memoized*>(value)) {
+                // в кэше могут лежать замыкания и списки с ними
+                values.push_back(memoized->func.get());
+                for (auto& entry : memoized->entries) {
+                    for (auto& arg : entry.args) {
+                        values.push_back(arg.get());
+                    }
+                    values.push_back(entry.value.get());
+                }
             }
         }
     }
@@ -46,24 +117,282 @@ void GarbageCollector::Clear() {
             new_memory.push_back(std::move(memory_[i]));
         }
     }
-    size_t cleared = memory_.size() - new_memory.size();
-//    if (cleared > 0) {
-//        std::cout << "Cleared: " << cleared << "\n";
-//    }
+    stats_.freed_contexts += memory_.size() - new_memory.size();
     memory_ = std::move(new_memory);
+
+    auto pause = std::chrono::steady_clock::now() - start;
+    ++stats_.collections;
+    collected_at_ = stats_.allocated_frames;
+    stats_.live_pairs = pairs;
+    stats_.live_closures = closures;
+    stats_.last_pause = pause;
+    stats_.max_pause = std::max(stats_.max_pause, stats_.last_pause);
+    stats_.total_pause += pause;
+    double seconds = std::chrono::duration<double>(pause).count();
+    size_t bucket = 0;
+    while (bucket < RuntimeStats::kPauseBuckets.size() &&
+           seconds > RuntimeStats::kPauseBuckets[bucket]) {
+        ++bucket;
+    }
+    ++stats_.pause_buckets[bucket];
+}
+
+void GarbageCollector::Reset() {
+    root_->slots.clear();
+    root_->var.clear();
+    free_frames_.clear();
+    Clear();
+    // кэши UnknownSymbol ссылаются на удалённые ячейки корневого контекста
+    ++global_version_;
+    ++macro_version_;
+}
+
+void GarbageCollector::Adopt(GarbageCollector& worker) {
+    for (auto& context : worker.memory_) {
+        context->collector = this;
+        memory_.push_back(std::move(context));
+    }
+    worker.memory_.clear();
+    for (const auto& name : worker.local_names_) {
+        AddLocalName(name);
+    }
+    stats_.allocated_frames += worker.stats_.allocated_frames;
+    stats_.pooled_frames += worker.stats_.pooled_frames;
+    stats_.allocated_frame_bytes += worker.stats_.allocated_frame_bytes;
+    stats_.max_depth = std::max(stats_.max_depth, worker.stats_.max_depth);
+}
+
+std::string RuntimeStats::ToPrometheus() const {
+    std::ostringstream out;
+    auto metric = [&out](const char* name, const char* type, const char* help, auto value) {
+        out << "# HELP " << name << " " << help << "\n";
+        out << "# TYPE " << name << " " << type << "\n";
+        out << name << " " << value << "\n";
+    };
+    metric("scheme_live_contexts", "gauge", "Environment frames held by the collector.",
+           live_contexts);
+    metric("scheme_live_pairs", "gauge", "Pairs reachable at the last collection.", live_pairs);
+    metric("scheme_live_closures", "gauge", "Closures reachable at the last collection.",
+           live_closures);
+    metric("scheme_allocated_frames_total", "counter", "Environment frames allocated.",
+           allocated_frames);
+    metric("scheme_allocated_frame_bytes_total", "counter",
+           "Bytes of environment frame objects allocated, without slots and name tables.",
+           allocated_frame_bytes);
+    metric("scheme_freed_contexts_total", "counter", "Environment frames freed by the collector.",
+           freed_contexts);
+    metric("scheme_pooled_frames_total", "counter", "Calls served by a pooled frame.",
+           pooled_frames);
+    metric("scheme_parse_cache_hits_total", "counter", "Run calls served by the parse cache.",
+           parse_cache_hits);
+    metric("scheme_parse_cache_misses_total", "counter", "Run calls parsed while caching.",
+           parse_cache_misses);
+    metric("scheme_max_evaluation_depth", "gauge", "Deepest nesting of evaluated applications.",
+           max_depth);
+    metric("scheme_gc_max_pause_seconds", "gauge", "Longest collection pause.",
+           std::chrono::duration<double>(max_pause).count());
+
+    const char* name = "scheme_gc_pause_seconds";
+    out << "# HELP " << name << " Collection pause times.\n";
+    out << "# TYPE " << name << " histogram\n";
+    size_t cumulative = 0;
+    for (size_t i = 0; i < pause_buckets.size(); ++i) {
+        cumulative += pause_buckets[i];
+        out << name << "_bucket{le=\"";
+        if (i < kPauseBuckets.size()) {
+            out << kPauseBuckets[i];
+        } else {
+            out << "+Inf";
+        }
+        out << "\"} " << cumulative << "\n";
+    }
+    out << name << "_sum " << std::chrono::duration<double>(total_pause).count() << "\n";
+    out << name << "_count " << collections << "\n";
+    return out.str();
+}
+
+std::shared_ptr<Type> Function::Call(const std::vector<std::shared_ptr<Type>>& values,
+                                     Context* context) {
+    auto quote = Make<Quote>();
+    std::vector<std::shared_ptr<Type>> arguments(values.size());
+    for (size_t i = 0; i < values.size(); ++i) {
+        arguments[i] = Make<Pair>(quote, values[i]);
+    }
+    return Apply(Pair::MakeList(arguments), context);
+}
+
+namespace {
+
+// начала счётчиков разнесены на 2^40 переходов
+std::atomic<uint64_t> next_shape_epoch = 1;
+
+}  // namespace
+
+thread_local ShapeEpoch* ShapeEpoch::current_ = nullptr;
+
+ShapeEpoch::ShapeEpoch() : value_(next_shape_epoch.fetch_add(uint64_t{1} << 40)) {
+}
+
+ShapeEpoch& ShapeEpoch::Current() {
+    static ShapeEpoch process;
+    return current_ ? *current_ : process;
 }
 
 Pair::Pair(std::shared_ptr<Type> first, std::shared_ptr<Type> second)
     : first_(first), second_(second) {
-    if (!first_ && !second_) {
-        proper_list_ = true;
-        return;
+}
+
+Pair::Pair(std::shared_ptr<Type> first, PairBlock& block)
+    : in_block_(true), first_(std::move(first)), block_(&block) {
+}
+
+Pair::~Pair() {
+    std::shared_ptr<Type> refs[] = {std::move(first_), nullptr};
+    if (!in_block_) {
+        refs[1] = std::move(second_);
+        second_.~shared_ptr();
+    } else if (!cdr_next_ && block_->PeekCdr(this)) {
+        // хвост без рекурсии, как second_ обычной пары
+        refs[1] = std::move(block_->Cdr(this));
+    }
+    ReleaseDeferred(refs);
+}
+
+void Pair::SetSecond(std::shared_ptr<Type> second) {
+    ShapeEpoch& shape_epoch = ShapeEpoch::Current();
+    if (epoch_.load(std::memory_order_relaxed) == shape_epoch.Load()) {
+        shape_epoch.Advance();
+    }
+    cdr_next_ = false;
+    if (in_block_) {
+        block_->Cdr(this) = std::move(second);
+    } else {
+        second_ = std::move(second);
+    }
+}
+
+uint32_t Pair::Shape() {
+    uint64_t epoch = ShapeEpoch::Current().Load();
+    if (epoch_.load(std::memory_order_acquire) == epoch) {
+        return shape_.load(std::memory_order_relaxed);
+    }
+    // ячейки до первой с верным кэшем; медленный указатель path[path.size() / 2] ловит циклы
+    std::vector<Pair*> path;
+    Pair* cell = this;
+    uint32_t shape;
+    while (true) {
+        if (cell->epoch_.load(std::memory_order_acquire) == epoch) {
+            shape = cell->shape_.load(std::memory_order_relaxed);
+            break;
+        }
+        if (cell->Empty()) {
+            shape = 1;
+            cell->SetShape(shape, epoch);
+            break;
+        }
+        path.push_back(cell);
+        auto next = dynamic_cast<Pair*>(cell->PeekSecond());
+        if (!next) {
+            shape = 0;
+            break;
+        }
+        if (next == path[path.size() / 2]) {
+            // цикл: ни одна ячейка пути не начинает собственный список
+            for (Pair* visited : path) {
+                visited->SetShape(0, epoch);
+            }
+            return 0;
+        }
+        cell = next;
+    }
+    for (auto it = path.rbegin(); it != path.rend(); ++it) {
+        shape += 2;
+        (*it)->SetShape(shape, epoch);
+    }
+    return shape;
+}
+
+std::shared_ptr<Type> Pair::MakeList(const std::vector<std::shared_ptr<Type>>& values,
+                                     std::shared_ptr<Type> tail) {
+    std::shared_ptr<Type> result = tail ? tail : EmptyPair();
+    for (auto it = values.rbegin(); it != values.rend(); ++it) {
+        result = Make<Pair>(*it, result);
     }
-    if (IsType<Pair>(second)) {
-        auto pair = AsType<Pair>(second);
-        if (pair->proper_list_) {
-            proper_list_ = true;
+    return result;
+}
+
+std::shared_ptr<Type> Pair::MakeCompactList(const std::vector<std::shared_ptr<Type>>& values,
+                                            std::shared_ptr<Type> tail) {
+    if (values.empty()) {
+        return tail ? tail : EmptyPair();
+    }
+    // форма известна сразу: хвост уже построен
+    uint32_t shape = 1;
+    if (tail) {
+        shape = IsType<Pair>(tail) ? AsType<Pair>(tail)->Shape() : 0;
+    }
+    uint64_t epoch = ShapeEpoch::Current().Load();
+    // пустой список в конце тоже лежит в блоке
+    auto block = Make<PairBlock>(values.size() + (tail ? 0 : 1));
+    for (const auto& value : values) {
+        block->Add(value).cdr_next_ = true;
+    }
+    if (tail) {
+        Pair& last = block->cells[block->size - 1];
+        last.cdr_next_ = false;
+        block->tail = std::move(tail);
+    } else {
+        block->Add(nullptr).SetShape(shape, epoch);
+    }
+    for (size_t i = values.size(); i-- > 0;) {
+        shape += 2;
+        block->cells[i].SetShape(shape, epoch);
+    }
+    return std::shared_ptr<Pair>(block, block->cells);
+}
+
+std::shared_ptr<Type> Pair::CopyData(const std::shared_ptr<Type>& value) {
+    if (!IsType<Pair>(value)) {
+        return value;
+    }
+    // копируемые списки от внешнего к вложенному: текущая ячейка и скопированные элементы
+    struct Level {
+        Pair* cell;
+        std::vector<std::shared_ptr<Type>> values;
+    };
+    std::vector<Level> levels;
+    levels.push_back({static_cast<Pair*>(value.get()), {}});
+    // готовая копия car текущей ячейки верхнего уровня
+    std::shared_ptr<Type> copy;
+    while (true) {
+        Level& level = levels.back();
+        if (copy) {
+            level.values.push_back(std::move(copy));
+            auto next = dynamic_cast<Pair*>(level.cell->PeekSecond());
+            if (!next) {
+                copy = MakeCompactList(level.values, level.cell->GetSecond());
+                levels.pop_back();
+                if (levels.empty()) {
+                    return copy;
+                }
+                continue;
+            }
+            level.cell = next;
+        }
+        if (level.cell->Empty()) {
+            copy = MakeCompactList(level.values);
+            levels.pop_back();
+            if (levels.empty()) {
+                return copy;
+            }
+            continue;
         }
+        auto first = level.cell->GetFirst();
+        if (IsType<Pair>(first)) {
+            levels.push_back({static_cast<Pair*>(first.get()), {}});
+            continue;
+        }
+        copy = std::move(first);
     }
 }
 
@@ -71,7 +400,8 @@ std::string Pair::Repr() {
     if (Empty()) {
         return "()";
     }
-    std::shared_ptr<Pair> curr = AsType<Pair>(shared_from_this());
+    // ячейки блока списка не связаны с shared_from_this, поэтому обход по сырым указателям
+    Pair* curr = this;
     std::string result = "(";
     while (true) {
         if (curr->Empty()) {
@@ -79,12 +409,18 @@ std::string Pair::Repr() {
             return result;
         }
         result += curr->first_->Repr();
-        if (IsType<Pair>(curr->second_)) {
+        if (curr->cdr_next_) {
+            result += " ";
+            ++curr;
+            continue;
+        }
+        Type* second = curr->PeekSecond();
+        if (auto next = dynamic_cast<Pair*>(second)) {
             result += " ";
-            curr = AsType<Pair>(curr->second_);
+            curr = next;
         } else {
             result += " . ";
-            result += curr->second_->Repr();
+            result += second->Repr();
             result += ")";
             return result;
         }
@@ -95,7 +431,8 @@ std::shared_ptr<Type> Pair::Evaluate(Context* context) {
     if (Empty()) {
         throw RuntimeError("Evaluate empty list ()");
     }
-    return AsType<Function>(first_->Evaluate(context))->Apply(second_, context);
+    GarbageCollector::DepthGuard guard(context->collector);
+    return AsType<Function>(first_->Evaluate(context))->Apply(GetSecond(), context);
 }
 
 UnknownSymbol::UnknownSymbol(std::string name) : name(std::move(name)) {
@@ -106,5 +443,17 @@ std::string UnknownSymbol::Repr() {
 }
 
 std::shared_ptr<Type> UnknownSymbol::Evaluate(Context* context) {
-    return context->Get(name);
+    GarbageCollector* collector = context->collector->Owner();
+    if (cache_owner == collector && cache_version == collector->GlobalVersion()) {
+        return *cache_cell;
+    }
+    std::shared_ptr<Type>& cell = context->Get(name);
+    // имя нигде не связано локально, значит ячейка лежит в корневом контексте.
+    // Потоки pmap кэш не заполняют
+    if (context->collector == collector && !collector->IsLocalName(name)) {
+        cache_owner = collector;
+        cache_version = collector->GlobalVersion();
+        cache_cell = &cell;
+    }
+    return cell;
 }
@@ -1,13 +1,20 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <memory>
+#include <new>
 #include <queue>
+#include <string>
 #include <vector>
 #include <unordered_map>
 #include <unordered_set>
 
 #include "object.h"
 #include "error.h"
+#include "memory.h"
 
 struct Context;
 
@@ -24,7 +31,16 @@ struct Type : public std::enable_shared_from_this<Type> {
 struct Context {
     GarbageCollector* collector = nullptr;
     Context* parent = nullptr;
+    // Кадр лямбды: значения параметров и внутренних define лежат в slots по раскладке layout
+    // (см. LambdaCode::layout), пустой слот - define ещё не выполнялся. var - глобальные имена и
+    // имена вне раскладки
+    std::shared_ptr<const std::vector<std::string>> layout;
+    std::vector<std::shared_ptr<Type>> slots;
     std::unordered_map<std::string, std::shared_ptr<Type>> var;
+    // кадр из пула вызовов (см. GarbageCollector::Frame); escaped - на него ссылается замыкание,
+    // и после возврата кадр переходит к сборщику
+    bool pooled = false;
+    bool escaped = false;
 
     Context(GarbageCollector* collector) : collector(collector) {
     }
@@ -33,23 +49,97 @@ struct Context {
     }
 
     Context(const Context& other)
-        : collector(other.collector), parent(other.parent), var(other.var) {
+        : collector(other.collector),
+          parent(other.parent),
+          layout(other.layout),
+          slots(other.slots),
+          var(other.var) {
     }
 
-    std::shared_ptr<Type> Add(const std::string& name, std::shared_ptr<Type> val) {
-        var[name] = val;
-        return val;
+    // Контекст выделяется из текущего ресурса (см. MemoryScope), ресурс запоминается перед
+    // объектом: кадр может освободиться уже вне области ресурса
+    static void* operator new(size_t size);
+
+    static void operator delete(void* ptr, size_t size);
+
+    std::shared_ptr<Type> Add(const std::string& name, std::shared_ptr<Type> val);
+
+    // ячейка имени в этом кадре, nullptr - имя здесь не связано
+    std::shared_ptr<Type>* Find(const std::string& name) {
+        if (layout) {
+            const auto& names = *layout;
+            for (size_t i = 0; i < names.size(); ++i) {
+                if (names[i] == name) {
+                    if (slots[i]) {
+                        return &slots[i];
+                    }
+                    break;
+                }
+            }
+        }
+        if (var.empty()) {
+            return nullptr;
+        }
+        auto it = var.find(name);
+        return it == var.end() ? nullptr : &it->second;
     }
 
-    std::shared_ptr<Type>& Get(const std::string& name) {
-        if (!var.contains(name)) {
-            if (!parent) {
-                throw NameError("Get() got unknown name");
+    // ячейка имени в этом кадре или выше, nullptr - имя не связано. Не бросает исключений
+    std::shared_ptr<Type>* Lookup(const std::string& name) {
+        for (Context* context = this; context; context = context->parent) {
+            if (auto cell = context->Find(name)) {
+                return cell;
             }
-            return parent->Get(name);  // Get(name);
         }
-        return var[name];
+        return nullptr;
     }
+
+    std::shared_ptr<Type>& Get(const std::string& name) {
+        if (auto cell = Lookup(name)) {
+            return *cell;
+        }
+        throw NameError("Get() got unknown name");
+    }
+};
+
+// Счётчики рантайма. live_pairs и live_closures - достижимые объекты на момент последней сборки
+struct RuntimeStats {
+    // границы корзин гистограммы пауз сборщика, в секундах
+    static constexpr std::array<double, 6> kPauseBuckets = {1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1};
+
+    size_t live_contexts = 0;
+    size_t live_pairs = 0;
+    size_t live_closures = 0;
+    // кадры окружения, выделенные сборщиком, и их байты (sizeof(Context), без слотов и таблицы
+    // имён). Остальные объекты не считаются, см. Interpreter::MemoryUsed
+    size_t allocated_frames = 0;
+    size_t allocated_frame_bytes = 0;
+    size_t freed_contexts = 0;
+    // вызовы, кадр которых взят из пула и не попал к сборщику
+    size_t pooled_frames = 0;
+    // Interpreter::Run: выражения, взятые из кэша разбора, и промахи (см. SetParseCacheSize)
+    size_t parse_cache_hits = 0;
+    size_t parse_cache_misses = 0;
+    size_t collections = 0;
+    size_t max_depth = 0;
+    std::chrono::nanoseconds last_pause{0};
+    std::chrono::nanoseconds max_pause{0};
+    std::chrono::nanoseconds total_pause{0};
+    // последняя корзина - +Inf
+    std::array<size_t, kPauseBuckets.size() + 1> pause_buckets{};
+
+    std::string ToPrometheus() const;
+};
+
+// Бюджет шагов вычисления, см. Interpreter::Run(str, fuel). Шаг - вызов лямбды или итерация
+// цикла (do, именованный let). Когда топливо кончилось, Refuel пополняет его или бросает
+// исключение
+struct FuelTank {
+    size_t fuel = 0;
+
+    virtual ~FuelTank() = default;
+
+    virtual void Refuel() = 0;
 };
 
 class GarbageCollector {
@@ -57,21 +147,191 @@ private:
     std::vector<std::unique_ptr<Context>> memory_;
     Context* root_;
 
+    RuntimeStats stats_;
+    size_t depth_ = 0;
+
+    // имена, которые хоть раз связывались не в корневом контексте (параметры и внутренние define)
+    std::unordered_set<std::string> local_names_;
+    uint64_t global_version_ = 0;
+    uint64_t macro_version_ = 0;
+
+    // владелец глобальной таблицы: сам сборщик или сборщик интерпретатора для потоков pmap
+    GarbageCollector* owner_ = this;
+
+    // allocated_frames на момент последней сборки
+    size_t collected_at_ = 0;
+
+    // свободные кадры вызовов, см. Frame
+    std::vector<std::unique_ptr<Context>> free_frames_;
+
+    // топливо вычисления, nullptr - без бюджета. У сборщиков потоков pmap его нет
+    FuelTank* fuel_ = nullptr;
+
+    Context* AcquireFrame(Context* parent) {
+        ++stats_.pooled_frames;
+        if (free_frames_.empty()) {
+            auto frame = new Context(parent);
+            frame->collector = this;
+            frame->pooled = true;
+            return frame;
+        }
+        Context* frame = free_frames_.back().release();
+        free_frames_.pop_back();
+        frame->parent = parent;
+        return frame;
+    }
+
+    void ReleaseFrame(Context* frame) {
+        if (!frame->escaped) {
+            // раскладка остаётся: следующий вызов той же функции не трогает счётчик ссылок
+            frame->slots.clear();
+            frame->var.clear();
+            free_frames_.emplace_back(frame);
+            return;
+        }
+        --stats_.pooled_frames;
+        frame->pooled = false;
+        frame->escaped = false;
+        memory_.emplace_back(frame);
+        ++stats_.allocated_frames;
+        stats_.allocated_frame_bytes += sizeof(Context);
+    }
+
 public:
     GarbageCollector() : root_(new Context(this)) {
         memory_.emplace_back(root_);
     }
 
+    // Сборщик рабочего потока: свои контексты, а глобальная таблица и кэши - владельца.
+    // Владелец не вычисляет ничего, пока работают потоки, поэтому кэши только читаются
+    explicit GarbageCollector(GarbageCollector* owner) : GarbageCollector() {
+        owner_ = owner;
+    }
+
     Context* GetRoot() {
         return root_;
     }
 
+    GarbageCollector* Owner() const {
+        return owner_;
+    }
+
+    // сборщик рабочего потока pmap
+    bool IsWorker() const {
+        return owner_ != this;
+    }
+
     Context* Allocate(Context* parent) {
         memory_.emplace_back(new Context(parent));
+        memory_.back()->collector = this;
+        ++stats_.allocated_frames;
+        stats_.allocated_frame_bytes += sizeof(Context);
         return memory_.back().get();
     }
 
     void Clear();
+
+    // Удаляет все глобальные имена и все контексты, кроме корневого, вместе с пулом кадров
+    void Reset();
+
+    // сколько контекстов выделено с последней сборки
+    size_t AllocatedSinceClear() const {
+        return stats_.allocated_frames - collected_at_;
+    }
+
+    // забрать контексты и локальные имена рабочего сборщика после параллельного участка
+    void Adopt(GarbageCollector& worker);
+
+    // Версия глобальной таблицы для кэшей UnknownSymbol. Ячейки корневого контекста не
+    // перемещаются и не удаляются, поэтому define и set! существующего имени видны через кэш
+    // сразу. Кэш устаревает, только когда имя впервые становится локальным и может затенить
+    // глобальное.
+    uint64_t GlobalVersion() const {
+        return global_version_;
+    }
+
+    bool IsLocalName(const std::string& name) const {
+        return local_names_.contains(name);
+    }
+
+    void AddLocalName(const std::string& name) {
+        if (local_names_.insert(name).second) {
+            ++global_version_;
+        }
+    }
+
+    // Версия набора глобальных макросов для разобранных деревьев кэша разбора: растёт, когда
+    // глобальное имя становится макросом или перестаёт им быть
+    uint64_t MacroVersion() const {
+        return macro_version_;
+    }
+
+    void ChangeMacros() {
+        ++macro_version_;
+    }
+
+    void CountParse(bool cache_hit) {
+        ++(cache_hit ? stats_.parse_cache_hits : stats_.parse_cache_misses);
+    }
+
+    void SetFuel(FuelTank* fuel) {
+        fuel_ = fuel;
+    }
+
+    bool HasFuel() const {
+        return fuel_;
+    }
+
+    // шаг вычисления; при пустом баке управление получает FuelTank::Refuel
+    void ChargeStep() {
+        if (fuel_) {
+            if (fuel_->fuel == 0) {
+                fuel_->Refuel();
+            }
+            --fuel_->fuel;
+        }
+    }
+
+    RuntimeStats GetStats() const {
+        RuntimeStats stats = stats_;
+        stats.live_contexts = memory_.size();
+        return stats;
+    }
+
+    // Кадр вызова функции, тело которой не создаёт замыканий (см. Lambda::Call). Кадр берётся из
+    // пула, не попадает в memory_ и возвращается в пул при выходе из вызова, в том числе по
+    // исключению. Если замыкание всё же захватило кадр (например, макрос раскрылся в lambda во
+    // время вычисления), кадр передаётся сборщику
+    struct Frame {
+        GarbageCollector* collector;
+        Context* context;
+
+        Frame(GarbageCollector* collector, Context* parent)
+            : collector(collector), context(collector->AcquireFrame(parent)) {
+        }
+
+        Frame(const Frame&) = delete;
+        Frame& operator=(const Frame&) = delete;
+
+        ~Frame() {
+            collector->ReleaseFrame(context);
+        }
+    };
+
+    // глубина вложенности вычислений, см. Pair::Evaluate
+    struct DepthGuard {
+        GarbageCollector* collector;
+
+        DepthGuard(GarbageCollector* collector) : collector(collector) {
+            if (++collector->depth_ > collector->stats_.max_depth) {
+                collector->stats_.max_depth = collector->depth_;
+            }
+        }
+
+        ~DepthGuard() {
+            --collector->depth_;
+        }
+    };
 };
 
 struct Function : public Type {
@@ -80,6 +340,11 @@ public:
 
     virtual std::shared_ptr<Type> Apply(std::shared_ptr<Type> arguments, Context* context) = 0;
 
+    // вызов с уже вычисленными аргументами. По умолчанию аргументы оборачиваются в quote и
+    // передаются в Apply, функции с быстрым путём переопределяют этот метод
+    virtual std::shared_ptr<Type> Call(const std::vector<std::shared_ptr<Type>>& values,
+                                       Context* context);
+
     virtual std::shared_ptr<Type> Evaluate(Context*) override {
         return shared_from_this();
     }
@@ -129,15 +394,99 @@ public:
     }
 };
 
+// Эпоха кэшей формы списков (см. Pair). Счётчик свой у каждого интерпретатора, поэтому set-cdr!
+// в одном изоляте не сбрасывает кэши других. Scope делает счётчик текущим для потока на время
+// вычисления, потоки pmap получают счётчик вызывающего (см. ThreadPool::Job)
+class ShapeEpoch {
+private:
+    static thread_local ShapeEpoch* current_;
+
+    std::atomic<uint64_t> value_;
+
+public:
+    // счётчики начинаются с разных значений: ячейка, чей кэш заполнен под чужим счётчиком,
+    // просто считается устаревшей
+    ShapeEpoch();
+
+    ShapeEpoch(const ShapeEpoch&) = delete;
+    ShapeEpoch& operator=(const ShapeEpoch&) = delete;
+
+    uint64_t Load() const {
+        return value_.load(std::memory_order_acquire);
+    }
+
+    void Advance() {
+        value_.fetch_add(1, std::memory_order_acq_rel);
+    }
+
+    // счётчик потока; вне вычисления - общий для процесса
+    static ShapeEpoch& Current();
+
+    // nullptr - счётчик не задан
+    static ShapeEpoch* Installed() {
+        return current_;
+    }
+
+    class Scope {
+    private:
+        ShapeEpoch* previous_;
+
+    public:
+        explicit Scope(ShapeEpoch* epoch) : previous_(current_) {
+            current_ = epoch;
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        ~Scope() {
+            current_ = previous_;
+        }
+    };
+};
+
+struct PairBlock;
+
 class Pair : public Type {
 private:
-    bool proper_list_ = false;
+    // Длина и собственность списка, начинающегося с ячейки, вычисляются лениво и верны, пока
+    // эпоха ShapeEpoch::Current() == epoch_. set-cdr! ячейки с верным кэшем увеличивает эпоху,
+    // и кэши всех ячеек устаревают. Если кэш ячейки устарел, то устарели и кэши всех ячеек, из
+    // которых она достижима, поэтому set-cdr! такой ячейки эпоху не трогает. Кэш заполняют и
+    // потоки pmap (все вычисляют одно и то же), поэтому поля атомарные
+    std::atomic<uint64_t> epoch_ = 0;
+    // длина << 1 | собственный список; длина имеет смысл только у собственного списка
+    std::atomic<uint32_t> shape_ = 0;
+    // Ячейка блока (см. MakeCompactList) хранит вместо cdr указатель на блок. Её cdr - следующая
+    // ячейка блока (cdr_next_) или, у последней ячейки и после set-cdr!, PairBlock::Cdr
+    bool in_block_ = false;
+    bool cdr_next_ = false;
     std::shared_ptr<Type> first_;
-    std::shared_ptr<Type> second_;
+    union {
+        std::shared_ptr<Type> second_;
+        PairBlock* block_;
+    };
+
+    friend struct PairBlock;
+
+    Pair(std::shared_ptr<Type> first, PairBlock& block);
+
+    std::shared_ptr<Type> NextInBlock();
+
+    // форма списка, при необходимости обновляет кэши ячеек до первой ячейки с верным кэшем
+    uint32_t Shape();
+
+    void SetShape(uint32_t shape, uint64_t epoch) {
+        shape_.store(shape, std::memory_order_relaxed);
+        epoch_.store(epoch, std::memory_order_release);
+    }
 
 public:
     Pair(std::shared_ptr<Type> first, std::shared_ptr<Type> second);
 
+    // без рекурсии по длине списка, см. ReleaseDeferred (object.h)
+    ~Pair() override;
+
     std::string Repr() override;
 
     std::shared_ptr<Type> Evaluate(Context*) override;
@@ -149,36 +498,152 @@ public:
         return first_;
     }
 
-    std::shared_ptr<Type> GetSecond() {
-        if (!second_) {
-            throw RuntimeError("second=nullptr");
-        }
-        return second_;
-    }
+    std::shared_ptr<Type> GetSecond();
 
     void SetFirst(std::shared_ptr<Type> first) {
         first_ = first;
     }
 
-    void SetSecond(std::shared_ptr<Type> second) {
-        second_ = second;
-    }
+    void SetSecond(std::shared_ptr<Type> second);
 
     bool ProperList() {
-        return proper_list_;
+        return Shape() & 1;
+    }
+
+    // число пар в списке, для собственного списка - его длина
+    size_t Length() {
+        return Shape() >> 1;
     }
 
     bool Empty() {
         return !first_;
     }
 
+    // cdr без копирования shared_ptr, для обходов списка, который держит вызывающий
+    Type* PeekSecond();
+
+    // shared_ptr на эту ячейку, в том числе на ячейку блока
+    std::shared_ptr<Pair> Self();
+
     static std::shared_ptr<Pair> EmptyPair() {
-        return std::make_shared<Pair>(nullptr, nullptr);
+        return Make<Pair>(nullptr, nullptr);
+    }
+
+    // список из values, последний cdr - tail (по умолчанию пустой список)
+    static std::shared_ptr<Type> MakeList(const std::vector<std::shared_ptr<Type>>& values,
+                                          std::shared_ptr<Type> tail = nullptr);
+
+    // То же, но ячейки лежат подряд в одном блоке и не хранят cdr: список занимает меньше
+    // памяти, а обход идёт по памяти последовательно. Для данных (list, map, литералы в quote);
+    // код строится через MakeList, потому что переход к cdr ячейки блока дороже
+    static std::shared_ptr<Type> MakeCompactList(const std::vector<std::shared_ptr<Type>>& values,
+                                                 std::shared_ptr<Type> tail = nullptr);
+
+    // Копия структуры пар value в компактных списках, атомы общие. Без рекурсии: так
+    // копируются и ключи memoize, вложенность которых не ограничена. value без циклов
+    static std::shared_ptr<Type> CopyData(const std::shared_ptr<Type>& value);
+};
+
+// Ячейки списка, созданного Pair::MakeCompactList. Ссылка на любую ячейку держит весь блок
+struct PairBlock : public std::enable_shared_from_this<PairBlock> {
+    size_t capacity;
+    size_t size = 0;
+    std::pmr::memory_resource* resource;
+    Pair* cells;
+    // cdr последней ячейки: хвост несобственного списка
+    std::shared_ptr<Type> tail;
+    // cdr остальных ячеек после set-cdr!, по номеру ячейки. Выделяется при первом set-cdr!
+    // ячейки блока, то есть вне потоков pmap
+    std::shared_ptr<Type>* cdrs = nullptr;
+
+    explicit PairBlock(size_t capacity)
+        : capacity(capacity),
+          resource(MemoryScope::Current() ? MemoryScope::Current()
+                                          : std::pmr::new_delete_resource()),
+          cells(static_cast<Pair*>(resource->allocate(capacity * sizeof(Pair), alignof(Pair)))) {
+    }
+
+    PairBlock(const PairBlock&) = delete;
+    PairBlock& operator=(const PairBlock&) = delete;
+
+    ~PairBlock() {
+        for (size_t i = 0; i < size; ++i) {
+            cells[i].~Pair();
+        }
+        if (cdrs) {
+            std::destroy_n(cdrs, capacity);
+            resource->deallocate(cdrs, capacity * sizeof(*cdrs), alignof(std::shared_ptr<Type>));
+        }
+        resource->deallocate(cells, capacity * sizeof(Pair), alignof(Pair));
+    }
+
+    Pair& Add(std::shared_ptr<Type> first) {
+        auto cell = new (cells + size) Pair(std::move(first), *this);
+        ++size;
+        return *cell;
+    }
+
+    // cdr ячейки, которая не ссылается на следующую ячейку блока
+    std::shared_ptr<Type>& Cdr(const Pair* cell) {
+        size_t index = cell - cells;
+        if (index + 1 == size) {
+            return tail;
+        }
+        if (!cdrs) {
+            cdrs = static_cast<std::shared_ptr<Type>*>(resource->allocate(
+                capacity * sizeof(*cdrs), alignof(std::shared_ptr<Type>)));
+            std::uninitialized_value_construct_n(cdrs, capacity);
+        }
+        return cdrs[index];
+    }
+
+    Type* PeekCdr(const Pair* cell) const {
+        size_t index = cell - cells;
+        if (index + 1 == size) {
+            return tail.get();
+        }
+        return cdrs ? cdrs[index].get() : nullptr;
     }
 };
 
+inline std::shared_ptr<Type> Pair::NextInBlock() {
+    return std::shared_ptr<Pair>(block_->shared_from_this(), this + 1);
+}
+
+inline std::shared_ptr<Type> Pair::GetSecond() {
+    if (cdr_next_) {
+        return NextInBlock();
+    }
+    if (!PeekSecond()) {
+        throw RuntimeError("second=nullptr");
+    }
+    return in_block_ ? block_->Cdr(this) : second_;
+}
+
+inline Type* Pair::PeekSecond() {
+    if (!in_block_) {
+        return second_.get();
+    }
+    return cdr_next_ ? this + 1 : block_->PeekCdr(this);
+}
+
+inline std::shared_ptr<Pair> Pair::Self() {
+    if (in_block_) {
+        return std::shared_ptr<Pair>(block_->shared_from_this(), this);
+    }
+    return std::static_pointer_cast<Pair>(shared_from_this());
+}
+
 struct UnknownSymbol : public Type {
     std::string name;
+    // номер раскрытия макроса, шаблон которого ввёл символ; 0 - символ из исходного текста.
+    // См. MacroExpander: параметры лямбд с ненулевой меткой переименовываются
+    uint64_t mark = 0;
+
+    // кэш глобальной ячейки, см. GarbageCollector::GlobalVersion
+    GarbageCollector* cache_owner = nullptr;
+    uint64_t cache_version = 0;
+    std::shared_ptr<Type>* cache_cell = nullptr;
 
     UnknownSymbol(std::string name);
 
@@ -188,7 +653,14 @@ struct UnknownSymbol : public Type {
 };
 
 template <typename T>
-bool IsType(std::shared_ptr<Type> type);
+bool IsType(std::shared_ptr<Type> type) {
+    return bool(std::dynamic_pointer_cast<T>(type));
+}
 
 template <typename T>
-std::shared_ptr<T> AsType(std::shared_ptr<Type> type);
+std::shared_ptr<T> AsType(std::shared_ptr<Type> type) {
+    if (!IsType<T>(type)) {
+        throw RuntimeError("Invalid type in AsType()");
+    }
+    return std::static_pointer_cast<T>(type);
+}